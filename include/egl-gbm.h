@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef EGL_GBM_H
+#define EGL_GBM_H
+
+/*
+ * Entry points of the NVIDIA EGL GBM platform library beyond the EGL external
+ * platform interface.
+ *
+ * libEGL has no way to forward these, so applications look them up in the
+ * library that is already loaded, by its soname, and with the symbol version
+ * below:
+ *
+ *     void* lib = dlopen("libnvidia-egl-gbm.so.1", RTLD_LAZY | RTLD_NOLOAD);
+ *     PFNEGLGBMSURFACEGETBUFFERDAMAGEPROC getDamage = lib ?
+ *         dlvsym(lib, "eGbmSurfaceGetBufferDamage", EGL_GBM_SYMBOL_VERSION) :
+ *         NULL;
+ *
+ * A NULL result means the loaded library doesn't implement the entry point,
+ * in which case applications should behave as if it failed.
+ *
+ * Entry points are only ever added, under a new symbol version, so the
+ * version an entry point was introduced with keeps working.
+ */
+
+#include <stdint.h>
+#include <EGL/egl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gbm_surface;
+struct gbm_bo;
+
+/*
+ * The symbol versions the entry points below were introduced with. Those not
+ * marked otherwise are part of EGL_GBM_SYMBOL_VERSION.
+ */
+#define EGL_GBM_SYMBOL_VERSION "EGL_GBM_1"
+#define EGL_GBM_SYMBOL_VERSION_2 "EGL_GBM_2"
+
+/*
+ * int eGbmSurfaceGetBufferDamage(struct gbm_surface* s,
+ *                                struct gbm_bo* bo,
+ *                                int32_t* rects,
+ *                                int maxRects);
+ *
+ * Returns the damage of <bo>, which must currently be locked from <s>,
+ * relative to the buffer locked before it: up to <maxRects> rectangles are
+ * written to <rects> as x, y, width and height relative to the top-left
+ * corner, the same convention as the KMS FB_DAMAGE_CLIPS property. Returns
+ * the number of rectangles written, or -1 if the whole buffer has to be
+ * considered damaged.
+ */
+typedef int (*PFNEGLGBMSURFACEGETBUFFERDAMAGEPROC)(struct gbm_surface* s,
+                                                   struct gbm_bo* bo,
+                                                   int32_t* rects,
+                                                   int maxRects);
+
+/*
+ * int eGbmSurfaceGetBufferFence(struct gbm_surface* s,
+ *                               struct gbm_bo* bo,
+ *                               int* fenceFd);
+ *
+ * For surfaces created with EGL_SYNC_NATIVE_FENCE_ANDROID set to EGL_TRUE,
+ * stores a new file descriptor referring to the native fence that signals
+ * when rendering to <bo>, which must currently be locked from <s>, completes
+ * in <fenceFd>. The caller owns the file descriptor. -1 is stored if
+ * rendering had already completed when the buffer was locked. The fence
+ * remains available until the buffer is released.
+ *
+ * Returns 0 on success, or a negative errno value on failure, in which case
+ * <fenceFd> is left unchanged.
+ */
+typedef int (*PFNEGLGBMSURFACEGETBUFFERFENCEPROC)(struct gbm_surface* s,
+                                                  struct gbm_bo* bo,
+                                                  int* fenceFd);
+
+/*
+ * EGLSurface eGbmCreateOffscreenSurface(EGLDisplay dpy,
+ *                                       EGLConfig config,
+ *                                       uint32_t width,
+ *                                       uint32_t height,
+ *                                       uint32_t format,
+ *                                       const EGLAttrib* attribs,
+ *                                       struct gbm_surface** buffers);
+ *
+ * Introduced with EGL_GBM_SYMBOL_VERSION_2.
+ *
+ * Creates a surface for offscreen rendering on <dpy>, a display of the GBM
+ * platform, whose color buffers are GBM buffer objects of <format> that can
+ * be exported as dma-bufs without copying. <config> and <attribs> are
+ * interpreted as by eglCreatePlatformWindowSurface. On success, a gbm_surface
+ * owned by the returned EGLSurface is stored in <buffers>: each call to
+ * eglSwapBuffers hands a frame to it, which the application takes with
+ * gbm_surface_lock_front_buffer and gives back with
+ * gbm_surface_release_buffer, exactly as for a window surface. The
+ * gbm_surface must not be used once the EGLSurface has been destroyed with
+ * eglDestroySurface.
+ *
+ * Returns EGL_NO_SURFACE and sets the EGL error on failure, in which case
+ * <buffers> is left unchanged.
+ */
+typedef EGLSurface (*PFNEGLGBMCREATEOFFSCREENSURFACEPROC)(
+    EGLDisplay dpy,
+    EGLConfig config,
+    uint32_t width,
+    uint32_t height,
+    uint32_t format,
+    const EGLAttrib* attribs,
+    struct gbm_surface** buffers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EGL_GBM_H */
@@ -7,18 +7,22 @@
 #include "gbm-display.h"
 #include "gbm-utils.h"
 #include "gbm-surface.h"
+#include "gbm-image.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <pthread.h>
 #include <gbm.h>
 #include <gbmint.h>
 #include <xf86drm.h>
+#include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
 #if !defined(O_CLOEXEC)
@@ -33,11 +37,13 @@
 #endif
 #endif
 
+#define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
+
 static bool
-CheckDevicePath(const GbmPlatformData* data,
-                EGLDeviceEXT dev,
-                EGLenum pathEnum,
-                dev_t gbmDev)
+GetDevicePathRdev(const GbmPlatformData* data,
+                  EGLDeviceEXT dev,
+                  EGLenum pathEnum,
+                  dev_t* rdev)
 {
     struct stat statbuf;
     const char *devPath;
@@ -49,21 +55,135 @@ CheckDevicePath(const GbmPlatformData* data,
     memset(&statbuf, 0, sizeof(statbuf));
     if (stat(devPath, &statbuf)) return false;
 
-    if (memcmp(&statbuf.st_rdev, &gbmDev, sizeof(gbmDev))) return false;
+    *rdev = statbuf.st_rdev;
 
     return true;
 }
 
+/*
+ * (Re)build the cache of EGLDevices and the device numbers of their DRM
+ * device files. Must be called with the platform data mutex held.
+ */
+static void
+BuildDeviceCacheLocked(GbmPlatformData* data)
+{
+    GbmDeviceCacheEntry* entries = NULL;
+    EGLDeviceEXT* devs = NULL;
+    GbmExtensionSet devExts;
+    EGLint maxDevs, numDevs;
+    EGLint numEntries = 0;
+    int i;
+
+    free(data->devices.entries);
+    data->devices.entries = NULL;
+    data->devices.numEntries = 0;
+    data->devices.initialized = false;
+
+    if (data->egl.QueryDevicesEXT(0, NULL, &maxDevs) != EGL_TRUE) goto done;
+
+    if (maxDevs <= 0) goto done;
+
+    devs = malloc(maxDevs * sizeof(*devs));
+    entries = calloc(maxDevs, sizeof(*entries));
+
+    if (!devs || !entries) {
+        eGbmSetError(data, EGL_BAD_ALLOC);
+        free(entries);
+        goto done;
+    }
+
+    if (data->egl.QueryDevicesEXT(maxDevs, devs, &numDevs) != EGL_TRUE) {
+        free(entries);
+        goto done;
+    }
+
+    for (i = 0; i < numDevs; i++) {
+        GbmDeviceCacheEntry* entry = &entries[numEntries];
+
+        devExts =
+            eGbmParseExtensions(data->egl.QueryDeviceStringEXT(devs[i],
+                                                               EGL_EXTENSIONS));
+
+        if (!eGbmHasExtension(devExts, EXT_device_drm)) continue;
+
+        entry->dev = devs[i];
+        entry->hasPrimary = GetDevicePathRdev(data,
+                                              devs[i],
+                                              EGL_DRM_DEVICE_FILE_EXT,
+                                              &entry->primary);
+
+        if (eGbmHasExtension(devExts, EXT_device_drm_render_node)) {
+            entry->hasRender = GetDevicePathRdev(data,
+                                                 devs[i],
+                                                 EGL_DRM_RENDER_NODE_FILE_EXT,
+                                                 &entry->render);
+        }
+
+        if (entry->hasPrimary || entry->hasRender) numEntries++;
+    }
+
+    data->devices.entries = entries;
+    data->devices.numEntries = numEntries;
+    data->devices.initialized = true;
+
+done:
+    free(devs);
+}
+
+static EGLDeviceEXT
+FindCachedDeviceLocked(const GbmPlatformData* data, dev_t rdev)
+{
+    const GbmDeviceCacheEntry* entry;
+    EGLint i;
+
+    for (i = 0; i < data->devices.numEntries; i++) {
+        entry = &data->devices.entries[i];
+
+        if ((entry->hasPrimary &&
+             !memcmp(&entry->primary, &rdev, sizeof(rdev))) ||
+            (entry->hasRender &&
+             !memcmp(&entry->render, &rdev, sizeof(rdev)))) {
+            return entry->dev;
+        }
+    }
+
+    return EGL_NO_DEVICE_EXT;
+}
+
+/*
+ * Returns the EGLDevice whose DRM device file or render node has the device
+ * number <rdev>, if any.
+ */
+static EGLDeviceEXT
+FindDeviceByRdev(GbmPlatformData* data, dev_t rdev)
+{
+    EGLDeviceEXT dev = EGL_NO_DEVICE_EXT;
+
+    pthread_mutex_lock(&data->mutex);
+
+    if (data->devices.initialized)
+        dev = FindCachedDeviceLocked(data, rdev);
+
+    if (dev == EGL_NO_DEVICE_EXT) {
+        /*
+         * Either this is the first lookup, or the device wasn't known yet.
+         * Enumerate the devices again in the latter case in case the set of
+         * available devices changed.
+         */
+        BuildDeviceCacheLocked(data);
+        dev = FindCachedDeviceLocked(data, rdev);
+    }
+
+    pthread_mutex_unlock(&data->mutex);
+
+    return dev;
+}
+
 static EGLDeviceEXT
 FindGbmDevice(GbmPlatformData* data, struct gbm_device* gbm)
 {
-    EGLDeviceEXT* devs = NULL;
-    const char* devExts;
     struct stat statbuf;
-    EGLDeviceEXT dev = EGL_NO_DEVICE_EXT;
-    EGLint maxDevs, numDevs;
     int gbmFd = gbm_device_get_fd(gbm);
-    int i;
 
     if (gbmFd < 0) {
         /*
@@ -74,84 +194,475 @@ FindGbmDevice(GbmPlatformData* data, struct gbm_device* gbm)
          * available, then EGL_NO_DISPLAY is returned; no error condition is
          * raised in this case."
          */
-        goto done;
+        return EGL_NO_DEVICE_EXT;
     }
 
     memset(&statbuf, 0, sizeof(statbuf));
-    if (fstat(gbmFd, &statbuf)) goto done;
+    if (fstat(gbmFd, &statbuf)) return EGL_NO_DEVICE_EXT;
 
-    if (data->egl.QueryDevicesEXT(0, NULL, &maxDevs) != EGL_TRUE) goto done;
+    return FindDeviceByRdev(data, statbuf.st_rdev);
+}
 
-    if (maxDevs <= 0) goto done;
+/* Returns the device number of <device>'s render node or DRM device file */
+static bool
+GetDrmDeviceRdev(const drmDevice* device, dev_t* rdev)
+{
+    static const int nodes[] = { DRM_NODE_RENDER, DRM_NODE_PRIMARY };
+    struct stat statbuf;
+    unsigned int i;
 
-    devs = malloc(maxDevs * sizeof(*devs));
+    for (i = 0; i < ARRAY_LEN(nodes); i++) {
+        if (!(device->available_nodes & (1 << nodes[i]))) continue;
 
-    if (!devs) {
-        eGbmSetError(data, EGL_BAD_ALLOC);
-        goto done;
+        memset(&statbuf, 0, sizeof(statbuf));
+        if (!stat(device->nodes[nodes[i]], &statbuf)) {
+            *rdev = statbuf.st_rdev;
+            return true;
+        }
     }
 
-    if (data->egl.QueryDevicesEXT(maxDevs, devs, &numDevs) != EGL_TRUE)
-        goto done;
+    return false;
+}
 
-    for (i = 0; i < numDevs; i++) {
-        devExts = data->egl.QueryDeviceStringEXT(devs[i], EGL_EXTENSIONS);
+/*
+ * Returns the EGLDevice named by <name>, which is either the path of a DRM
+ * device file or render node, or a PCI bus ID of the form
+ * "domain:bus:device.function" as printed by lspci -D.
+ */
+static EGLDeviceEXT
+FindNamedDevice(GbmPlatformData* data, const char* name)
+{
+    EGLDeviceEXT dev = EGL_NO_DEVICE_EXT;
+    drmDevicePtr* devices = NULL;
+    unsigned int domain, bus, slot, func;
+    struct stat statbuf;
+    int numDevices = 0;
+    dev_t rdev;
+    int i;
 
-        if (!eGbmFindExtension("EGL_EXT_device_drm", devExts)) continue;
+    if (name[0] == '/') {
+        memset(&statbuf, 0, sizeof(statbuf));
+        if (stat(name, &statbuf)) return EGL_NO_DEVICE_EXT;
 
-        if (CheckDevicePath(data,
-                            devs[i],
-                            EGL_DRM_DEVICE_FILE_EXT,
-                            statbuf.st_rdev)) {
-            dev = devs[i];
-            break;
-        }
+        return FindDeviceByRdev(data, statbuf.st_rdev);
+    }
+
+    if (sscanf(name, "%x:%x:%x.%x", &domain, &bus, &slot, &func) != 4)
+        return EGL_NO_DEVICE_EXT;
+
+    numDevices = drmGetDevices2(0, NULL, 0);
+
+    if (numDevices <= 0) return EGL_NO_DEVICE_EXT;
+
+    devices = calloc(numDevices, sizeof(*devices));
+
+    if (!devices) return EGL_NO_DEVICE_EXT;
+
+    numDevices = drmGetDevices2(0, devices, numDevices);
+
+    for (i = 0; i < numDevices; i++) {
+        const drmDevice* device = devices[i];
 
-        if (!eGbmFindExtension("EGL_EXT_device_drm_render_node", devExts))
+        if (device->bustype != DRM_BUS_PCI ||
+            device->businfo.pci->domain != domain ||
+            device->businfo.pci->bus != bus ||
+            device->businfo.pci->dev != slot ||
+            device->businfo.pci->func != func) {
             continue;
+        }
 
-        if (CheckDevicePath(data,
-                            devs[i],
-                            EGL_DRM_RENDER_NODE_FILE_EXT,
-                            statbuf.st_rdev)) {
-            dev = devs[i];
+        if (GetDrmDeviceRdev(device, &rdev)) {
+            dev = FindDeviceByRdev(data, rdev);
             break;
         }
     }
 
-done:
-    free(devs);
+    if (numDevices > 0) drmFreeDevices(devices, numDevices);
+    free(devices);
 
     return dev;
+}
+
+static bool
+IsKnownDeviceLocked(const GbmPlatformData* data, EGLDeviceEXT dev)
+{
+    EGLint i;
+
+    for (i = 0; i < data->devices.numEntries; i++) {
+        if (data->devices.entries[i].dev == dev) return true;
+    }
+
+    return false;
+}
+
+static bool
+IsKnownDevice(GbmPlatformData* data, EGLDeviceEXT dev)
+{
+    bool known;
+
+    pthread_mutex_lock(&data->mutex);
+
+    known = data->devices.initialized && IsKnownDeviceLocked(data, dev);
+
+    if (!known) {
+        BuildDeviceCacheLocked(data);
+        known = IsKnownDeviceLocked(data, dev);
+    }
+
+    pthread_mutex_unlock(&data->mutex);
+
+    return known;
+}
+
+/*
+ * Returns the EGLDevice to render with if the application selected one with
+ * the EGL_DEVICE_EXT display attribute, or the user selected one with the
+ * EGL_GBM_RENDER_DEVICE environment variable. <*dev> is set to
+ * EGL_NO_DEVICE_EXT if neither was done, in which case rendering happens on
+ * the device backing the GBM device. Returns false if the selected device
+ * doesn't exist.
+ */
+static bool
+SelectRenderDevice(GbmPlatformData* data,
+                   const EGLAttrib* attribs,
+                   EGLDeviceEXT* dev)
+{
+    const char* name = getenv("EGL_GBM_RENDER_DEVICE");
+    size_t i;
+
+    *dev = EGL_NO_DEVICE_EXT;
+
+    for (i = 0; attribs && attribs[i] != EGL_NONE; i += 2) {
+        if (attribs[i] == EGL_DEVICE_EXT) {
+            *dev = (EGLDeviceEXT)attribs[i + 1];
+
+            if (*dev == EGL_NO_DEVICE_EXT || !IsKnownDevice(data, *dev)) {
+                eGbmSetError(data, EGL_BAD_DEVICE_EXT);
+                return false;
+            }
+
+            return true;
+        }
+    }
+
+    if (name && name[0]) {
+        *dev = FindNamedDevice(data, name);
+
+        /*
+         * This is a user error rather than an application error, so just
+         * return EGL_NO_DISPLAY as with any other display that isn't
+         * available.
+         */
+        return *dev != EGL_NO_DEVICE_EXT;
+    }
+
+    return true;
+}
+
+static int
+OpenDrmDevice(const drmDevice* device)
+{
+    int fd = -1;
+
+    if (device->available_nodes & (1 << DRM_NODE_RENDER))
+        fd = open(device->nodes[DRM_NODE_RENDER], O_RDWR | O_CLOEXEC);
+
+    if ((fd < 0) && (device->available_nodes & (1 << DRM_NODE_PRIMARY)))
+        fd = open(device->nodes[DRM_NODE_PRIMARY], O_RDWR | O_CLOEXEC);
+
+    return fd;
+}
+
+/*
+ * Returns true if <device> is the PCI device the firmware initialized the
+ * console on, according to sysfs.
+ */
+static bool
+IsBootVgaDevice(const drmDevice* device)
+{
+    const drmPciBusInfo* pci;
+    char path[64];
+    char value = 0;
+    int fd;
+
+    if (device->bustype != DRM_BUS_PCI) return false;
+
+    pci = device->businfo.pci;
+    snprintf(path, sizeof(path),
+             "/sys/bus/pci/devices/%04x:%02x:%02x.%u/boot_vga",
+             pci->domain, pci->bus, pci->dev, pci->func);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) return false;
+
+    if (read(fd, &value, 1) != 1) value = 0;
 
+    close(fd);
+
+    return value == '1';
 }
 
+/*
+ * Opens the DRM device to use for EGL_DEFAULT_DISPLAY: the first DRM device
+ * that is backed by an EGLDevice, falling back to the first DRM device that
+ * can be opened if there is none.
+ *
+ * If <scanout> is true, rendering happens on a separately selected device,
+ * so the GBM device is only used to display the results. That is the job of
+ * the boot display, so it is preferred if it is backed by an EGLDevice.
+ */
 static int
-OpenDefaultDrmDevice(void)
+OpenDefaultDrmDevice(GbmPlatformData* data, bool scanout)
 {
-    drmDevicePtr devices[1];
-    int numDevices = drmGetDevices2(0, devices, 1);
+    drmDevicePtr* devices = NULL;
+    bool* known = NULL;
+    int numDevices = drmGetDevices2(0, NULL, 0);
     int fd = -1;
+    dev_t rdev;
+    int i, pass;
 
-    if (numDevices == 0)
+    if (numDevices <= 0)
         return -1;
 
-    if (devices[0]->nodes[DRM_NODE_RENDER])
-        fd = open(devices[0]->nodes[DRM_NODE_RENDER], O_RDWR | O_CLOEXEC);
+    devices = calloc(numDevices, sizeof(*devices));
+    known = calloc(numDevices, sizeof(*known));
+
+    if (!devices || !known)
+        goto done;
+
+    numDevices = drmGetDevices2(0, devices, numDevices);
+
+    /*
+     * Match all devices in one go, so that the EGLDevices are enumerated
+     * again at most once if the cache is missing some.
+     */
+    pthread_mutex_lock(&data->mutex);
+
+    for (pass = data->devices.initialized ? 0 : 1; pass < 2; pass++) {
+        bool found = false;
+
+        if (pass == 1) BuildDeviceCacheLocked(data);
 
-    if ((fd < 0) && devices[0]->nodes[DRM_NODE_PRIMARY])
-        fd = open(devices[0]->nodes[DRM_NODE_PRIMARY], O_RDWR | O_CLOEXEC);
+        for (i = 0; i < numDevices; i++) {
+            known[i] = GetDrmDeviceRdev(devices[i], &rdev) &&
+                FindCachedDeviceLocked(data, rdev) != EGL_NO_DEVICE_EXT;
+            found = found || known[i];
+        }
+
+        if (found) break;
+    }
+
+    pthread_mutex_unlock(&data->mutex);
+
+    for (i = 0; scanout && i < numDevices && fd < 0; i++) {
+        if (known[i] && IsBootVgaDevice(devices[i]))
+            fd = OpenDrmDevice(devices[i]);
+    }
 
-    drmFreeDevices(devices, 1);
+    for (i = 0; i < numDevices && fd < 0; i++) {
+        if (known[i]) fd = OpenDrmDevice(devices[i]);
+    }
+
+    for (i = 0; i < numDevices && fd < 0; i++)
+        fd = OpenDrmDevice(devices[i]);
+
+done:
+    if (numDevices > 0 && devices) drmFreeDevices(devices, numDevices);
+    free(devices);
+    free(known);
 
     return fd;
 }
 
+static void
+FlushChooseConfigCache(GbmDisplay* display)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&display->mutex);
+
+    for (i = 0; i < MAX_CHOOSE_CONFIG_CACHE_ENTRIES; i++) {
+        free(display->chooseConfigCache.entries[i].attribs);
+        free(display->chooseConfigCache.entries[i].configs);
+    }
+
+    memset(&display->chooseConfigCache, 0,
+           sizeof(display->chooseConfigCache));
+
+    pthread_mutex_unlock(&display->mutex);
+}
+
+/*
+ * Returns all configs matching the attribute list <attribs>, which contains
+ * <nAttribs> values including the terminating EGL_NONE, in a newly allocated
+ * array. Results are cached per display, since they only depend on the
+ * attribute list until the display is terminated.
+ */
+static EGLBoolean
+ChooseAllConfigs(GbmDisplay* display,
+                 const EGLint* attribs,
+                 EGLint nAttribs,
+                 EGLConfig** configsOut,
+                 EGLint* numConfigsOut)
+{
+    GbmChooseConfigCacheEntry* entries = display->chooseConfigCache.entries;
+    GbmChooseConfigCacheEntry* entry = NULL;
+    EGLConfig* configs = NULL;
+    EGLint* attribsCopy = NULL;
+    EGLint numConfigs = 0;
+    unsigned int i;
+
+    pthread_mutex_lock(&display->mutex);
+
+    for (i = 0; i < MAX_CHOOSE_CONFIG_CACHE_ENTRIES; i++) {
+        if (entries[i].attribs && entries[i].nAttribs == nAttribs &&
+            !memcmp(entries[i].attribs, attribs,
+                    nAttribs * sizeof(*attribs))) {
+            entry = &entries[i];
+            break;
+        }
+    }
+
+    if (entry) {
+        numConfigs = entry->numConfigs;
+        configs = malloc((numConfigs ? numConfigs : 1) * sizeof(*configs));
+
+        if (configs) {
+            memcpy(configs, entry->configs, numConfigs * sizeof(*configs));
+            entry->lastUse = ++display->chooseConfigCache.clock;
+        }
+
+        pthread_mutex_unlock(&display->mutex);
+
+        if (!configs) {
+            eGbmSetObjectError(&display->base, EGL_BAD_ALLOC);
+            return EGL_FALSE;
+        }
+
+        *configsOut = configs;
+        *numConfigsOut = numConfigs;
+        return EGL_TRUE;
+    }
+
+    pthread_mutex_unlock(&display->mutex);
+
+    if (!display->data->egl.ChooseConfig(display->devDpy,
+                                         attribs,
+                                         NULL,
+                                         0,
+                                         &numConfigs)) {
+        return EGL_FALSE;
+    }
+
+    configs = malloc((numConfigs ? numConfigs : 1) * sizeof(*configs));
+
+    if (!configs) {
+        eGbmSetObjectError(&display->base, EGL_BAD_ALLOC);
+        return EGL_FALSE;
+    }
+
+    if (numConfigs &&
+        !display->data->egl.ChooseConfig(display->devDpy,
+                                         attribs,
+                                         configs,
+                                         numConfigs,
+                                         &numConfigs)) {
+        free(configs);
+        return EGL_FALSE;
+    }
+
+    *configsOut = configs;
+    *numConfigsOut = numConfigs;
+
+    /* Failing to cache the result isn't an error */
+    attribsCopy = malloc(nAttribs * sizeof(*attribsCopy));
+    configs = malloc((numConfigs ? numConfigs : 1) * sizeof(*configs));
+
+    if (!attribsCopy || !configs) {
+        free(attribsCopy);
+        free(configs);
+        return EGL_TRUE;
+    }
+
+    memcpy(attribsCopy, attribs, nAttribs * sizeof(*attribs));
+    memcpy(configs, *configsOut, numConfigs * sizeof(*configs));
+
+    pthread_mutex_lock(&display->mutex);
+
+    /* Replace the least recently used entry */
+    entry = &entries[0];
+    for (i = 1; i < MAX_CHOOSE_CONFIG_CACHE_ENTRIES; i++) {
+        if (entries[i].lastUse < entry->lastUse) entry = &entries[i];
+    }
+
+    free(entry->attribs);
+    free(entry->configs);
+    entry->attribs = attribsCopy;
+    entry->nAttribs = nAttribs;
+    entry->configs = configs;
+    entry->numConfigs = numConfigs;
+    entry->lastUse = ++display->chooseConfigCache.clock;
+
+    pthread_mutex_unlock(&display->mutex);
+
+    return EGL_TRUE;
+}
+
+static size_t
+CountAttribs(const EGLAttrib* attribs)
+{
+    size_t n = 0;
+
+    if (!attribs) return 0;
+
+    while (attribs[n] != EGL_NONE) n += 2;
+
+    return n;
+}
+
+/*
+ * Returns the display previously created for <nativeDpy> with an identical
+ * attribute list, if any. Must be called with the platform data mutex held.
+ */
+static GbmDisplay*
+FindDisplayLocked(GbmPlatformData* data,
+                  void* nativeDpy,
+                  const EGLAttrib* attribs)
+{
+    size_t nAttribs = CountAttribs(attribs);
+    GbmDisplay* display;
+
+    for (display = data->displays; display; display = display->nextDisplay) {
+        if (display->nativeDpy == nativeDpy &&
+            display->nAttribs == nAttribs &&
+            (!nAttribs ||
+             !memcmp(display->attribs, attribs,
+                     nAttribs * sizeof(*attribs)))) {
+            return display;
+        }
+    }
+
+    return NULL;
+}
+
 static void
 FreeDisplay(GbmObject* obj)
 {
     if (obj) {
         GbmDisplay* display = (GbmDisplay*)obj;
+        GbmDisplay** link;
+        int i;
+
+        pthread_mutex_lock(&display->data->mutex);
+        for (link = &display->data->displays; *link;
+             link = &(*link)->nextDisplay) {
+            if (*link == display) {
+                *link = display->nextDisplay;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&display->data->mutex);
 
         /*
          * The device file is only opened when the display is
@@ -163,89 +674,342 @@ FreeDisplay(GbmObject* obj)
             close(display->fd);
         }
 
-        free(obj);
+        FlushChooseConfigCache(display);
+        eGbmFlushImageCache(display);
+        eGbmFlushSurfacePool(display);
+        for (i = 0; i < display->scanoutModifiers.numEntries; i++)
+            free(display->scanoutModifiers.entries[i].modifiers);
+        pthread_mutex_destroy(&display->mutex);
+        free(display->configFormats);
+        free(display->attribs);
+        free(obj);
+    }
+}
+
+EGLDisplay
+eGbmGetPlatformDisplayExport(void *dataVoid,
+                             EGLenum platform,
+                             void *nativeDpy,
+                             const EGLAttrib *attribs)
+{
+    static const EGLAttrib refAttrs[] = {
+        EGL_TRACK_REFERENCES_KHR, EGL_TRUE,
+        EGL_NONE
+    };
+    GbmPlatformData* data = dataVoid;
+    GbmDisplay* display = NULL;
+    GbmDisplay* existing;
+    const EGLAttrib *attrs =
+        eGbmHasExtension(data->clientExts, KHR_display_reference) ?
+        refAttrs : NULL;
+    size_t nAttribs = CountAttribs(attribs);
+    EGLDeviceEXT renderDev;
+
+    if (platform != EGL_PLATFORM_GBM_KHR) {
+        eGbmSetError(data, EGL_BAD_PARAMETER);
+        return EGL_NO_DISPLAY;
+    }
+
+    /*
+     * From the EGL 1.5 spec:
+     *
+     * "Multiple calls made to eglGetPlatformDisplay with the same parameters
+     * will return the same EGLDisplay handle."
+     */
+    pthread_mutex_lock(&data->mutex);
+    existing = FindDisplayLocked(data, nativeDpy, attribs);
+    pthread_mutex_unlock(&data->mutex);
+
+    if (existing) return (EGLDisplay)existing;
+
+    display = calloc(1, sizeof(*display));
+
+    if (!display) {
+        eGbmSetError(data, EGL_BAD_ALLOC);
+        return EGL_NO_DISPLAY;
+    }
+
+    if (pthread_mutex_init(&display->mutex, NULL)) {
+        free(display);
+        eGbmSetError(data, EGL_BAD_ALLOC);
+        return EGL_NO_DISPLAY;
+    }
+
+    display->base.dpy = display;
+    display->base.type = EGL_OBJECT_DISPLAY_KHR;
+    display->base.refCount = 1;
+    display->base.free = FreeDisplay;
+    display->data = data;
+    display->fd = -1;
+    display->gbm = nativeDpy;
+    display->nativeDpy = nativeDpy;
+
+    if (nAttribs) {
+        display->attribs = malloc(nAttribs * sizeof(*attribs));
+
+        if (!display->attribs) {
+            eGbmSetError(data, EGL_BAD_ALLOC);
+            goto fail;
+        }
+
+        memcpy(display->attribs, attribs, nAttribs * sizeof(*attribs));
+        display->nAttribs = nAttribs;
+    }
+
+    if (!SelectRenderDevice(data, attribs, &renderDev)) goto fail;
+
+    if (nativeDpy == EGL_DEFAULT_DISPLAY) {
+        display->fd = OpenDefaultDrmDevice(data,
+                                           renderDev != EGL_NO_DEVICE_EXT);
+        if (display->fd < 0) goto fail;
+        if (!(display->gbm = gbm_create_device(display->fd))) goto fail;
+    }
+
+    if (data->ptr_gbm_device_get_backend_name != NULL) {
+        const char *name = data->ptr_gbm_device_get_backend_name(display->gbm);
+        if (name == NULL || strcmp(name, "nvidia") != 0) {
+            /*
+             * This is not an NVIDIA device. Return failure, so that libglvnd
+             * can move on to the next driver. That applies even when
+             * rendering on a selected device: window surfaces need the
+             * surface functions of the GBM device, and those of another
+             * driver belong to its own EGL implementation.
+             */
+            goto fail;
+        }
+    }
+
+    display->dev = FindGbmDevice(data, display->gbm);
+
+    if (renderDev != EGL_NO_DEVICE_EXT) {
+        /*
+         * Buffers rendered on another device are shared with the GBM device
+         * through PRIME, which requires a layout both devices understand.
+         */
+        display->prime = (display->dev != renderDev);
+        display->dev = renderDev;
+    } else if (display->dev == EGL_NO_DEVICE_EXT) {
+        /* FindGbmDevice() sets an appropriate EGL error on failure */
+        goto fail;
+    }
+
+    display->devDpy =
+        display->data->egl.GetPlatformDisplay(EGL_PLATFORM_DEVICE_EXT,
+                                              display->dev,
+                                              attrs);
+
+    if (display->devDpy == EGL_NO_DISPLAY) {
+        /* GetPlatformDisplay will set an appropriate error */
+        goto fail;
+    }
+
+    pthread_mutex_lock(&data->mutex);
+
+    /* Another thread may have created the same display in the meantime */
+    existing = FindDisplayLocked(data, nativeDpy, attribs);
+
+    if (!existing) {
+        if (!eGbmAddObject(&display->base)) {
+            pthread_mutex_unlock(&data->mutex);
+            eGbmSetError(data, EGL_BAD_ALLOC);
+            goto fail;
+        }
+
+        display->nextDisplay = data->displays;
+        data->displays = display;
+    }
+
+    pthread_mutex_unlock(&data->mutex);
+
+    if (existing) {
+        FreeDisplay(&display->base);
+        return (EGLDisplay)existing;
+    }
+
+    return (EGLDisplay)display;
+
+fail:
+    FreeDisplay(&display->base);
+    return EGL_NO_DISPLAY;
+}
+
+/*
+ * Maps EGLConfig color component sizes and types to DRM fourcc formats.
+ *
+ * EGL exposes no attribute describing the order of the color components in
+ * memory, so each layout maps to the single format listed for it. Formats
+ * with the opposite red/blue order are not accepted as native visual IDs:
+ * the driver would still render in the listed order, and the buffers handed
+ * to the application would be mislabeled.
+ */
+static const struct {
+    EGLint r, g, b, a;
+    EGLint componentType;
+    uint32_t fourcc;
+} ConfigFormatMap[] = {
+    { 8, 8, 8, 0, EGL_COLOR_COMPONENT_TYPE_FIXED_EXT,
+      DRM_FORMAT_XRGB8888 },
+    { 8, 8, 8, 8, EGL_COLOR_COMPONENT_TYPE_FIXED_EXT,
+      DRM_FORMAT_ARGB8888 },
+    { 5, 6, 5, 0, EGL_COLOR_COMPONENT_TYPE_FIXED_EXT,
+      DRM_FORMAT_RGB565 },
+    { 10, 10, 10, 0, EGL_COLOR_COMPONENT_TYPE_FIXED_EXT,
+      DRM_FORMAT_XRGB2101010 },
+    { 10, 10, 10, 2, EGL_COLOR_COMPONENT_TYPE_FIXED_EXT,
+      DRM_FORMAT_ARGB2101010 },
+    /* Older drm_fourcc.h versions lack the half float formats */
+#ifdef DRM_FORMAT_XBGR16161616F
+    { 16, 16, 16, 0, EGL_COLOR_COMPONENT_TYPE_FLOAT_EXT,
+      DRM_FORMAT_XBGR16161616F },
+#endif
+#ifdef DRM_FORMAT_ABGR16161616F
+    { 16, 16, 16, 16, EGL_COLOR_COMPONENT_TYPE_FLOAT_EXT,
+      DRM_FORMAT_ABGR16161616F },
+#endif
+};
+
+static uint32_t ConfigToDrmFourCC(GbmDisplay* display, EGLConfig config)
+{
+    EGLDisplay dpy = display->devDpy;
+    EGLint r, g, b, a;
+    EGLint componentType = EGL_COLOR_COMPONENT_TYPE_FIXED_EXT;
+    EGLBoolean ret = EGL_TRUE;
+    unsigned int i;
+
+    ret &= display->data->egl.GetConfigAttrib(dpy,
+                                              config,
+                                              EGL_RED_SIZE,
+                                              &r);
+    ret &= display->data->egl.GetConfigAttrib(dpy,
+                                              config,
+                                              EGL_GREEN_SIZE,
+                                              &g);
+    ret &= display->data->egl.GetConfigAttrib(dpy,
+                                              config,
+                                              EGL_BLUE_SIZE,
+                                              &b);
+    ret &= display->data->egl.GetConfigAttrib(dpy,
+                                              config,
+                                              EGL_ALPHA_SIZE,
+                                              &a);
+
+    if (eGbmHasExtension(display->exts, EXT_pixel_format_float)) {
+        ret &= display->data->egl.GetConfigAttrib(dpy,
+                                                  config,
+                                                  EGL_COLOR_COMPONENT_TYPE_EXT,
+                                                  &componentType);
+    }
+
+    if (!ret) {
+        /*
+         * The only reason this could fail is some internal error in the
+         * platform library code or if the application terminated the display
+         * in another thread while this code was running. In either case,
+         * behave as if there is no DRM fourcc format associated with this
+         * config.
+         */
+        return 0; /* DRM_FORMAT_INVALID */
+    }
+
+    for (i = 0; i < sizeof(ConfigFormatMap) / sizeof(ConfigFormatMap[0]); i++) {
+        if (ConfigFormatMap[i].r == r &&
+            ConfigFormatMap[i].g == g &&
+            ConfigFormatMap[i].b == b &&
+            ConfigFormatMap[i].a == a &&
+            ConfigFormatMap[i].componentType == componentType) {
+            return ConfigFormatMap[i].fourcc;
+        }
     }
+
+    return 0; /* DRM_FORMAT_INVALID */
 }
 
-EGLDisplay
-eGbmGetPlatformDisplayExport(void *dataVoid,
-                             EGLenum platform,
-                             void *nativeDpy,
-                             const EGLAttrib *attribs)
+static int
+ConfigFormatCompar(const void* a, const void* b)
 {
-    static const EGLAttrib refAttrs[] = {
-        EGL_TRACK_REFERENCES_KHR, EGL_TRUE,
-        EGL_NONE
-    };
-    GbmPlatformData* data = dataVoid;
-    GbmDisplay* display = NULL;
-    const EGLAttrib *attrs = data->supportsDisplayReference ? refAttrs : NULL;
-
-    (void)attribs;
+    const GbmConfigFormat* fmtA = a;
+    const GbmConfigFormat* fmtB = b;
 
-    if (platform != EGL_PLATFORM_GBM_KHR) {
-        eGbmSetError(data, EGL_BAD_PARAMETER);
-        return EGL_NO_DISPLAY;
-    }
+    if (fmtA->config == fmtB->config) return 0;
 
-    display = calloc(1, sizeof(*display));
+    return ((uintptr_t)fmtA->config < (uintptr_t)fmtB->config) ? -1 : 1;
+}
 
-    if (!display) {
-        eGbmSetError(data, EGL_BAD_ALLOC);
-        return EGL_NO_DISPLAY;
+/*
+ * Build the table used to map EGLConfigs to DRM fourcc formats, so that
+ * looking up a config's native visual doesn't need to query its attributes
+ * from the driver each time.
+ */
+static void
+BuildConfigFormats(GbmDisplay* display)
+{
+    GbmPlatformData* data = display->data;
+    GbmConfigFormatTable* table;
+    GbmConfigFormatTable* expected = NULL;
+    EGLConfig* configs;
+    EGLint numConfigs = 0;
+    EGLint i;
+
+    if (__atomic_load_n(&display->configFormats, __ATOMIC_ACQUIRE)) return;
+
+    if (!data->egl.GetConfigs(display->devDpy, NULL, 0, &numConfigs) ||
+        numConfigs <= 0) {
+        return;
     }
 
-    display->base.dpy = display;
-    display->base.type = EGL_OBJECT_DISPLAY_KHR;
-    display->base.refCount = 1;
-    display->base.free = FreeDisplay;
-    display->data = data;
-    display->fd = -1;
-    display->gbm = nativeDpy;
-
-    if (nativeDpy == EGL_DEFAULT_DISPLAY) {
-        if ((display->fd = OpenDefaultDrmDevice()) < 0) goto fail;
-        if (!(display->gbm = gbm_create_device(display->fd))) goto fail;
+    configs = malloc(numConfigs * sizeof(*configs));
+    table = malloc(sizeof(*table) + numConfigs * sizeof(table->formats[0]));
+
+    if (!configs || !table ||
+        !data->egl.GetConfigs(display->devDpy,
+                              configs,
+                              numConfigs,
+                              &numConfigs)) {
+        /* Not fatal. Lookups will fall back to querying the driver. */
+        free(configs);
+        free(table);
+        return;
     }
 
-    if (data->ptr_gbm_device_get_backend_name != NULL) {
-        const char *name = data->ptr_gbm_device_get_backend_name(display->gbm);
-        if (name == NULL || strcmp(name, "nvidia") != 0) {
-            /*
-             * This is not an NVIDIA device. Return failure, so that libglvnd can
-             * move on to the next driver.
-             */
-            goto fail;
-        }
+    for (i = 0; i < numConfigs; i++) {
+        table->formats[i].config = configs[i];
+        table->formats[i].fourcc = ConfigToDrmFourCC(display, configs[i]);
     }
 
-    display->dev = FindGbmDevice(data, display->gbm);
+    table->numFormats = numConfigs;
+    free(configs);
 
-    if (display->dev == EGL_NO_DEVICE_EXT) {
-        /* FindGbmDevice() sets an appropriate EGL error on failure */
-        goto fail;
+    qsort(table->formats, table->numFormats, sizeof(table->formats[0]),
+          ConfigFormatCompar);
+
+    /* Another thread may have initialized the display at the same time */
+    if (!__atomic_compare_exchange_n(&display->configFormats,
+                                     &expected,
+                                     table,
+                                     false,
+                                     __ATOMIC_RELEASE,
+                                     __ATOMIC_RELAXED)) {
+        free(table);
     }
+}
 
-    display->devDpy =
-        display->data->egl.GetPlatformDisplay(EGL_PLATFORM_DEVICE_EXT,
-                                              display->dev,
-                                              attrs);
+static uint32_t
+GetConfigFourCC(GbmDisplay* display, EGLConfig config)
+{
+    GbmConfigFormatTable* table =
+        __atomic_load_n(&display->configFormats, __ATOMIC_ACQUIRE);
+    GbmConfigFormat key;
+    GbmConfigFormat* fmt;
 
-    if (display->devDpy == EGL_NO_DISPLAY) {
-        /* GetPlatformDisplay will set an appropriate error */
-        goto fail;
-    }
+    if (table) {
+        key.config = config;
+        fmt = bsearch(&key, table->formats, table->numFormats,
+                      sizeof(table->formats[0]), ConfigFormatCompar);
 
-    if (!eGbmAddObject(&display->base)) {
-        eGbmSetError(data, EGL_BAD_ALLOC);
-        goto fail;
+        if (fmt) return fmt->fourcc;
     }
 
-    return (EGLDisplay)display;
-
-fail:
-    FreeDisplay(&display->base);
-    return EGL_NO_DISPLAY;
+    return ConfigToDrmFourCC(display, config);
 }
 
 EGLBoolean
@@ -253,7 +1017,7 @@ eGbmInitializeHook(EGLDisplay dpy, EGLint* major, EGLint* minor)
 {
     GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
     GbmPlatformData* data;
-    const char* exts;
+    GbmExtensionSet exts;
     EGLBoolean res;
 
     if (!display) {
@@ -267,20 +1031,24 @@ eGbmInitializeHook(EGLDisplay dpy, EGLint* major, EGLint* minor)
 
     if (!res) goto done;
 
-    exts = data->egl.QueryString(display->devDpy, EGL_EXTENSIONS);
+    exts = eGbmParseExtensions(data->egl.QueryString(display->devDpy,
+                                                     EGL_EXTENSIONS));
 
-    if (!exts ||
-        !eGbmFindExtension("EGL_KHR_stream", exts) ||
-        !eGbmFindExtension("EGL_KHR_stream_producer_eglsurface", exts) ||
-        !eGbmFindExtension("EGL_KHR_image_base", exts) ||
-        !eGbmFindExtension("EGL_NV_stream_consumer_eglimage", exts) ||
-        !eGbmFindExtension("EGL_MESA_image_dma_buf_export", exts) ||
-        !eGbmFindExtension("EGL_EXT_sync_reuse", exts)) {
+    if (!eGbmHasExtension(exts, KHR_stream) ||
+        !eGbmHasExtension(exts, KHR_stream_producer_eglsurface) ||
+        !eGbmHasExtension(exts, KHR_image_base) ||
+        !eGbmHasExtension(exts, NV_stream_consumer_eglimage) ||
+        !eGbmHasExtension(exts, MESA_image_dma_buf_export) ||
+        !eGbmHasExtension(exts, EXT_sync_reuse)) {
         data->egl.Terminate(display->devDpy);
-        eGbmSetError(data, EGL_NOT_INITIALIZED);
+        eGbmSetObjectError(&display->base, EGL_NOT_INITIALIZED);
         res = EGL_FALSE;
     }
 
+    display->exts = res ? exts : 0;
+
+    if (res) BuildConfigFormats(display);
+
     display->gbm->v0.surface_lock_front_buffer = eGbmSurfaceLockFrontBuffer;
     display->gbm->v0.surface_release_buffer = eGbmSurfaceReleaseBuffer;
     display->gbm->v0.surface_has_free_buffers = eGbmSurfaceHasFreeBuffers;
@@ -301,6 +1069,10 @@ eGbmTerminateHook(EGLDisplay dpy)
         return EGL_FALSE;
     }
 
+    FlushChooseConfigCache(display);
+    eGbmFlushImageCache(display);
+    eGbmFlushSurfacePool(display);
+
     res = display->data->egl.Terminate(display->devDpy);
 
     eGbmUnrefObject(&display->base);
@@ -319,6 +1091,10 @@ eGbmQueryStringExport(void *data,
     case EGL_EXT_PLATFORM_PLATFORM_CLIENT_EXTENSIONS:
         return "EGL_KHR_platform_gbm EGL_MESA_platform_gbm";
 
+    case EGL_EXT_PLATFORM_DISPLAY_EXTENSIONS:
+        /* gbm_bos can be imported as EGL_NATIVE_PIXMAP_KHR images */
+        return "EGL_KHR_image_pixmap";
+
     default:
         break;
     }
@@ -375,61 +1151,6 @@ done:
     return res;
 }
 
-static uint32_t ConfigToDrmFourCC(GbmDisplay* display, EGLConfig config)
-{
-    EGLDisplay dpy = display->devDpy;
-    EGLint r, g, b, a;
-    EGLBoolean ret = EGL_TRUE;
-
-    ret &= display->data->egl.GetConfigAttrib(dpy,
-                                              config,
-                                              EGL_RED_SIZE,
-                                              &r);
-    ret &= display->data->egl.GetConfigAttrib(dpy,
-                                              config,
-                                              EGL_GREEN_SIZE,
-                                              &g);
-    ret &= display->data->egl.GetConfigAttrib(dpy,
-                                              config,
-                                              EGL_BLUE_SIZE,
-                                              &b);
-    ret &= display->data->egl.GetConfigAttrib(dpy,
-                                              config,
-                                              EGL_ALPHA_SIZE,
-                                              &a);
-
-    if (!ret) {
-        /*
-         * The only reason this could fail is some internal error in the
-         * platform library code or if the application terminated the display
-         * in another thread while this code was running. In either case,
-         * behave as if there is no DRM fourcc format associated with this
-         * config.
-         */
-        return 0; /* DRM_FORMAT_INVALID */
-    }
-
-    /* Handles configs with up to 255 bits per component */
-    assert(a < 256 && g < 256 && b < 256 && a < 256);
-#define PACK_CONFIG(r_, g_, b_, a_) \
-    (((r_) << 24ULL) | ((g_) << 16ULL) | ((b_) << 8ULL) | (a_))
-
-    switch (PACK_CONFIG(r, g, b, a)) {
-    case PACK_CONFIG(8, 8, 8, 0):
-        return DRM_FORMAT_XRGB8888;
-    case PACK_CONFIG(8, 8, 8, 8):
-        return DRM_FORMAT_ARGB8888;
-    case PACK_CONFIG(5, 6, 5, 0):
-        return DRM_FORMAT_RGB565;
-    case PACK_CONFIG(10, 10, 10, 0):
-        return DRM_FORMAT_XRGB2101010;
-    case PACK_CONFIG(10, 10, 10, 2):
-        return DRM_FORMAT_ARGB2101010;
-    default:
-        return 0; /* DRM_FORMAT_INVALID */
-    }
-}
-
 EGLBoolean
 eGbmChooseConfigHook(EGLDisplay dpy,
                      EGLint const* attribs,
@@ -438,139 +1159,94 @@ eGbmChooseConfigHook(EGLDisplay dpy,
                      EGLint *numConfig)
 {
     GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
-    GbmPlatformData* data;
-    EGLint *newAttribs = NULL;
+    GbmAttribList newAttribs;
     EGLConfig *newConfigs = NULL;
-    EGLint nAttribs = 0;
-    EGLint nNewAttribs = 0;
     EGLint nNewConfigs = 0;
     EGLint cfg;
+    EGLint i;
     EGLint nativeVisual = EGL_DONT_CARE;
     EGLint err = EGL_SUCCESS;
     EGLBoolean ret = EGL_FALSE;
     bool surfType = false;
-    bool nativeVisualID = false;
 
     if (!display) {
         /*  No platform data. Can't set error EGL_NO_DISPLAY */
         return EGL_FALSE;
     }
 
-    data = display->data;
-
-    if (attribs) {
-        for (; attribs[nAttribs] != EGL_NONE; nAttribs += 2) {
-            surfType = surfType || (attribs[nAttribs] == EGL_SURFACE_TYPE);
-            if (attribs[nAttribs] == EGL_NATIVE_VISUAL_ID) {
-                nativeVisual = attribs[nAttribs + 1];
-                nativeVisualID = true;
-            }
-        }
-    }
-
-    /*
-     * Add room for EGL_SURFACE_TYPE attrib if not present, remove the
-     * EGL_NATIVE_VISUAL_ID attrib if present
-     */
-    nNewAttribs = (surfType ? nAttribs : nAttribs + 2);
-    nNewAttribs = (nativeVisualID ? nNewAttribs - 2 : nNewAttribs);
-
-    newAttribs = malloc((nNewAttribs + 1) * sizeof(*newAttribs));
+    eGbmAttribListInit(&newAttribs);
 
-    if (!newAttribs) {
-        err = EGL_BAD_ALLOC;
+    if (!numConfig) {
+        err = EGL_BAD_PARAMETER;
         goto done;
     }
 
-    for (nAttribs = 0, nNewAttribs = 0;
-         attribs[nAttribs] != EGL_NONE;
-         nAttribs += 2) {
-        /*
-         * Convert all instances of EGL_WINDOW_BIT in an EGL_SURFACE_TYPE
-         * attribute's value to EGL_STREAM_BIT_KHR
-         */
-        if ((attribs[nAttribs] == EGL_SURFACE_TYPE) &&
-            (attribs[nAttribs + 1] != EGL_DONT_CARE) &&
-            (attribs[nAttribs + 1] & EGL_WINDOW_BIT)) {
-            newAttribs[nNewAttribs++] = attribs[nAttribs];
-            newAttribs[nNewAttribs++] =
-                (attribs[nAttribs + 1] & ~EGL_WINDOW_BIT) |
-                EGL_STREAM_BIT_KHR;
-
-        /* Remove all instances of the EGL_nATIVE_VISUAL_ID attribute */
-        } else if (attribs[nAttribs] != EGL_NATIVE_VISUAL_ID) {
-            newAttribs[nNewAttribs++] = attribs[nAttribs];
-            newAttribs[nNewAttribs++] = attribs[nAttribs + 1];
-        }
-    }
-
-    if (!surfType) {
-        /*
-         * If EGL_SURFACE_TYPE was not specified, convert the default
-         * EGL_WINDOW_BIT to EGL_STREAM_BIT_KHR
-         */
-        newAttribs[nNewAttribs++] = EGL_SURFACE_TYPE;
-        newAttribs[nNewAttribs++] = EGL_STREAM_BIT_KHR;
-    }
-
-    newAttribs[nNewAttribs] = EGL_NONE;
+    for (i = 0; attribs && attribs[i] != EGL_NONE; i += 2) {
+        EGLint value = attribs[i + 1];
 
-    if (nativeVisual != EGL_DONT_CARE) {
-        /*
-         * Need to query *all* configs that match everything but the specified
-         * native visual ID, then filter them down based on visual ID before
-         * clamping to the number of configs requested.
-         */
-        ret = data->egl.ChooseConfig(display->devDpy,
-                                     newAttribs,
-                                     NULL,
-                                     0,
-                                     &nNewConfigs);
-
-        if (!ret || !*numConfig) goto done;
+        if (attribs[i] == EGL_SURFACE_TYPE) {
+            /*
+             * Convert all instances of EGL_WINDOW_BIT in an EGL_SURFACE_TYPE
+             * attribute's value to EGL_STREAM_BIT_KHR
+             */
+            if (value != EGL_DONT_CARE && (value & EGL_WINDOW_BIT))
+                value = (value & ~EGL_WINDOW_BIT) | EGL_STREAM_BIT_KHR;
 
-        newConfigs = malloc(sizeof(EGLConfig) * *numConfig);
+            surfType = true;
+        } else if (attribs[i] == EGL_NATIVE_VISUAL_ID) {
+            /* Remove all instances of the EGL_NATIVE_VISUAL_ID attribute */
+            nativeVisual = value;
+            continue;
+        }
 
-        if (!newConfigs) {
+        if (!eGbmAttribListAppend(&newAttribs, attribs[i], value)) {
             err = EGL_BAD_ALLOC;
             goto done;
         }
+    }
 
-        ret = data->egl.ChooseConfig(display->devDpy,
-                                     newAttribs,
-                                     newConfigs,
-                                     nNewConfigs,
-                                     &nNewConfigs);
-
-        if (!ret) goto done;
-
-        for (cfg = 0, *numConfig = 0;
-             cfg < nNewConfigs && (!configs || *numConfig < configSize);
-             cfg++) {
-            if (ConfigToDrmFourCC(display, newConfigs[cfg]) !=
-                (uint32_t)nativeVisual) {
-                continue;
-            }
-
-            if (!configs) {
-                (*numConfig)++;
-                continue;
-            }
+    /*
+     * If EGL_SURFACE_TYPE was not specified, convert the default
+     * EGL_WINDOW_BIT to EGL_STREAM_BIT_KHR
+     */
+    if (!surfType &&
+        !eGbmAttribListAppend(&newAttribs, EGL_SURFACE_TYPE,
+                              EGL_STREAM_BIT_KHR)) {
+        err = EGL_BAD_ALLOC;
+        goto done;
+    }
 
-            configs[(*numConfig)++] = newConfigs[cfg];
+    /*
+     * If a native visual ID was specified, *all* configs that match
+     * everything but the native visual ID are needed so they can be filtered
+     * down based on visual ID before clamping to the number of configs
+     * requested.
+     */
+    ret = ChooseAllConfigs(display,
+                           newAttribs.attribs,
+                           newAttribs.nAttribs + 1,
+                           &newConfigs,
+                           &nNewConfigs);
+
+    if (!ret) goto done;
+
+    for (cfg = 0, *numConfig = 0;
+         cfg < nNewConfigs && (!configs || *numConfig < configSize);
+         cfg++) {
+        if (nativeVisual != EGL_DONT_CARE &&
+            GetConfigFourCC(display, newConfigs[cfg]) !=
+            (uint32_t)nativeVisual) {
+            continue;
         }
-    } else {
-        ret = data->egl.ChooseConfig(display->devDpy,
-                                     newAttribs,
-                                     configs,
-                                     configSize,
-                                     numConfig);
+
+        if (configs) configs[*numConfig] = newConfigs[cfg];
+        (*numConfig)++;
     }
 
 done:
-    free(newAttribs);
+    eGbmAttribListFree(&newAttribs);
     free(newConfigs);
-    if (err != EGL_SUCCESS) eGbmSetError(data, err);
+    if (err != EGL_SUCCESS) eGbmSetObjectError(&display->base, err);
 
     eGbmUnrefObject(&display->base);
 
@@ -607,7 +1283,7 @@ eGbmGetConfigAttribHook(EGLDisplay dpy,
             break;
 
         case EGL_NATIVE_VISUAL_ID:
-            *value = ConfigToDrmFourCC(display, config);
+            *value = GetConfigFourCC(display, config);
             break;
 
         default:
@@ -619,3 +1295,296 @@ eGbmGetConfigAttribHook(EGLDisplay dpy,
 
     return ret;
 }
+
+/*
+ * Returns the type of plane <planeId> and stores the ID of its IN_FORMATS
+ * blob in <inFormats>, which is 0 if it has none.
+ */
+static uint64_t
+GetPlaneProps(int fd, uint32_t planeId, uint64_t* inFormats)
+{
+    drmModeObjectPropertiesPtr props =
+        drmModeObjectGetProperties(fd, planeId, DRM_MODE_OBJECT_PLANE);
+    uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+    uint32_t i;
+
+    *inFormats = 0;
+
+    if (!props) return type;
+
+    for (i = 0; i < props->count_props; i++) {
+        drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+
+        if (!prop) continue;
+
+        if (!strcmp(prop->name, "type"))
+            type = props->prop_values[i];
+        else if (!strcmp(prop->name, "IN_FORMATS"))
+            *inFormats = props->prop_values[i];
+
+        drmModeFreeProperty(prop);
+    }
+
+    drmModeFreeObjectProperties(props);
+
+    return type;
+}
+
+/*
+ * Returns all planes of the device <fd> refers to, including the primary
+ * planes, which are only listed once DRM_CLIENT_CAP_UNIVERSAL_PLANES is set.
+ *
+ * <fd> shares its client capabilities with the application's file
+ * descriptor, and opening a separate primary node instead could make it DRM
+ * master behind the application's back. So the capability is only set if
+ * no primary plane is listed, meaning the application hasn't set it (or
+ * DRM_CLIENT_CAP_ATOMIC, which implies it) itself, and <*capSet> is set to
+ * true so the caller can clear it again.
+ */
+static drmModePlaneResPtr
+GetUniversalPlanes(int fd, bool* capSet)
+{
+    drmModePlaneResPtr planes = drmModeGetPlaneResources(fd);
+    uint64_t inFormats;
+    uint32_t p;
+
+    *capSet = false;
+
+    for (p = 0; planes && p < planes->count_planes; p++) {
+        if (GetPlaneProps(fd, planes->planes[p], &inFormats) ==
+            DRM_PLANE_TYPE_PRIMARY) {
+            return planes;
+        }
+    }
+
+    if (planes) drmModeFreePlaneResources(planes);
+
+    if (drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1)) return NULL;
+
+    *capSet = true;
+
+    return drmModeGetPlaneResources(fd);
+}
+
+/* Lower values are preferred */
+static int
+ModifierRank(uint64_t modifier)
+{
+    if (modifier == DRM_FORMAT_MOD_LINEAR) return 2;
+
+    /* The compression type of NVIDIA block linear layouts is in bits 23-25 */
+    if ((modifier >> 56) == DRM_FORMAT_MOD_VENDOR_NVIDIA &&
+        ((modifier >> 23) & 0x7) != 0) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Stores up to <maxModifiers> of the modifiers the IN_FORMATS blob <blob>
+ * lists for <format> in <modifiers>. Returns the number stored, or -1 if the
+ * plane doesn't support <format> at all.
+ */
+static int
+GetPlaneModifiers(const drmModePropertyBlobRes* blob,
+                  uint32_t format,
+                  uint64_t* modifiers,
+                  int maxModifiers)
+{
+    const struct drm_format_modifier_blob* header = blob->data;
+    const struct drm_format_modifier* mods;
+    const uint32_t* formats;
+    int numModifiers = 0;
+    uint32_t f, m;
+
+    if (blob->length < sizeof(*header) ||
+        header->formats_offset > blob->length ||
+        header->count_formats >
+            (blob->length - header->formats_offset) / sizeof(*formats) ||
+        header->modifiers_offset > blob->length ||
+        header->count_modifiers >
+            (blob->length - header->modifiers_offset) / sizeof(*mods)) {
+        return -1;
+    }
+
+    formats = (const uint32_t*)((const char*)header + header->formats_offset);
+    mods = (const struct drm_format_modifier*)
+        ((const char*)header + header->modifiers_offset);
+
+    for (f = 0; f < header->count_formats; f++) {
+        if (formats[f] == format) break;
+    }
+
+    if (f == header->count_formats) return -1;
+
+    for (m = 0; m < header->count_modifiers; m++) {
+        if (f < mods[m].offset || f >= mods[m].offset + 64 ||
+            !(mods[m].formats & (1ull << (f - mods[m].offset))) ||
+            mods[m].modifier == DRM_FORMAT_MOD_INVALID) {
+            continue;
+        }
+
+        if (numModifiers < maxModifiers)
+            modifiers[numModifiers++] = mods[m].modifier;
+    }
+
+    return numModifiers;
+}
+
+/*
+ * Removes the modifiers that aren't among the <numOther> in <other> from the
+ * <numModifiers> in <modifiers>, keeping their order. Returns the number
+ * left.
+ */
+static int
+IntersectModifiers(uint64_t* modifiers,
+                   int numModifiers,
+                   const uint64_t* other,
+                   int numOther)
+{
+    int n = 0;
+    int i, j;
+
+    for (i = 0; i < numModifiers; i++) {
+        for (j = 0; j < numOther; j++) {
+            if (other[j] == modifiers[i]) break;
+        }
+
+        if (j < numOther) modifiers[n++] = modifiers[i];
+    }
+
+    return n;
+}
+
+/*
+ * Queries the modifiers all primary planes of the display's device that
+ * support <format> can scan it out with, and stores them in <entry> ordered
+ * so that compressed layouts come first and linear comes last. Which CRTC
+ * the application will use isn't known, so only modifiers every primary
+ * plane accepts are safe to offer.
+ */
+static void
+QueryScanoutModifiers(GbmDisplay* display,
+                      uint32_t format,
+                      GbmScanoutModifiers* entry)
+{
+    drmModePlaneResPtr planes = NULL;
+    uint64_t modifiers[64];
+    uint64_t planeModifiers[64];
+    int numModifiers = 0;
+    int numPlaneModifiers;
+    bool planeFound = false;
+    bool capSet = false;
+    int fd = fcntl(gbm_device_get_fd(display->gbm), F_DUPFD_CLOEXEC, 0);
+    uint32_t p;
+    int j, k;
+
+    entry->format = format;
+    entry->modifiers = NULL;
+    entry->numModifiers = 0;
+
+    if (fd < 0) return;
+
+    planes = GetUniversalPlanes(fd, &capSet);
+
+    for (p = 0; planes && p < planes->count_planes; p++) {
+        uint64_t inFormats;
+        uint64_t type = GetPlaneProps(fd, planes->planes[p], &inFormats);
+
+        if (type == DRM_PLANE_TYPE_PRIMARY && inFormats) {
+            drmModePropertyBlobPtr blob =
+                drmModeGetPropertyBlob(fd, (uint32_t)inFormats);
+
+            if (blob) {
+                numPlaneModifiers =
+                    GetPlaneModifiers(blob, format, planeModifiers,
+                                      (int)ARRAY_LEN(planeModifiers));
+                drmModeFreePropertyBlob(blob);
+
+                if (numPlaneModifiers >= 0 && !planeFound) {
+                    memcpy(modifiers, planeModifiers,
+                           numPlaneModifiers * sizeof(*modifiers));
+                    numModifiers = numPlaneModifiers;
+                    planeFound = true;
+                } else if (numPlaneModifiers >= 0) {
+                    numModifiers = IntersectModifiers(modifiers, numModifiers,
+                                                      planeModifiers,
+                                                      numPlaneModifiers);
+                }
+            }
+        }
+    }
+
+    if (planes) drmModeFreePlaneResources(planes);
+    if (capSet) drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 0);
+    close(fd);
+
+    if (!numModifiers) return;
+
+    /* Stable insertion sort by rank, keeping the kernel's order otherwise */
+    for (j = 1; j < numModifiers; j++) {
+        uint64_t mod = modifiers[j];
+
+        for (k = j; k > 0 && ModifierRank(modifiers[k - 1]) >
+             ModifierRank(mod); k--) {
+            modifiers[k] = modifiers[k - 1];
+        }
+
+        modifiers[k] = mod;
+    }
+
+    entry->modifiers = malloc(numModifiers * sizeof(*entry->modifiers));
+
+    if (!entry->modifiers) return;
+
+    memcpy(entry->modifiers, modifiers,
+           numModifiers * sizeof(*entry->modifiers));
+    entry->numModifiers = numModifiers;
+}
+
+/*
+ * Returns the modifiers the display's device can scan out <format> with, in
+ * order of preference, or none if that can't be determined. The returned
+ * list remains valid for the lifetime of <display>.
+ */
+void
+eGbmGetScanoutModifiers(GbmDisplay* display,
+                        uint32_t format,
+                        const uint64_t** modifiers,
+                        int* numModifiers)
+{
+    GbmScanoutModifiers* entry = NULL;
+    int i;
+
+    *modifiers = NULL;
+    *numModifiers = 0;
+
+    pthread_mutex_lock(&display->mutex);
+
+    for (i = 0; i < display->scanoutModifiers.numEntries; i++) {
+        if (display->scanoutModifiers.entries[i].format == format) {
+            entry = &display->scanoutModifiers.entries[i];
+            break;
+        }
+    }
+
+    /*
+     * The result doesn't change for the lifetime of the device, so negative
+     * results are remembered as well. Formats beyond the cache size don't
+     * get scanout modifiers at all.
+     */
+    if (!entry &&
+        display->scanoutModifiers.numEntries < MAX_SCANOUT_MODIFIER_FORMATS) {
+        entry = &display->scanoutModifiers.entries[
+            display->scanoutModifiers.numEntries++];
+        QueryScanoutModifiers(display, format, entry);
+    }
+
+    if (entry) {
+        *modifiers = entry->modifiers;
+        *numModifiers = entry->numModifiers;
+    }
+
+    pthread_mutex_unlock(&display->mutex);
+}
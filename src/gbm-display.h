@@ -10,6 +10,73 @@
 #include "gbm-platform.h"
 #include "gbm-handle.h"
 
+#include <pthread.h>
+#include <stdbool.h>
+
+#define MAX_CHOOSE_CONFIG_CACHE_ENTRIES 8
+
+/* The number of formats for which scanout modifiers are remembered */
+#define MAX_SCANOUT_MODIFIER_FORMATS 8
+
+/*
+ * The number of EGLImages imported from gbm_bos that are tracked per display,
+ * and how many of those are kept after the application destroyed them in case
+ * it creates an image for the same buffer again. Each image kept keeps its
+ * buffer's memory allocated, even if the application destroyed the gbm_bo.
+ */
+#define MAX_IMAGE_CACHE_ENTRIES 32
+#define MAX_IDLE_IMAGE_CACHE_ENTRIES 4
+
+typedef struct GbmConfigFormatRec {
+    EGLConfig config;
+    uint32_t fourcc;
+} GbmConfigFormat;
+
+typedef struct GbmConfigFormatTableRec {
+    EGLint numFormats;
+    /* Sorted by config handle */
+    GbmConfigFormat formats[];
+} GbmConfigFormatTable;
+
+typedef struct GbmChooseConfigCacheEntryRec {
+    /* The rewritten attribute list, including the terminating EGL_NONE */
+    EGLint* attribs;
+    EGLint nAttribs;
+    EGLConfig* configs;
+    EGLint numConfigs;
+    unsigned int lastUse;
+} GbmChooseConfigCacheEntry;
+
+typedef struct GbmScanoutModifiersRec {
+    uint32_t format;
+    /* In order of preference. NULL if there are none. */
+    uint64_t* modifiers;
+    int numModifiers;
+} GbmScanoutModifiers;
+
+typedef struct GbmImageCacheEntryRec {
+    /*
+     * Identity of each plane's dma-buf and the layout of the imported buffer.
+     * The bo pointer can't serve as the key, since a destroyed bo's address
+     * may be reused for a different buffer. The dma-bufs' identities can't be
+     * reused while the image exists, since it keeps the dma-bufs alive.
+     */
+    dev_t devs[GBM_MAX_PLANES];
+    ino_t inos[GBM_MAX_PLANES];
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint64_t modifier;
+    int numPlanes;
+    uint32_t strides[GBM_MAX_PLANES];
+    uint32_t offsets[GBM_MAX_PLANES];
+
+    EGLImage image;
+    /* The number of times the application created this image */
+    unsigned int refs;
+    unsigned int lastUse;
+} GbmImageCacheEntry;
+
 typedef struct GbmDisplayRec {
     GbmObject base;
     GbmPlatformData* data;
@@ -17,6 +84,49 @@ typedef struct GbmDisplayRec {
     EGLDisplay devDpy;
     struct gbm_device* gbm;
     int fd;
+    /*
+     * True if rendering happens on a different device than the one backing
+     * the GBM device, so buffers must be shared in a linear layout.
+     */
+    bool prime;
+    /* GbmExtensionSet of the device display's extensions */
+    uint64_t exts;
+    GbmConfigFormatTable* configFormats;
+
+    /*
+     * The native display and attribute list passed to eglGetPlatformDisplay,
+     * used to return the same EGLDisplay for identical parameters.
+     */
+    void* nativeDpy;
+    EGLAttrib* attribs;
+    size_t nAttribs;
+    struct GbmDisplayRec* nextDisplay;
+
+    /* Protects the caches below */
+    pthread_mutex_t mutex;
+
+    struct {
+        GbmChooseConfigCacheEntry entries[MAX_CHOOSE_CONFIG_CACHE_ENTRIES];
+        unsigned int clock;
+    } chooseConfigCache;
+
+    struct {
+        GbmScanoutModifiers entries[MAX_SCANOUT_MODIFIER_FORMATS];
+        int numEntries;
+    } scanoutModifiers;
+
+    struct {
+        GbmImageCacheEntry entries[MAX_IMAGE_CACHE_ENTRIES];
+        unsigned int clock;
+    } imageCache;
+
+    /*
+     * Window surfaces the application destroyed, kept so that a new surface
+     * with the same parameters can reuse their stream, sync object and
+     * images. Most recently destroyed first.
+     */
+    struct GbmSurfaceRec* surfacePool;
+    int numPooledSurfaces;
 } GbmDisplay;
 
 EGLDisplay eGbmGetPlatformDisplayExport(void *data,
@@ -45,4 +155,9 @@ EGLBoolean eGbmGetConfigAttribHook(EGLDisplay dpy,
                                    EGLint attribute,
                                    EGLint* value);
 
+void eGbmGetScanoutModifiers(GbmDisplay* display,
+                             uint32_t format,
+                             const uint64_t** modifiers,
+                             int* numModifiers);
+
 #endif /* GBM_DISPLAY_H */
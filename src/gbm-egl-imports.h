@@ -6,18 +6,23 @@
 
 DO_EGL_FUNC(PFNEGLCHOOSECONFIGPROC, ChooseConfig)
 DO_EGL_FUNC(PFNEGLCLIENTWAITSYNCKHRPROC, ClientWaitSyncKHR)
+DO_EGL_FUNC(PFNEGLCREATEIMAGEPROC, CreateImage)
 DO_EGL_FUNC(PFNEGLCREATEIMAGEKHRPROC, CreateImageKHR)
 DO_EGL_FUNC(PFNEGLCREATEPBUFFERSURFACEPROC, CreatePbufferSurface)
 DO_EGL_FUNC(PFNEGLCREATESTREAMKHRPROC, CreateStreamKHR)
 DO_EGL_FUNC(PFNEGLCREATESYNCKHRPROC, CreateSyncKHR)
 DO_EGL_FUNC(PFNEGLCREATESTREAMPRODUCERSURFACEKHRPROC, CreateStreamProducerSurfaceKHR)
+DO_EGL_FUNC(PFNEGLDESTROYIMAGEPROC, DestroyImage)
 DO_EGL_FUNC(PFNEGLDESTROYIMAGEKHRPROC, DestroyImageKHR)
 DO_EGL_FUNC(PFNEGLDESTROYSTREAMKHRPROC, DestroyStreamKHR)
 DO_EGL_FUNC(PFNEGLDESTROYSURFACEPROC, DestroySurface)
 DO_EGL_FUNC(PFNEGLDESTROYSYNCKHRPROC, DestroySyncKHR)
+DO_EGL_FUNC(PFNEGLDUPNATIVEFENCEFDANDROIDPROC, DupNativeFenceFDANDROID)
 DO_EGL_FUNC(PFNEGLEXPORTDMABUFIMAGEMESAPROC, ExportDMABUFImageMESA)
 DO_EGL_FUNC(PFNEGLEXPORTDMABUFIMAGEQUERYMESAPROC, ExportDMABUFImageQueryMESA)
 DO_EGL_FUNC(PFNEGLGETCONFIGATTRIBPROC, GetConfigAttrib)
+DO_EGL_FUNC(PFNEGLGETCONFIGSPROC, GetConfigs)
+DO_EGL_FUNC(PFNEGLGETCURRENTSURFACEPROC, GetCurrentSurface)
 DO_EGL_FUNC(PFNEGLGETERRORPROC, GetError)
 DO_EGL_FUNC(PFNEGLGETPLATFORMDISPLAYPROC, GetPlatformDisplay)
 DO_EGL_FUNC(PFNEGLINITIALIZEPROC, Initialize)
@@ -25,7 +30,11 @@ DO_EGL_FUNC(PFNEGLQUERYDEVICESEXTPROC, QueryDevicesEXT)
 DO_EGL_FUNC(PFNEGLQUERYDEVICESTRINGEXTPROC, QueryDeviceStringEXT)
 DO_EGL_FUNC(PFNEGLQUERYSTREAMCONSUMEREVENTNVPROC, QueryStreamConsumerEventNV)
 DO_EGL_FUNC(PFNEGLQUERYSTRINGPROC, QueryString)
+DO_EGL_FUNC(PFNEGLQUERYSURFACEPROC, QuerySurface)
 DO_EGL_FUNC(PFNEGLSTREAMIMAGECONSUMERCONNECTNVPROC, StreamImageConsumerConnectNV)
 DO_EGL_FUNC(PFNEGLSTREAMACQUIREIMAGENVPROC, StreamAcquireImageNV)
 DO_EGL_FUNC(PFNEGLSTREAMRELEASEIMAGENVPROC, StreamReleaseImageNV)
+DO_EGL_FUNC(PFNEGLSWAPBUFFERSPROC, SwapBuffers)
+DO_EGL_FUNC(PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC, SwapBuffersWithDamageEXT)
+DO_EGL_FUNC(PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC, SwapBuffersWithDamageKHR)
 DO_EGL_FUNC(PFNEGLTERMINATEPROC, Terminate)
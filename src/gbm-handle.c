@@ -8,45 +8,69 @@
 #include "gbm-mutex.h"
 
 #include <stddef.h>
-#include <search.h>
+#include <stdint.h>
 #include <assert.h>
 
-static int
-HandleCompar(const void *a, const void *b)
-{
-    const GbmObject* objA = a;
-    const GbmObject* objB = b;
+/*
+ * Handles are the addresses of the objects they refer to, so the handle table
+ * is a hash table keyed on the handle value itself. This means looking up a
+ * handle never dereferences it, even if it turns out not to be valid.
+ *
+ * Lookups only take the handles lock for reading, so they can proceed in
+ * parallel on multiple threads.
+ */
+#define HANDLE_TABLE_SIZE 256 /* Must be a power of two */
 
-    if (objA->type != objB->type)
-        return objA->type - objB->type;
+static GbmObject* handleTable[HANDLE_TABLE_SIZE];
 
-    if (objA->dpy != objB->dpy)
-        return (const uint8_t *)objA->dpy - (const uint8_t *)objB->dpy;
+static inline unsigned int
+HashHandle(GbmHandle handle)
+{
+    uintptr_t val = (uintptr_t)handle;
 
-    return objA - objB;
+    /* Objects are heap allocations, so the low bits carry no information */
+    val ^= val >> 4;
+    val ^= val >> 12;
+    val ^= val >> 24;
+
+    return (unsigned int)(val & (HANDLE_TABLE_SIZE - 1));
 }
 
-void *handleTreeRoot = NULL;
+static GbmObject**
+FindHandleLocked(GbmHandle handle)
+{
+    GbmObject** link = &handleTable[HashHandle(handle)];
+
+    for (; *link; link = &(*link)->next) {
+        if (*link == handle) return link;
+    }
+
+    return NULL;
+}
 
 GbmHandle
 eGbmAddObject(GbmObject* obj)
 {
-    GbmObject** res = NULL;
+    GbmObject** bucket;
+    GbmObject* res = NULL;
 
     if (!eGbmHandlesLock())
         return NULL;
 
     assert(obj->refCount == 1);
 
-    if (tfind(obj, &handleTreeRoot, HandleCompar))
+    if (FindHandleLocked(obj))
         goto fail;
 
-    res = tsearch(obj, &handleTreeRoot, HandleCompar);
+    bucket = &handleTable[HashHandle(obj)];
+    obj->next = *bucket;
+    *bucket = obj;
+    res = obj;
 
 fail:
     eGbmHandlesUnlock();
 
-    return res ? *res : NULL;
+    return res;
 }
 
 GbmObject*
@@ -54,15 +78,19 @@ eGbmRefHandle(GbmHandle handle)
 {
     GbmObject **res = NULL;
 
-    if (!eGbmHandlesLock())
+    if (!eGbmHandlesReadLock())
         return NULL;
 
-    res = tfind(handle, &handleTreeRoot, HandleCompar);
+    res = FindHandleLocked(handle);
 
     if (!res) goto fail;
 
-    assert((*res)->refCount >= 1);
-    (*res)->refCount++;
+    /*
+     * Other threads may be referencing the same object concurrently, so the
+     * reference count must be updated atomically even with the lock held.
+     */
+    assert(__atomic_load_n(&(*res)->refCount, __ATOMIC_RELAXED) >= 1);
+    __atomic_fetch_add(&(*res)->refCount, 1, __ATOMIC_RELAXED);
 
 fail:
     eGbmHandlesUnlock();
@@ -73,11 +101,17 @@ fail:
 static void
 UnrefObjectLocked(GbmObject* obj)
 {
+    GbmObject** link;
+
     assert(obj->refCount >= 1);
 
-    if (--obj->refCount == 0) {
-        if (!tdelete(obj, &handleTreeRoot, HandleCompar))
-            assert(!"Failed to find handle in tree for deletion");
+    if (__atomic_sub_fetch(&obj->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+        link = FindHandleLocked(obj);
+
+        if (link)
+            *link = obj->next;
+        else
+            assert(!"Failed to find handle in table for deletion");
 
         eGbmHandlesUnlock();
         obj->free(obj);
@@ -90,6 +124,26 @@ UnrefObjectLocked(GbmObject* obj)
 void
 eGbmUnrefObject(GbmObject* obj)
 {
+    int refCount = __atomic_load_n(&obj->refCount, __ATOMIC_RELAXED);
+
+    /*
+     * As long as this isn't the last reference, the object stays in the
+     * handle table, so the lock is only needed if the count may drop to zero.
+     * References can only be added by lookups, which are excluded while the
+     * lock is held for writing, so the count can't go back up once the last
+     * reference is dropped below.
+     */
+    while (refCount > 1) {
+        if (__atomic_compare_exchange_n(&obj->refCount,
+                                        &refCount,
+                                        refCount - 1,
+                                        true,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+
     if (!eGbmHandlesLock()) {
         assert(!"Failed to lock handle list to unref object");
         return;
@@ -109,7 +163,7 @@ eGbmDestroyHandle(GbmHandle handle)
         return false;
     }
 
-    res = tfind(handle, &handleTreeRoot, HandleCompar);
+    res = FindHandleLocked(handle);
 
     if (!res || (*res)->destroyed) {
         eGbmHandlesUnlock();
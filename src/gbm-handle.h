@@ -14,8 +14,11 @@ typedef struct GbmObjectRec {
     void (*free)(struct GbmObjectRec *obj);
     struct GbmDisplayRec* dpy;
     EGLenum type;
+    /* Only modified using atomic operations once the object is added */
     int refCount;
     bool destroyed;
+    /* Next object in the same handle table bucket */
+    struct GbmObjectRec* next;
 } GbmObject;
 
 typedef const GbmObject* GbmHandle;
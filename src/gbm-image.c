@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "gbm-image.h"
+#include "gbm-utils.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <drm_fourcc.h>
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
+
+static const EGLint PlaneAttribs[GBM_MAX_PLANES][5] = {
+    {
+        EGL_DMA_BUF_PLANE0_FD_EXT,
+        EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+        EGL_DMA_BUF_PLANE0_PITCH_EXT,
+        EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+        EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
+    },
+    {
+        EGL_DMA_BUF_PLANE1_FD_EXT,
+        EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+        EGL_DMA_BUF_PLANE1_PITCH_EXT,
+        EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+        EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT,
+    },
+    {
+        EGL_DMA_BUF_PLANE2_FD_EXT,
+        EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+        EGL_DMA_BUF_PLANE2_PITCH_EXT,
+        EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+        EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT,
+    },
+    {
+        EGL_DMA_BUF_PLANE3_FD_EXT,
+        EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+        EGL_DMA_BUF_PLANE3_PITCH_EXT,
+        EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+        EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT,
+    },
+};
+
+/*
+ * Fills in the identity and layout of <bo> in <key>, and exports a file
+ * descriptor for each of its planes in <fds>, which the caller must close.
+ */
+static bool
+DescribeBo(struct gbm_bo* bo, GbmImageCacheEntry* key, int* fds)
+{
+    struct stat st;
+    int i;
+
+    memset(key, 0, sizeof(*key));
+    key->width = gbm_bo_get_width(bo);
+    key->height = gbm_bo_get_height(bo);
+    key->format = gbm_bo_get_format(bo);
+    key->modifier = gbm_bo_get_modifier(bo);
+    key->numPlanes = gbm_bo_get_plane_count(bo);
+
+    if (key->numPlanes < 1 || key->numPlanes > GBM_MAX_PLANES) return false;
+
+    /* Planes may live in different dma-bufs, so identify each of them */
+    for (i = 0; i < key->numPlanes; i++) {
+        fds[i] = gbm_bo_get_fd_for_plane(bo, i);
+        if (fds[i] < 0 || fstat(fds[i], &st)) return false;
+
+        key->devs[i] = st.st_dev;
+        key->inos[i] = st.st_ino;
+        key->strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+        key->offsets[i] = gbm_bo_get_offset(bo, i);
+    }
+
+    return true;
+}
+
+static bool
+SameBuffer(const GbmImageCacheEntry* a, const GbmImageCacheEntry* b)
+{
+    return a->width == b->width &&
+        a->height == b->height &&
+        a->format == b->format &&
+        a->modifier == b->modifier &&
+        a->numPlanes == b->numPlanes &&
+        !memcmp(a->devs, b->devs, sizeof(a->devs)) &&
+        !memcmp(a->inos, b->inos, sizeof(a->inos)) &&
+        !memcmp(a->strides, b->strides, sizeof(a->strides)) &&
+        !memcmp(a->offsets, b->offsets, sizeof(a->offsets));
+}
+
+static EGLImage
+ImportBo(GbmDisplay* display, const GbmImageCacheEntry* key, const int* fds)
+{
+    EGLint attribs[6 + GBM_MAX_PLANES * 10 + 1];
+    bool useModifier = key->modifier != DRM_FORMAT_MOD_INVALID;
+    int n = 0;
+    int i;
+
+    if (useModifier &&
+        !eGbmHasExtension(display->exts, EXT_image_dma_buf_import_modifiers)) {
+        /*
+         * Without modifiers, EGL_EXT_image_dma_buf_import can still describe
+         * pitch linear buffers, which is all an import without a modifier
+         * can mean.
+         */
+        if (key->modifier != DRM_FORMAT_MOD_LINEAR) {
+            eGbmSetObjectError(&display->base, EGL_BAD_MATCH);
+            return EGL_NO_IMAGE_KHR;
+        }
+
+        useModifier = false;
+    }
+
+    attribs[n++] = EGL_WIDTH;
+    attribs[n++] = key->width;
+    attribs[n++] = EGL_HEIGHT;
+    attribs[n++] = key->height;
+    attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+    attribs[n++] = key->format;
+
+    for (i = 0; i < key->numPlanes; i++) {
+        attribs[n++] = PlaneAttribs[i][0];
+        attribs[n++] = fds[i];
+        attribs[n++] = PlaneAttribs[i][1];
+        attribs[n++] = key->offsets[i];
+        attribs[n++] = PlaneAttribs[i][2];
+        attribs[n++] = key->strides[i];
+
+        if (useModifier) {
+            attribs[n++] = PlaneAttribs[i][3];
+            attribs[n++] = (EGLint)(key->modifier & 0xffffffff);
+            attribs[n++] = PlaneAttribs[i][4];
+            attribs[n++] = (EGLint)(key->modifier >> 32);
+        }
+    }
+
+    attribs[n] = EGL_NONE;
+
+    return display->data->egl.CreateImageKHR(display->devDpy,
+                                             EGL_NO_CONTEXT,
+                                             EGL_LINUX_DMA_BUF_EXT,
+                                             NULL,
+                                             attribs);
+}
+
+/*
+ * Removes the least recently used image the application no longer references
+ * from the cache if there are more than <maxIdle> of them, and returns it so
+ * the caller can destroy it once the display mutex has been released.
+ */
+static EGLImage
+EvictIdleImageLocked(GbmDisplay* display, unsigned int maxIdle)
+{
+    GbmImageCacheEntry* entries = display->imageCache.entries;
+    GbmImageCacheEntry* oldest = NULL;
+    unsigned int clock = display->imageCache.clock;
+    unsigned int numIdle = 0;
+    EGLImage image;
+    unsigned int i;
+
+    for (i = 0; i < MAX_IMAGE_CACHE_ENTRIES; i++) {
+        if (entries[i].image == EGL_NO_IMAGE_KHR || entries[i].refs) continue;
+
+        numIdle++;
+
+        if (!oldest ||
+            clock - entries[i].lastUse > clock - oldest->lastUse) {
+            oldest = &entries[i];
+        }
+    }
+
+    if (numIdle <= maxIdle) return EGL_NO_IMAGE_KHR;
+
+    image = oldest->image;
+    memset(oldest, 0, sizeof(*oldest));
+
+    return image;
+}
+
+static GbmImageCacheEntry*
+FindFreeEntryLocked(GbmDisplay* display)
+{
+    unsigned int i;
+
+    for (i = 0; i < MAX_IMAGE_CACHE_ENTRIES; i++) {
+        if (display->imageCache.entries[i].image == EGL_NO_IMAGE_KHR)
+            return &display->imageCache.entries[i];
+    }
+
+    return NULL;
+}
+
+static EGLImage
+CreateBoImage(GbmDisplay* display,
+              EGLContext ctx,
+              EGLClientBuffer buffer,
+              bool validAttribs)
+{
+    struct gbm_bo* bo = (struct gbm_bo*)buffer;
+    GbmImageCacheEntry key;
+    GbmImageCacheEntry* entry;
+    EGLImage image = EGL_NO_IMAGE_KHR;
+    EGLImage evicted = EGL_NO_IMAGE_KHR;
+    int fds[GBM_MAX_PLANES];
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_LEN(fds); i++) fds[i] = -1;
+
+    /*
+     * From EGL_KHR_image_pixmap, which defines this target for the native
+     * pixmaps of the platform, i.e., gbm_bos for EGL_KHR_platform_gbm:
+     *
+     * "If <target> is EGL_NATIVE_PIXMAP_KHR, and <ctx> is not EGL_NO_CONTEXT,
+     * the error EGL_BAD_PARAMETER is generated."
+     */
+    if (ctx != EGL_NO_CONTEXT || !bo || !validAttribs ||
+        !eGbmHasExtension(display->exts, EXT_image_dma_buf_import)) {
+        eGbmSetObjectError(&display->base, EGL_BAD_PARAMETER);
+        goto done;
+    }
+
+    /*
+     * The bo is identified by its dma-bufs, which takes exporting them. The
+     * bo's user data belongs to the application, so it can't be used to
+     * remember bos that were seen before.
+     */
+    if (!DescribeBo(bo, &key, fds)) {
+        eGbmSetObjectError(&display->base, EGL_BAD_PARAMETER);
+        goto done;
+    }
+
+    pthread_mutex_lock(&display->mutex);
+    for (i = 0; i < MAX_IMAGE_CACHE_ENTRIES; i++) {
+        entry = &display->imageCache.entries[i];
+
+        if (entry->image == EGL_NO_IMAGE_KHR) continue;
+
+        if (SameBuffer(entry, &key)) {
+            entry->refs++;
+            entry->lastUse = ++display->imageCache.clock;
+            image = entry->image;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&display->mutex);
+
+    if (image != EGL_NO_IMAGE_KHR) goto done;
+
+    image = ImportBo(display, &key, fds);
+
+    if (image == EGL_NO_IMAGE_KHR) goto done;
+
+    /*
+     * If all entries are in use by the application, the image simply isn't
+     * cached, and is passed through to the driver when destroyed.
+     */
+    pthread_mutex_lock(&display->mutex);
+    entry = FindFreeEntryLocked(display);
+    if (!entry) {
+        evicted = EvictIdleImageLocked(display, 0);
+        entry = FindFreeEntryLocked(display);
+    }
+    if (entry) {
+        *entry = key;
+        entry->image = image;
+        entry->refs = 1;
+        entry->lastUse = ++display->imageCache.clock;
+    }
+    pthread_mutex_unlock(&display->mutex);
+
+    if (evicted != EGL_NO_IMAGE_KHR)
+        display->data->egl.DestroyImageKHR(display->devDpy, evicted);
+
+done:
+    for (i = 0; i < ARRAY_LEN(fds); i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+
+    return image;
+}
+
+/*
+ * Drops the application's reference to <image> if it was imported from a
+ * gbm_bo. Returns false if <image> isn't in the cache.
+ */
+static bool
+ReleaseBoImage(GbmDisplay* display, EGLImage image, EGLBoolean* ret)
+{
+    GbmImageCacheEntry* entry = NULL;
+    EGLImage evicted = EGL_NO_IMAGE_KHR;
+    unsigned int i;
+
+    if (image == EGL_NO_IMAGE_KHR) return false;
+
+    pthread_mutex_lock(&display->mutex);
+
+    for (i = 0; i < MAX_IMAGE_CACHE_ENTRIES; i++) {
+        if (display->imageCache.entries[i].image == image) {
+            entry = &display->imageCache.entries[i];
+            break;
+        }
+    }
+
+    if (entry && entry->refs) {
+        if (--entry->refs == 0)
+            evicted = EvictIdleImageLocked(display,
+                                           MAX_IDLE_IMAGE_CACHE_ENTRIES);
+        *ret = EGL_TRUE;
+    } else if (entry) {
+        /* Already destroyed by the application */
+        eGbmSetObjectError(&display->base, EGL_BAD_PARAMETER);
+        *ret = EGL_FALSE;
+    }
+
+    pthread_mutex_unlock(&display->mutex);
+
+    if (evicted != EGL_NO_IMAGE_KHR)
+        display->data->egl.DestroyImageKHR(display->devDpy, evicted);
+
+    return entry != NULL;
+}
+
+EGLImage
+eGbmCreateImageHook(EGLDisplay dpy,
+                    EGLContext ctx,
+                    EGLenum target,
+                    EGLClientBuffer buffer,
+                    const EGLAttrib* attribs)
+{
+    GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
+    bool validAttribs = true;
+    EGLImage ret;
+
+    if (!display) {
+        /*  No platform data. Can't set error EGL_NO_DISPLAY */
+        return EGL_NO_IMAGE;
+    }
+
+    if (target != EGL_NATIVE_PIXMAP_KHR) {
+        ret = display->data->egl.CreateImage(display->devDpy, ctx, target,
+                                             buffer, attribs);
+        goto done;
+    }
+
+    /* The contents of imported buffers are always preserved */
+    for (; attribs && attribs[0] != EGL_NONE; attribs += 2) {
+        if (attribs[0] != EGL_IMAGE_PRESERVED_KHR) validAttribs = false;
+    }
+
+    ret = CreateBoImage(display, ctx, buffer, validAttribs);
+
+done:
+    eGbmUnrefObject(&display->base);
+
+    return ret;
+}
+
+EGLImageKHR
+eGbmCreateImageKHRHook(EGLDisplay dpy,
+                       EGLContext ctx,
+                       EGLenum target,
+                       EGLClientBuffer buffer,
+                       const EGLint* attribs)
+{
+    GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
+    bool validAttribs = true;
+    EGLImageKHR ret;
+
+    if (!display) {
+        /*  No platform data. Can't set error EGL_NO_DISPLAY */
+        return EGL_NO_IMAGE_KHR;
+    }
+
+    if (target != EGL_NATIVE_PIXMAP_KHR) {
+        ret = display->data->egl.CreateImageKHR(display->devDpy, ctx, target,
+                                                buffer, attribs);
+        goto done;
+    }
+
+    for (; attribs && attribs[0] != EGL_NONE; attribs += 2) {
+        if (attribs[0] != EGL_IMAGE_PRESERVED_KHR) validAttribs = false;
+    }
+
+    ret = CreateBoImage(display, ctx, buffer, validAttribs);
+
+done:
+    eGbmUnrefObject(&display->base);
+
+    return ret;
+}
+
+EGLBoolean
+eGbmDestroyImageHook(EGLDisplay dpy, EGLImage image)
+{
+    GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
+    EGLBoolean ret;
+
+    if (!display) {
+        /*  No platform data. Can't set error EGL_NO_DISPLAY */
+        return EGL_FALSE;
+    }
+
+    if (!ReleaseBoImage(display, image, &ret))
+        ret = display->data->egl.DestroyImage(display->devDpy, image);
+
+    eGbmUnrefObject(&display->base);
+
+    return ret;
+}
+
+EGLBoolean
+eGbmDestroyImageKHRHook(EGLDisplay dpy, EGLImageKHR image)
+{
+    GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
+    EGLBoolean ret;
+
+    if (!display) {
+        /*  No platform data. Can't set error EGL_NO_DISPLAY */
+        return EGL_FALSE;
+    }
+
+    if (!ReleaseBoImage(display, image, &ret))
+        ret = display->data->egl.DestroyImageKHR(display->devDpy, image);
+
+    eGbmUnrefObject(&display->base);
+
+    return ret;
+}
+
+void
+eGbmFlushImageCache(GbmDisplay* display)
+{
+    EGLImage images[MAX_IMAGE_CACHE_ENTRIES];
+    unsigned int i;
+
+    /*
+     * Destroying an image may end up back in this library, so only do so once
+     * the mutex has been released.
+     */
+    pthread_mutex_lock(&display->mutex);
+
+    for (i = 0; i < MAX_IMAGE_CACHE_ENTRIES; i++)
+        images[i] = display->imageCache.entries[i].image;
+
+    memset(&display->imageCache, 0, sizeof(display->imageCache));
+
+    pthread_mutex_unlock(&display->mutex);
+
+    for (i = 0; i < MAX_IMAGE_CACHE_ENTRIES; i++) {
+        if (images[i] != EGL_NO_IMAGE_KHR)
+            display->data->egl.DestroyImageKHR(display->devDpy, images[i]);
+    }
+}
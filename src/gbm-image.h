@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef GBM_IMAGE_H
+#define GBM_IMAGE_H
+
+#include "gbm-display.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+EGLImage eGbmCreateImageHook(EGLDisplay dpy,
+                             EGLContext ctx,
+                             EGLenum target,
+                             EGLClientBuffer buffer,
+                             const EGLAttrib* attribs);
+EGLImageKHR eGbmCreateImageKHRHook(EGLDisplay dpy,
+                                   EGLContext ctx,
+                                   EGLenum target,
+                                   EGLClientBuffer buffer,
+                                   const EGLint* attribs);
+EGLBoolean eGbmDestroyImageHook(EGLDisplay dpy, EGLImage image);
+EGLBoolean eGbmDestroyImageKHRHook(EGLDisplay dpy, EGLImageKHR image);
+
+/* Destroys all images imported from gbm_bos on <display> */
+void eGbmFlushImageCache(GbmDisplay* display);
+
+#endif /* GBM_IMAGE_H */
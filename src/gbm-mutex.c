@@ -4,7 +4,7 @@
  * SPDX-License-Identifier: MIT
  */
 
-/* For PTHREAD_MUTEX_ERRORCHECK */
+/* For pthread_rwlock_t */
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
@@ -14,49 +14,49 @@
 #include <assert.h>
 #include <pthread.h>
 
-static pthread_mutex_t handlesMutex;
+static pthread_rwlock_t handlesLock;
 static pthread_once_t onceControl = PTHREAD_ONCE_INIT;
-static bool mutexInitialized = false;
+static bool lockInitialized = false;
 
 
 static void
-InitMutex(void)
+InitLock(void)
 {
-    pthread_mutexattr_t attr;
-
-    if (pthread_mutexattr_init(&attr)) {
-        assert(!"Failed to initialize pthread mutex attributes");
+    if (pthread_rwlock_init(&handlesLock, NULL)) {
+        assert(!"Failed to initialize handles lock");
         return;
     }
 
-    if (pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK)) {
-        assert(!"Failed to set PTHREAD_MUTEX_ERRORCHECK attribute");
-        goto fail;
-    }
+    lockInitialized = true;
+}
 
-    if (pthread_mutex_init(&handlesMutex, &attr)) {
-        assert(!"Failed to initialize handles mutex");
-        goto fail;
+static bool
+EnsureLockInitialized(void)
+{
+    if (pthread_once(&onceControl, InitLock)) {
+        assert(!"pthread_once() failed");
+        return false;
     }
 
-    mutexInitialized = true;
-
-fail:
-    if (pthread_mutexattr_destroy(&attr)) {
-        assert(!"Failed to destroy pthread mutex attributes");
-    }
+    return lockInitialized;
 }
 
 bool
 eGbmHandlesLock(void)
 {
-    if (pthread_once(&onceControl, InitMutex)) {
-        assert(!"pthread_once() failed");
+    if (!EnsureLockInitialized() || pthread_rwlock_wrlock(&handlesLock)) {
+        assert(!"Failed to lock handles lock for writing");
         return false;
     }
 
-    if (!mutexInitialized || pthread_mutex_lock(&handlesMutex)) {
-        assert(!"Failed to lock handles mutex");
+    return true;
+}
+
+bool
+eGbmHandlesReadLock(void)
+{
+    if (!EnsureLockInitialized() || pthread_rwlock_rdlock(&handlesLock)) {
+        assert(!"Failed to lock handles lock for reading");
         return false;
     }
 
@@ -66,9 +66,9 @@ eGbmHandlesLock(void)
 void
 eGbmHandlesUnlock(void)
 {
-    assert(mutexInitialized);
+    assert(lockInitialized);
 
-    if (pthread_mutex_unlock(&handlesMutex))
-        assert(!"Failed to unlock pthread mutex");
+    if (pthread_rwlock_unlock(&handlesLock))
+        assert(!"Failed to unlock handles lock");
 }
 
@@ -9,7 +9,13 @@
 
 #include <stdbool.h>
 
+/*
+ * The handles lock is a reader-writer lock. Lookups take it for reading, and
+ * anything that adds or removes handles takes it for writing.
+ * eGbmHandlesUnlock releases it in either case.
+ */
 bool eGbmHandlesLock(void);
+bool eGbmHandlesReadLock(void);
 void eGbmHandlesUnlock(void);
 
 #endif /* GBM_MUTEX_H */
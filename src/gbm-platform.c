@@ -6,8 +6,10 @@
 
 #include "gbm-utils.h"
 #include "gbm-display.h"
+#include "gbm-image.h"
 #include "gbm-platform.h"
 #include "gbm-surface.h"
+#include "gbm-trace.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -16,17 +18,23 @@
 static void
 DestroyPlatformData(GbmPlatformData* data)
 {
+    pthread_mutex_destroy(&data->mutex);
+    free(data->devices.entries);
     free(data);
 }
 
 static GbmPlatformData*
 CreatePlatformData(const EGLExtDriver *driver)
 {
-    const char* clExts;
     GbmPlatformData *res = calloc(1, sizeof(*res));
 
     if (!res) return NULL;
 
+    if (pthread_mutex_init(&res->mutex, NULL)) {
+        free(res);
+        return NULL;
+    }
+
 #if defined(RTLD_DEFAULT)
     res->ptr_gbm_device_get_backend_name = dlsym(RTLD_DEFAULT, "gbm_device_get_backend_name");
     if (res->ptr_gbm_device_get_backend_name == NULL) {
@@ -46,20 +54,20 @@ CreatePlatformData(const EGLExtDriver *driver)
 
     res->driver.setError = driver->setError;
 
-    clExts = res->egl.QueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    eGbmTraceInit();
+    eGbmErrorLogInit();
+
+    res->clientExts =
+        eGbmParseExtensions(res->egl.QueryString(EGL_NO_DISPLAY,
+                                                 EGL_EXTENSIONS));
 
-    if (!eGbmFindExtension("EGL_EXT_platform_device", clExts) ||
-        (!eGbmFindExtension("EGL_EXT_device_query", clExts) &&
-         !eGbmFindExtension("EGL_EXT_device_base", clExts))) {
+    if (!eGbmHasExtension(res->clientExts, EXT_platform_device) ||
+        (!eGbmHasExtension(res->clientExts, EXT_device_query) &&
+         !eGbmHasExtension(res->clientExts, EXT_device_base))) {
         DestroyPlatformData(res);
         return NULL;
     }
 
-    if (eGbmFindExtension("EGL_KHR_display_reference", clExts))
-        res->supportsDisplayReference = true;
-    else
-        res->supportsDisplayReference = false;
-
     return res;
 }
 
@@ -88,7 +96,7 @@ CreatePlatformPixmapSurfaceHook(EGLDisplay dpy,
      * unmodified from the EGLDevice, would support rendering to pixmaps even
      * if GBM did.
      */
-    eGbmSetError(display->data, EGL_BAD_MATCH);
+    eGbmSetObjectError(&display->base, EGL_BAD_MATCH);
     eGbmUnrefObject(&display->base);
 
     return EGL_NO_SURFACE;
@@ -100,31 +108,287 @@ CreatePbufferSurfaceHook(EGLDisplay dpy,
                          const EGLint *attribs)
 {
     GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
-    GbmPlatformData* data = display->data;
+    EGLSurface surf;
 
     if (!display) {
         /*  No platform data. Can't set error EGL_NO_DISPLAY */
         return EGL_NO_SURFACE;
     }
 
-    return data->egl.CreatePbufferSurface(display->devDpy, config, attribs);
+    /*
+     * Pbuffers are private to the driver, so there is no way to hand their
+     * contents to another API without a copy. Applications that need
+     * offscreen rendering they can export as dma-bufs use
+     * eGbmCreateOffscreenSurface() instead, whose color buffers are handed
+     * out as gbm_bos.
+     */
+    surf = display->data->egl.CreatePbufferSurface(display->devDpy,
+                                                   config, attribs);
+    eGbmUnrefObject(&display->base);
+
+    return surf;
+}
+
+/*
+ * Versions of the hooks below that wrap the call in a trace slice. These are
+ * returned from GetHookAddressExport() instead when tracing is enabled, so
+ * that the untraced entry points don't pay for it.
+ */
+static EGLBoolean
+TracedChooseConfigHook(EGLDisplay dpy,
+                       EGLint const* attribs,
+                       EGLConfig* configs,
+                       EGLint configSize,
+                       EGLint *numConfig)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglChooseConfig", dpy, -1);
+    ret = eGbmChooseConfigHook(dpy, attribs, configs, configSize, numConfig);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLImage
+TracedCreateImageHook(EGLDisplay dpy,
+                      EGLContext ctx,
+                      EGLenum target,
+                      EGLClientBuffer buffer,
+                      const EGLAttrib* attribs)
+{
+    EGLImage ret;
+
+    eGbmTraceBegin("eglCreateImage", buffer, -1);
+    ret = eGbmCreateImageHook(dpy, ctx, target, buffer, attribs);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLImageKHR
+TracedCreateImageKHRHook(EGLDisplay dpy,
+                         EGLContext ctx,
+                         EGLenum target,
+                         EGLClientBuffer buffer,
+                         const EGLint* attribs)
+{
+    EGLImageKHR ret;
+
+    eGbmTraceBegin("eglCreateImageKHR", buffer, -1);
+    ret = eGbmCreateImageKHRHook(dpy, ctx, target, buffer, attribs);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLSurface
+TracedCreatePbufferSurfaceHook(EGLDisplay dpy,
+                               EGLConfig config,
+                               const EGLint *attribs)
+{
+    EGLSurface ret;
+
+    eGbmTraceBegin("eglCreatePbufferSurface", dpy, -1);
+    ret = CreatePbufferSurfaceHook(dpy, config, attribs);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLSurface
+TracedCreatePlatformPixmapSurfaceHook(EGLDisplay dpy,
+                                      EGLConfig config,
+                                      void *nativePixmap,
+                                      const EGLAttrib *attribs)
+{
+    EGLSurface ret;
+
+    eGbmTraceBegin("eglCreatePlatformPixmapSurface", dpy, -1);
+    ret = CreatePlatformPixmapSurfaceHook(dpy, config, nativePixmap, attribs);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLSurface
+TracedCreatePlatformWindowSurfaceHook(EGLDisplay dpy,
+                                      EGLConfig config,
+                                      void* nativeWin,
+                                      const EGLAttrib* attribs)
+{
+    EGLSurface ret;
+
+    eGbmTraceBegin("eglCreatePlatformWindowSurface", nativeWin, -1);
+    ret = eGbmCreatePlatformWindowSurfaceHook(dpy, config, nativeWin, attribs);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLBoolean
+TracedDestroyImageHook(EGLDisplay dpy, EGLImage image)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglDestroyImage", image, -1);
+    ret = eGbmDestroyImageHook(dpy, image);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLBoolean
+TracedDestroyImageKHRHook(EGLDisplay dpy, EGLImageKHR image)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglDestroyImageKHR", image, -1);
+    ret = eGbmDestroyImageKHRHook(dpy, image);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLBoolean
+TracedDestroySurfaceHook(EGLDisplay dpy, EGLSurface eglSurf)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglDestroySurface", eglSurf, -1);
+    ret = eGbmDestroySurfaceHook(dpy, eglSurf);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLBoolean
+TracedGetConfigAttribHook(EGLDisplay dpy,
+                          EGLConfig config,
+                          EGLint attribute,
+                          EGLint* value)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglGetConfigAttrib", dpy, -1);
+    ret = eGbmGetConfigAttribHook(dpy, config, attribute, value);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLBoolean
+TracedInitializeHook(EGLDisplay dpy, EGLint* major, EGLint* minor)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglInitialize", dpy, -1);
+    ret = eGbmInitializeHook(dpy, major, minor);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLBoolean
+TracedQuerySurfaceHook(EGLDisplay dpy,
+                       EGLSurface eglSurf,
+                       EGLint attribute,
+                       EGLint* value)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglQuerySurface", eglSurf, -1);
+    ret = eGbmQuerySurfaceHook(dpy, eglSurf, attribute, value);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLBoolean
+TracedSwapBuffersHook(EGLDisplay dpy, EGLSurface eglSurf)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglSwapBuffers", eglSurf, -1);
+    ret = eGbmSwapBuffersHook(dpy, eglSurf);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLBoolean
+TracedSwapBuffersWithDamageEXTHook(EGLDisplay dpy,
+                                   EGLSurface eglSurf,
+                                   const EGLint* rects,
+                                   EGLint numRects)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglSwapBuffersWithDamageEXT", eglSurf, -1);
+    ret = eGbmSwapBuffersWithDamageEXTHook(dpy, eglSurf, rects, numRects);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLBoolean
+TracedSwapBuffersWithDamageKHRHook(EGLDisplay dpy,
+                                   EGLSurface eglSurf,
+                                   const EGLint* rects,
+                                   EGLint numRects)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglSwapBuffersWithDamageKHR", eglSurf, -1);
+    ret = eGbmSwapBuffersWithDamageKHRHook(dpy, eglSurf, rects, numRects);
+    eGbmTraceEnd();
+
+    return ret;
+}
+
+static EGLBoolean
+TracedTerminateHook(EGLDisplay dpy)
+{
+    EGLBoolean ret;
+
+    eGbmTraceBegin("eglTerminate", dpy, -1);
+    ret = eGbmTerminateHook(dpy);
+    eGbmTraceEnd();
+
+    return ret;
 }
 
 typedef struct GbmEglHookRec {
     const char *name;
     void *func;
+    void *traced;
 } GbmEglHook;
 
 static const GbmEglHook EglHooksMap[] = {
     /* Keep names in ascending order */
-    { "eglChooseConfig", eGbmChooseConfigHook },
-    { "eglCreatePbufferSurface", CreatePbufferSurfaceHook },
-    { "eglCreatePlatformPixmapSurface", CreatePlatformPixmapSurfaceHook },
-    { "eglCreatePlatformWindowSurface", eGbmCreatePlatformWindowSurfaceHook },
-    { "eglDestroySurface", eGbmDestroySurfaceHook },
-    { "eglGetConfigAttrib", eGbmGetConfigAttribHook },
-    { "eglInitialize", eGbmInitializeHook },
-    { "eglTerminate", eGbmTerminateHook },
+    { "eglChooseConfig", eGbmChooseConfigHook, TracedChooseConfigHook },
+    { "eglCreateImage", eGbmCreateImageHook, TracedCreateImageHook },
+    { "eglCreateImageKHR", eGbmCreateImageKHRHook, TracedCreateImageKHRHook },
+    { "eglCreatePbufferSurface", CreatePbufferSurfaceHook,
+      TracedCreatePbufferSurfaceHook },
+    { "eglCreatePlatformPixmapSurface", CreatePlatformPixmapSurfaceHook,
+      TracedCreatePlatformPixmapSurfaceHook },
+    { "eglCreatePlatformWindowSurface", eGbmCreatePlatformWindowSurfaceHook,
+      TracedCreatePlatformWindowSurfaceHook },
+    { "eglDestroyImage", eGbmDestroyImageHook, TracedDestroyImageHook },
+    { "eglDestroyImageKHR", eGbmDestroyImageKHRHook,
+      TracedDestroyImageKHRHook },
+    { "eglDestroySurface", eGbmDestroySurfaceHook, TracedDestroySurfaceHook },
+    { "eglGetConfigAttrib", eGbmGetConfigAttribHook,
+      TracedGetConfigAttribHook },
+    { "eglInitialize", eGbmInitializeHook, TracedInitializeHook },
+    { "eglQuerySurface", eGbmQuerySurfaceHook, TracedQuerySurfaceHook },
+    { "eglSwapBuffers", eGbmSwapBuffersHook, TracedSwapBuffersHook },
+    { "eglSwapBuffersWithDamageEXT", eGbmSwapBuffersWithDamageEXTHook,
+      TracedSwapBuffersWithDamageEXTHook },
+    { "eglSwapBuffersWithDamageKHR", eGbmSwapBuffersWithDamageKHRHook,
+      TracedSwapBuffersWithDamageKHRHook },
+    { "eglTerminate", eGbmTerminateHook, TracedTerminateHook },
 };
 
 static int
@@ -148,7 +412,7 @@ GetHookAddressExport(void *data, const char *name)
                                 sizeof(GbmEglHook),
                                 HookCmp);
 
-    if (hook) return hook->func;
+    if (hook) return eGbmTraceEnabled() ? hook->traced : hook->func;
 
     return NULL;
 }
@@ -156,6 +420,7 @@ GetHookAddressExport(void *data, const char *name)
 static EGLBoolean
 UnloadPlatformExport(void *data)
 {
+    eGbmErrorLogFlush();
     DestroyPlatformData(data);
     return EGL_TRUE;
 }
@@ -8,6 +8,8 @@
 #define GBM_PLATFORM_H
 
 #include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
@@ -52,6 +54,15 @@
 
 #define EGBM_EXPORT __attribute__ ((visibility ("default")))
 
+typedef struct GbmDeviceCacheEntryRec {
+    EGLDeviceEXT dev;
+    /* Device numbers of the DRM device file and render node, if any */
+    dev_t primary;
+    dev_t render;
+    bool hasPrimary;
+    bool hasRender;
+} GbmDeviceCacheEntry;
+
 typedef struct GbmPlatformDataRec {
     struct {
 #define DO_EGL_FUNC(_PROTO, _FUNC) \
@@ -64,7 +75,21 @@ typedef struct GbmPlatformDataRec {
         PEGLEXTFNSETERROR setError;
     } driver;
 
-    bool supportsDisplayReference;
+    /* GbmExtensionSet of the client extensions */
+    uint64_t clientExts;
+
+    /* Protects the device cache and the display list */
+    pthread_mutex_t mutex;
+
+    /* All displays created by eglGetPlatformDisplay */
+    struct GbmDisplayRec* displays;
+
+    /* EGLDevices with DRM device files, enumerated on first use */
+    struct {
+        GbmDeviceCacheEntry* entries;
+        EGLint numEntries;
+        bool initialized;
+    } devices;
 
     const char * (* ptr_gbm_device_get_backend_name) (struct gbm_device *gbm);
 } GbmPlatformData;
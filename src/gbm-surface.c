@@ -7,64 +7,303 @@
 #include "gbm-surface.h"
 #include "gbm-display.h"
 #include "gbm-utils.h"
+#include "gbm-trace.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <EGL/eglext.h>
 #include <gbmint.h>
+#include <drm_fourcc.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
 
-#define MAX_STREAM_IMAGES 10
+#define MAX_STREAM_IMAGES 16
 
-// One front, one back.
+/* Size of the maps used to look up images. Must be a power of two. */
+#define IMAGE_MAP_SIZE (MAX_STREAM_IMAGES * 2)
+
+// One front, one back by default.
 #define WINDOW_STREAM_FIFO_LENGTH 2
 
+/*
+ * Range of FIFO lengths applications may request using the
+ * EGL_STREAM_FIFO_LENGTH_KHR window surface attribute or the
+ * EGL_GBM_FIFO_LENGTH environment variable.
+ */
+#define MIN_WINDOW_STREAM_FIFO_LENGTH 2
+#define MAX_WINDOW_STREAM_FIFO_LENGTH 4
+
+/*
+ * The number of imported buffer objects that are kept around after the stream
+ * removes the image they were created for, in case the stream adds the same
+ * buffer back later.
+ */
+#define MAX_IDLE_IMPORTS 2
+#define MAX_IMPORT_CACHE_ENTRIES (MAX_STREAM_IMAGES + MAX_IDLE_IMPORTS)
+
+/* The number of destroyed window surfaces kept for reuse per display */
+#define MAX_POOLED_SURFACES 4
+
+/*
+ * The number of damage rectangles tracked per frame. Damage that doesn't fit
+ * is replaced by its bounding box.
+ */
+#define MAX_DAMAGE_RECTS 16
+
+/*
+ * Damage is stored as x, y, width, height rectangles relative to the top-left
+ * corner of the buffer, the same convention as KMS FB_DAMAGE_CLIPS.
+ */
+typedef struct GbmDamageRec {
+    bool full;
+    int numRects;
+    EGLint rects[MAX_DAMAGE_RECTS * 4];
+} GbmDamage;
+
+typedef struct GbmImportCacheEntryRec {
+    /* Identity of each plane's exported dma-buf and the layout */
+    dev_t devs[GBM_MAX_PLANES];
+    ino_t inos[GBM_MAX_PLANES];
+    uint64_t modifier;
+    uint32_t numPlanes;
+    int strides[GBM_MAX_PLANES];
+    int offsets[GBM_MAX_PLANES];
+    bool identified;
+
+    struct gbm_bo* bo;
+    unsigned int lastUse;
+    bool inUse;
+} GbmImportCacheEntry;
+
+/*
+ * Counters used to attribute latency to the individual steps of handing a
+ * frame from the stream to the application. They are only maintained if the
+ * EGL_GBM_STATS environment variable is set and tracing is enabled with
+ * EGL_GBM_TRACE, in which case they are written to the trace as counter
+ * events when the surface is destroyed, and every EGL_GBM_STATS_INTERVAL
+ * locked frames if that is also set. All times are in nanoseconds.
+ */
+typedef struct GbmSurfaceStatsRec {
+    bool enabled;
+    unsigned int interval;
+
+    uint64_t acquired;          /* Frames acquired from the stream */
+    uint64_t locked;            /* Frames locked by the application */
+    uint64_t dropped;           /* Frames released without being locked */
+    uint64_t stalls;            /* Times buffers ran out, not queries */
+    bool stalled;               /* The last query found no buffer */
+
+    uint64_t acquireWaitTime;   /* Time spent waiting for rendering to finish */
+    uint64_t maxAcquireWaitTime;
+
+    uint64_t importHits;        /* Locks that found a cached buffer object */
+    uint64_t imports;           /* Buffer objects imported into GBM */
+    uint64_t importTime;        /* Time spent exporting and importing images */
+    uint64_t maxImportTime;
+
+    uint64_t freeImagesSum;     /* Sum of numFreeImages at each lock */
+    int minFreeImages;
+} GbmSurfaceStats;
+
+/*
+ * An open-addressed hash map from EGLImage or gbm_bo pointers to indices in
+ * GbmSurface::images.
+ */
+typedef struct GbmImageMapRec {
+    const void* keys[IMAGE_MAP_SIZE];
+    unsigned int slots[IMAGE_MAP_SIZE];
+} GbmImageMap;
+
 typedef struct GbmSurfaceImageRec {
     EGLImage image;
     struct gbm_bo* bo;
     struct GbmSurfaceImageRec* nextAcquired;
+    struct GbmSurfaceImageRec* prevAcquired;
+    bool acquired;
+    /*
+     * Native fence signaled when rendering to the image completes, if the
+     * surface was created in native fence mode. Owned by the image, and kept
+     * while it is locked so the fence stays tied to the buffer it belongs to.
+     */
+    int fenceFd;
+    /*
+     * The sync object the image was acquired with, until rendering to it is
+     * known to be complete.
+     */
+    EGLSyncKHR sync;
     bool locked;
+    /*
+     * Damage relative to the frame the application locked before this one.
+     * This includes the damage of any frames in between that were released
+     * without being locked.
+     */
+    GbmDamage damage;
 } GbmSurfaceImage;
 
 typedef struct GbmSurfaceRec {
     GbmObject base;
+    struct gbm_surface* gbmSurf;
+    /* gbmSurf was created by eGbmCreateOffscreenSurface() and is ours */
+    bool ownsGbmSurf;
+
+    /*
+     * Serializes eglSwapBuffers, which the application calls on its rendering
+     * thread, with the gbm_surface_* calls a compositor may make on another
+     * one. It protects the images, the acquired list, numFreeImages, the
+     * damage ring and the import cache. The driver's swap itself is made
+     * without holding it, since the driver may block until the compositor
+     * releases a buffer. Waiting for rendering in
+     * gbm_surface_lock_front_buffer does hold it, since that doesn't depend
+     * on the other thread.
+     */
+    pthread_mutex_t mutex;
+
+    /*
+     * The parameters the stream and producer surface were created with,
+     * which a new surface must match to reuse them once this one has been
+     * destroyed.
+     */
+    EGLConfig config;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t flags;
+    uint64_t* modifiers;
+    unsigned int numModifiers;
+    struct GbmSurfaceRec* nextPooled;
+
+    /*
+     * The first thread the driver translated this surface's handle for,
+     * identified by the address of a thread local variable, and whether any
+     * other thread did as well. The driver translates the handle when the
+     * surface is made current, so a surface that never was can't be current
+     * in any context.
+     */
+    const void* boundThread;
+    bool boundElsewhere;
+
     EGLStreamKHR stream;
     EGLSurface egl;
-    EGLSyncKHR sync;
+
+    /*
+     * A ring of reusable sync objects, one per FIFO slot, used to acquire
+     * images from the stream. The sync for a frame is only waited on when
+     * the frame is locked, so acquiring a frame never blocks, and the syncs
+     * of several acquired frames can be pending at once. At most fifoLength
+     * frames can be acquired at any time, so a sync is never reused before
+     * the frame it was acquired with has been waited on or released.
+     */
+    EGLSyncKHR syncs[MAX_WINDOW_STREAM_FIFO_LENGTH];
+    unsigned int nextSync;
+
+    /*
+     * If true, the stream acquires images using a native fence sync object,
+     * and the resulting fence fd is handed to the application rather than
+     * waiting for rendering to complete on the CPU. The fence belonging to
+     * a locked buffer can be retrieved with eGbmSurfaceGetBufferFence(), and
+     * that of the most recently locked buffer by querying
+     * EGL_SYNC_NATIVE_FENCE_FD_ANDROID on the EGLSurface.
+     */
+    bool useFenceFd;
+    /* Native fences were requested, but the driver couldn't provide them */
+    bool fenceFdFallback;
+    /* The slot of the most recently locked image, or -1 */
+    int lastLocked;
+
     GbmSurfaceImage images[MAX_STREAM_IMAGES];
+    GbmImageMap imageMap;
+    GbmImageMap boMap;
+
+    /*
+     * The number of EGL_STREAM_IMAGE_ADD_NV events received for which no
+     * EGLImage has been created yet. Image creation is deferred until the
+     * stream presents or removes an image, so surface creation doesn't pay
+     * for it and images that are never used are never created.
+     */
+    unsigned int numPendingImages;
+
     struct {
         GbmSurfaceImage *first;
         GbmSurfaceImage *last;
     } acquiredImages;
 
+    /*
+     * The length of the stream's FIFO, i.e. the number of color buffers the
+     * producer may have queued or locked at once.
+     */
+    int fifoLength;
+
     /*
      * The number of free color buffers. This is initially set to the stream's
      * FIFO length, and updated whenever we acquire or release an EGLImage
      * to/from the stream.
+     */
+    int numFreeImages;
+
+    /*
+     * If true, only the newest swapped frame can be locked. In eglSwapBuffers
+     * and gbm_surface_lock_front_buffer, all acquired but unlocked images
+     * from older swaps are released back to the stream. This matches Mesa's
+     * GBM platform, and avoids filling up the FIFO if the application calls
+     * eglSwapBuffers more times than the FIFO depth without calling
+     * gbm_surface_lock_front_buffer.
      *
-     * FIXME: Our EGLImage handling is wrong: If the application calls
-     * eglSwapBuffers more than once without calling
-     * gbm_surface_lock_front_buffer, then gbm_surface_lock_front_buffer will
-     * return the buffer from the oldest swap, but it should return the newest
-     * swap.
-     *
-     * Also, if an application calls eglSwapBuffers more times than the FIFO
-     * depth without calling gbm_surface_lock_front_buffer, then it will fill
-     * up the FIFO and hang.
+     * Otherwise, gbm_surface_lock_front_buffer returns the buffer from the
+     * oldest swap that hasn't been locked yet. This is the default, since
+     * applications written against it expect every swapped frame to be
+     * handed out. Mailbox mode is enabled by setting EGL_GBM_MAILBOX to a
+     * non-zero value.
+     */
+    bool mailbox;
+
+    /*
+     * Stream consumer events are only generated when the producer adds
+     * images to the stream or presents a frame, which happens at creation
+     * time and in eglSwapBuffers. This is set at those points and cleared
+     * whenever the events are pumped, so gbm_surface_has_free_buffers only
+     * needs to query the driver when something may actually have changed.
      *
-     * To get something closer to correct behavior, in eglSwapBuffers we'd need
-     * to call eglStreamReleaseImageNV on all unlocked buffers, then call into
-     * the driver's eglSwapBuffers, and then call eglStreamAcquireImageNV to
-     * fetch the EGLImage for that frame. That would require adding an
-     * eglSwapBuffers hook and rewriting eGbmSurfaceLockFrontBuffer and
-     * eGbmSurfaceReleaseBuffer.
+     * If a frame shows up that didn't go through eglSwapBuffers, e.g. one
+     * presented by an extension entry point this library doesn't hook,
+     * trackSwaps is cleared and the events are pumped on every call again.
      */
-    int numFreeImages;
+    bool pumpNeeded;
+    bool trackSwaps;
+
+    /*
+     * Damage of frames that have been swapped but not acquired yet, in swap
+     * order, and damage of frames that were released without being locked
+     * that still needs to be added to the next acquired frame.
+     */
+    struct {
+        GbmDamage frames[MAX_STREAM_IMAGES];
+        unsigned int first;
+        unsigned int count;
+    } pendingDamage;
+    GbmDamage carriedDamage;
+
+    /*
+     * Buffer objects imported from the stream's images. These are owned by
+     * the cache rather than by the images so that a buffer the stream removes
+     * and later adds back again does not need to be imported a second time.
+     */
+    struct {
+        GbmImportCacheEntry entries[MAX_IMPORT_CACHE_ENTRIES];
+        unsigned int clock;
+    } importCache;
+
+    GbmSurfaceStats stats;
 } GbmSurface;
 
+/* Only its address is used, to identify the calling thread */
+static __thread char threadTag;
+
 /*
  * Returns a pointer to a pointer in the NV-private structure that wraps the
  * gbm_surface structure. This pointer is reserved for use by this library.
@@ -91,308 +330,1315 @@ SetSurf(struct gbm_surface* s, GbmSurface *surf)
     *priv = surf;
 }
 
-static bool
-AddSurfImage(GbmDisplay* display, GbmSurface* surf)
+static inline void
+CloseFenceFd(int* fd)
 {
-    GbmPlatformData* data = display->data;
-    unsigned int i;
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
 
-    for (i = 0; i < ARRAY_LEN(surf->images); i++) {
-        if (surf->images[i].image == EGL_NO_IMAGE_KHR &&
-            surf->images[i].bo == NULL) {
-            surf->images[i].image =
-                data->egl.CreateImageKHR(display->devDpy,
-                                         EGL_NO_CONTEXT,
-                                         EGL_STREAM_CONSUMER_IMAGE_NV,
-                                         (EGLClientBuffer)surf->stream,
-                                         NULL);
-            if (surf->images[i].image == EGL_NO_IMAGE_KHR) break;
+static inline uint64_t
+StatsBeginTimer(const GbmSurface* surf)
+{
+    return surf->stats.enabled ? eGbmGetTimeNs() : 0;
+}
 
-            return true;
-        }
+static inline void
+StatsEndTimer(const GbmSurface* surf, uint64_t start,
+              uint64_t* total, uint64_t* max)
+{
+    uint64_t elapsed;
+
+    if (!surf->stats.enabled) return;
+
+    elapsed = eGbmGetTimeNs() - start;
+    *total += elapsed;
+    if (elapsed > *max) *max = elapsed;
+}
+
+static inline uint64_t
+StatsAverage(uint64_t total, uint64_t count)
+{
+    return count ? total / count : 0;
+}
+
+static void
+DumpSurfStats(const GbmSurface* surf)
+{
+    const GbmSurfaceStats* stats = &surf->stats;
+
+    eGbmTraceCounter("egl-gbm acquired", surf, stats->acquired);
+    eGbmTraceCounter("egl-gbm locked", surf, stats->locked);
+    eGbmTraceCounter("egl-gbm dropped", surf, stats->dropped);
+    eGbmTraceCounter("egl-gbm stalls", surf, stats->stalls);
+    eGbmTraceCounter("egl-gbm acquire wait avg us", surf,
+                     StatsAverage(stats->acquireWaitTime,
+                                  stats->acquired) / 1000);
+    eGbmTraceCounter("egl-gbm acquire wait max us", surf,
+                     stats->maxAcquireWaitTime / 1000);
+    eGbmTraceCounter("egl-gbm imports", surf, stats->imports);
+    eGbmTraceCounter("egl-gbm import cache hits", surf, stats->importHits);
+    eGbmTraceCounter("egl-gbm export avg us", surf,
+                     StatsAverage(stats->importTime,
+                                  stats->imports + stats->importHits) / 1000);
+    eGbmTraceCounter("egl-gbm export max us", surf,
+                     stats->maxImportTime / 1000);
+    eGbmTraceCounter("egl-gbm free buffers at lock min", surf,
+                     stats->locked ? stats->minFreeImages :
+                     surf->numFreeImages);
+}
+
+static GbmImportCacheEntry*
+FindCachedImport(GbmSurface* surf, const struct gbm_bo* bo)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_LEN(surf->importCache.entries); i++) {
+        if (surf->importCache.entries[i].bo == bo)
+            return &surf->importCache.entries[i];
     }
 
-    return false;
+    return NULL;
 }
 
 static void
-RemoveSurfImage(GbmDisplay* display, GbmSurface* surf, EGLImage img)
+EvictIdleImports(GbmSurface* surf, unsigned int maxIdle)
 {
-    GbmPlatformData* data = display->data;
-    GbmSurfaceImage* acqImg;
-    GbmSurfaceImage* prev = NULL;
+    GbmImportCacheEntry* entries = surf->importCache.entries;
+    GbmImportCacheEntry* oldest;
+    unsigned int numIdle;
     unsigned int i;
 
-    for (i = 0; i < ARRAY_LEN(surf->images); i++) {
-        if (surf->images[i].image == img) {
-            /*
-             * The EGL_NV_stream_consumer_eglimage spec is unclear if removed
-             * images that are currently acquired still need to be released, but
-             * it does say this:
-             *
-             *   If an acquired EGLImage has not yet released when
-             *   eglDestroyImage is called, then, then an implicit
-             *   eglStreamReleaseImageNV will be called.
-             *
-             * so this should be sufficient either way.
-             */
-            data->egl.DestroyImageKHR(display->devDpy, img);
-            surf->images[i].image = EGL_NO_IMAGE_KHR;
-            if (!surf->images[i].locked && surf->images[i].bo) {
-                gbm_bo_destroy(surf->images[i].bo);
-                surf->images[i].bo = NULL;
-            } else {
-                /*
-                 * If the image is currently acquired from the stream and
-                 * available for locking, remove it from the acquired images list.
-                 */
-                for (acqImg = surf->acquiredImages.first;
-                     acqImg;
-                     prev = acqImg, acqImg = acqImg->nextAcquired) {
-                    if (acqImg == &surf->images[i]) {
-                        if (prev)
-                            prev->nextAcquired = acqImg->nextAcquired;
-                        else
-                            surf->acquiredImages.first = acqImg->nextAcquired;
-
-                        if (surf->acquiredImages.last == acqImg)
-                            surf->acquiredImages.last = prev;
-
-                        assert(surf->numFreeImages < WINDOW_STREAM_FIFO_LENGTH);
-                        surf->numFreeImages++;
-                        break;
-                    }
-                }
-            }
+    while (true) {
+        oldest = NULL;
+        numIdle = 0;
 
-            break;
+        for (i = 0; i < ARRAY_LEN(surf->importCache.entries); i++) {
+            if (!entries[i].bo || entries[i].inUse) continue;
+
+            numIdle++;
+            if (!oldest || entries[i].lastUse < oldest->lastUse)
+                oldest = &entries[i];
         }
+
+        if (numIdle <= maxIdle) break;
+
+        gbm_bo_destroy(oldest->bo);
+        memset(oldest, 0, sizeof(*oldest));
     }
 }
 
-static bool AcquireSurfImage(GbmDisplay* display, GbmSurface* surf)
+/*
+ * Called when an image no longer references its buffer object. The buffer
+ * object stays in the import cache until it is evicted.
+ */
+static void
+ReleaseCachedImport(GbmSurface* surf, struct gbm_bo* bo)
 {
-    GbmPlatformData* data = display->data;
-    EGLDisplay dpy = display->devDpy;
-    GbmSurfaceImage* image = NULL;
-    EGLImage img;
+    GbmImportCacheEntry* entry = FindCachedImport(surf, bo);
+
+    assert(entry && entry->inUse);
+
+    if (!entry) return;
+
+    entry->inUse = false;
+    EvictIdleImports(surf, MAX_IDLE_IMPORTS);
+}
+
+/*
+ * Look up or import a buffer object for the dma-buf described by <buf>. On
+ * return, the file descriptors in <buf> are no longer needed and may be
+ * closed by the caller.
+ */
+static struct gbm_bo*
+ImportCachedBo(GbmSurface* surf, struct gbm_import_fd_modifier_data* buf)
+{
+    GbmImportCacheEntry* entries = surf->importCache.entries;
+    GbmImportCacheEntry* entry = NULL;
+    dev_t devs[GBM_MAX_PLANES];
+    ino_t inos[GBM_MAX_PLANES];
+    struct stat statbuf;
+    struct gbm_bo* bo;
     unsigned int i;
-    EGLBoolean res;
+    bool identified = true;
 
-    res = data->egl.StreamAcquireImageNV(dpy,
-                                         surf->stream,
-                                         &img,
-                                         surf->sync);
+    /*
+     * Every plane may be backed by a different memory object, so all of
+     * them are part of the identity. If the buffer can't be identified,
+     * import it anyway, but never hand it out again for a different image.
+     */
+    memset(devs, 0, sizeof(devs));
+    memset(inos, 0, sizeof(inos));
+    memset(&statbuf, 0, sizeof(statbuf));
+
+    for (i = 0; identified && i < buf->num_fds; i++) {
+        identified = !fstat(buf->fds[i], &statbuf);
+        devs[i] = statbuf.st_dev;
+        inos[i] = statbuf.st_ino;
+    }
 
-    if (!res) {
-        /*
-         * Match Mesa EGL dri2 platform behavior when no buffer is available
-         * even though this function is not called from an EGL entry point
-         */
-        eGbmSetError(data, EGL_BAD_SURFACE);
-        return false;
+    for (i = 0; identified && i < ARRAY_LEN(surf->importCache.entries); i++) {
+        if (entries[i].bo && !entries[i].inUse && entries[i].identified &&
+            !memcmp(entries[i].devs, devs, sizeof(devs)) &&
+            !memcmp(entries[i].inos, inos, sizeof(inos)) &&
+            entries[i].modifier == buf->modifier &&
+            entries[i].numPlanes == buf->num_fds &&
+            !memcmp(entries[i].strides, buf->strides,
+                    sizeof(entries[i].strides)) &&
+            !memcmp(entries[i].offsets, buf->offsets,
+                    sizeof(entries[i].offsets))) {
+            entry = &entries[i];
+            surf->stats.importHits++;
+            goto done;
+        }
     }
 
-    if (data->egl.ClientWaitSyncKHR(dpy, surf->sync, 0, EGL_FOREVER_KHR) !=
-        EGL_CONDITION_SATISFIED_KHR) {
-        /* Release the image back to the stream */
-        data->egl.StreamReleaseImageNV(dpy,
-                                       surf->stream,
-                                       img,
-                                       surf->sync);
-        /* Not clear what error to use. Pretend no buffer was available. */
-        eGbmSetError(data, EGL_BAD_SURFACE);
-        return false;
+    surf->stats.imports++;
+
+    bo = gbm_bo_import(surf->base.dpy->gbm, GBM_BO_IMPORT_FD_MODIFIER, buf, 0);
+
+    if (!bo) return NULL;
+
+    /* Make room for the new entry if all of them are occupied */
+    for (i = 0; i < ARRAY_LEN(surf->importCache.entries); i++) {
+        if (!entries[i].bo) break;
     }
 
-    for (i = 0; i < ARRAY_LEN(surf->images); i++) {
-        if (surf->images[i].image == img) {
-            image = &surf->images[i];
-            break;
+    if (i >= ARRAY_LEN(surf->importCache.entries)) {
+        EvictIdleImports(surf, 0);
+
+        for (i = 0; i < ARRAY_LEN(surf->importCache.entries); i++) {
+            if (!entries[i].bo) break;
         }
     }
 
-    if (surf->acquiredImages.last)
-        surf->acquiredImages.last->nextAcquired = image;
-    else
-        surf->acquiredImages.first = image;
-    surf->acquiredImages.last = image;
-    surf->numFreeImages--;
+    /* Only MAX_STREAM_IMAGES entries can be in use at once */
+    assert(i < ARRAY_LEN(surf->importCache.entries));
 
-    return true;
+    entry = &entries[i];
+    memcpy(entry->devs, devs, sizeof(entry->devs));
+    memcpy(entry->inos, inos, sizeof(entry->inos));
+    entry->modifier = buf->modifier;
+    entry->numPlanes = buf->num_fds;
+    memcpy(entry->strides, buf->strides, sizeof(entry->strides));
+    memcpy(entry->offsets, buf->offsets, sizeof(entry->offsets));
+    entry->identified = identified;
+    entry->bo = bo;
+
+done:
+    entry->inUse = true;
+    entry->lastUse = ++surf->importCache.clock;
+
+    return entry->bo;
 }
 
-static bool
-PumpSurfEvents(GbmDisplay* display, GbmSurface* surf)
+static inline unsigned int
+ImageMapHash(const void* key)
 {
-    GbmPlatformData* data = display->data;
-    EGLenum event;
-    EGLAttrib aux;
-    EGLint evStatus;
-
-    while (true) {
-        evStatus = data->egl.QueryStreamConsumerEventNV(display->devDpy,
-                                                        surf->stream,
-                                                        0,
-                                                        &event,
-                                                        &aux);
+    uintptr_t val = (uintptr_t)key;
 
-        if (evStatus != EGL_TRUE) break;
+    val ^= val >> 4;
+    val ^= val >> 12;
 
-        switch (event) {
-        case EGL_STREAM_IMAGE_AVAILABLE_NV:
-            /*
-             * The image must be acquired to clear the IMAGE_AVAILABLE event,
-             * so acquire it here rather than in eGbmSurfaceLockFrontBuffer().
-             */
-            if (!AcquireSurfImage(display, surf)) return false;
-            break;
-        case EGL_STREAM_IMAGE_ADD_NV:
-            if (!AddSurfImage(display, surf)) return false;
-            break;
+    return (unsigned int)(val & (IMAGE_MAP_SIZE - 1));
+}
 
-        case EGL_STREAM_IMAGE_REMOVE_NV:
-            RemoveSurfImage(display, surf, (EGLImage)aux);
-            break;
+/* Returns the image slot for <key>, or -1 if it isn't in <map> */
+static int
+ImageMapFind(const GbmImageMap* map, const void* key)
+{
+    unsigned int i = ImageMapHash(key);
 
-        default:
-            assert(!"Unhandled EGLImage stream consumer event");
+    if (!key) return -1;
 
-        }
+    for (; map->keys[i]; i = (i + 1) & (IMAGE_MAP_SIZE - 1)) {
+        if (map->keys[i] == key) return (int)map->slots[i];
     }
 
-    return evStatus != EGL_FALSE;
+    return -1;
 }
 
-int
-eGbmSurfaceHasFreeBuffers(struct gbm_surface* s)
+static void
+ImageMapInsert(GbmImageMap* map, const void* key, unsigned int slot)
 {
-    GbmSurface* surf = GetSurf(s);
-
-    if (!surf) return 0;
+    unsigned int i = ImageMapHash(key);
 
-    if (!PumpSurfEvents(surf->base.dpy, surf)) return 0;
+    /* The map has room for twice as many entries as there are images */
+    while (map->keys[i] && map->keys[i] != key)
+        i = (i + 1) & (IMAGE_MAP_SIZE - 1);
 
-    return (surf->numFreeImages > 0);
+    map->keys[i] = key;
+    map->slots[i] = slot;
 }
 
-struct gbm_bo*
-eGbmSurfaceLockFrontBuffer(struct gbm_surface* s)
+static void
+ImageMapRemove(GbmImageMap* map, const void* key)
 {
-    GbmSurface* surf = GetSurf(s);
-    GbmSurfaceImage* image;
-    GbmPlatformData* data;
-    EGLDisplay dpy;
-    uint32_t i;
+    unsigned int i = ImageMapHash(key);
+    unsigned int j, home;
 
-    if (!surf) return NULL;
+    for (; map->keys[i]; i = (i + 1) & (IMAGE_MAP_SIZE - 1)) {
+        if (map->keys[i] == key) break;
+    }
 
-    data = surf->base.dpy->data;
-    dpy = surf->base.dpy->devDpy;
+    if (!map->keys[i]) return;
 
-    /* Must pump events to ensure images are created before acquiring them */
-    if (!PumpSurfEvents(surf->base.dpy, surf)) return NULL;
+    /*
+     * Shift later entries of the same probe sequence back so that lookups
+     * don't stop at the hole left behind.
+     */
+    for (j = (i + 1) & (IMAGE_MAP_SIZE - 1);
+         map->keys[j];
+         j = (j + 1) & (IMAGE_MAP_SIZE - 1)) {
+        home = ImageMapHash(map->keys[j]);
+
+        if (((j - home) & (IMAGE_MAP_SIZE - 1)) >=
+            ((j - i) & (IMAGE_MAP_SIZE - 1))) {
+            map->keys[i] = map->keys[j];
+            map->slots[i] = map->slots[j];
+            i = j;
+        }
+    }
 
-    if (!surf->acquiredImages.first) return NULL;
+    map->keys[i] = NULL;
+}
 
-    image = surf->acquiredImages.first;
-    assert(image->image);
+static void
+AppendAcquiredImage(GbmSurface* surf, GbmSurfaceImage* image)
+{
+    assert(!image->acquired);
 
-    if (!image->bo) {
-        struct gbm_import_fd_modifier_data buf;
-        uint64_t modifier;
-        EGLint stride; /* XXX support planar formats */
-        EGLint offset; /* XXX support planar formats */
-        int format;
-        int planes;
-        int fd; /* XXX support planar separate memory objects */
+    image->nextAcquired = NULL;
+    image->prevAcquired = surf->acquiredImages.last;
+    if (surf->acquiredImages.last)
+        surf->acquiredImages.last->nextAcquired = image;
+    else
+        surf->acquiredImages.first = image;
+    surf->acquiredImages.last = image;
+    image->acquired = true;
+}
 
-        if (!data->egl.ExportDMABUFImageQueryMESA(dpy,
-                                                  image->image,
-                                                  &format,
-                                                  &planes,
-                                                  &modifier)) goto fail;
+static void
+UnlinkAcquiredImage(GbmSurface* surf, GbmSurfaceImage* image)
+{
+    assert(image->acquired);
 
-        assert(planes == 1); /* XXX support planar formats */
+    if (image->prevAcquired)
+        image->prevAcquired->nextAcquired = image->nextAcquired;
+    else
+        surf->acquiredImages.first = image->nextAcquired;
 
-        if (!data->egl.ExportDMABUFImageMESA(dpy, image->image,
-                                             &fd, &stride, &offset)) {
-            goto fail;
+    if (image->nextAcquired)
+        image->nextAcquired->prevAcquired = image->prevAcquired;
+    else
+        surf->acquiredImages.last = image->prevAcquired;
+
+    image->nextAcquired = NULL;
+    image->prevAcquired = NULL;
+    image->acquired = false;
+}
+
+static inline void
+DamageSetFull(GbmDamage* damage)
+{
+    damage->full = true;
+    damage->numRects = 0;
+}
+
+static inline void
+DamageClear(GbmDamage* damage)
+{
+    damage->full = false;
+    damage->numRects = 0;
+}
+
+/* Replaces the rectangles in <damage> with their bounding box */
+static void
+DamageCollapse(GbmDamage* damage)
+{
+    EGLint x0, y0, x1, y1;
+    int i;
+
+    if (damage->numRects < 2) return;
+
+    x0 = damage->rects[0];
+    y0 = damage->rects[1];
+    x1 = x0 + damage->rects[2];
+    y1 = y0 + damage->rects[3];
+
+    for (i = 1; i < damage->numRects; i++) {
+        const EGLint* r = &damage->rects[i * 4];
+
+        if (r[0] < x0) x0 = r[0];
+        if (r[1] < y0) y0 = r[1];
+        if (r[0] + r[2] > x1) x1 = r[0] + r[2];
+        if (r[1] + r[3] > y1) y1 = r[1] + r[3];
+    }
+
+    damage->rects[0] = x0;
+    damage->rects[1] = y0;
+    damage->rects[2] = x1 - x0;
+    damage->rects[3] = y1 - y0;
+    damage->numRects = 1;
+}
+
+static void
+DamageAddRect(GbmDamage* damage, EGLint x, EGLint y, EGLint w, EGLint h)
+{
+    EGLint* r;
+
+    if (damage->full || w <= 0 || h <= 0) return;
+
+    if (damage->numRects == MAX_DAMAGE_RECTS) DamageCollapse(damage);
+
+    r = &damage->rects[damage->numRects++ * 4];
+    r[0] = x;
+    r[1] = y;
+    r[2] = w;
+    r[3] = h;
+}
+
+static void
+DamageMerge(GbmDamage* dst, const GbmDamage* src)
+{
+    int i;
+
+    if (src->full) {
+        DamageSetFull(dst);
+        return;
+    }
+
+    for (i = 0; i < src->numRects; i++) {
+        DamageAddRect(dst, src->rects[i * 4], src->rects[i * 4 + 1],
+                      src->rects[i * 4 + 2], src->rects[i * 4 + 3]);
+    }
+}
+
+/*
+ * Records the damage of a frame about to be swapped. <rects> are in EGL's
+ * bottom-left origin convention, and are clipped to the surface. A NULL
+ * <rects> means the whole surface is damaged.
+ */
+static void
+QueueSwapDamage(GbmSurface* surf, const EGLint* rects, EGLint numRects)
+{
+    const EGLint width = surf->gbmSurf->v0.width;
+    const EGLint height = surf->gbmSurf->v0.height;
+    GbmDamage* damage;
+    EGLint i;
+
+    if (surf->pendingDamage.count == ARRAY_LEN(surf->pendingDamage.frames)) {
+        /* Should never happen, but make sure no damage is ever missed */
+        DamageSetFull(&surf->carriedDamage);
+        return;
+    }
+
+    damage = &surf->pendingDamage.frames[(surf->pendingDamage.first +
+                                          surf->pendingDamage.count++) %
+                                         ARRAY_LEN(surf->pendingDamage.frames)];
+    DamageClear(damage);
+
+    if (!rects || numRects <= 0) {
+        DamageSetFull(damage);
+        return;
+    }
+
+    for (i = 0; i < numRects; i++) {
+        EGLint x0 = rects[i * 4];
+        EGLint y0 = rects[i * 4 + 1];
+        EGLint x1 = x0 + rects[i * 4 + 2];
+        EGLint y1 = y0 + rects[i * 4 + 3];
+
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x1 > width) x1 = width;
+        if (y1 > height) y1 = height;
+
+        DamageAddRect(damage, x0, height - y1, x1 - x0, y1 - y0);
+    }
+}
+
+/* Forgets the damage of the most recently queued frame */
+static void
+UnqueueSwapDamage(GbmSurface* surf)
+{
+    if (surf->pendingDamage.count) surf->pendingDamage.count--;
+}
+
+/*
+ * Assigns the damage of the oldest swapped frame, along with any damage
+ * carried over from frames released without being locked, to <image>.
+ */
+static void
+TakeSwapDamage(GbmSurface* surf, GbmSurfaceImage* image)
+{
+    image->damage = surf->carriedDamage;
+    DamageClear(&surf->carriedDamage);
+
+    if (!surf->trackSwaps || !surf->pendingDamage.count) {
+        /* The frame wasn't swapped through the hooks */
+        DamageSetFull(&image->damage);
+        return;
+    }
+
+    DamageMerge(&image->damage,
+                &surf->pendingDamage.frames[surf->pendingDamage.first]);
+    surf->pendingDamage.first = (surf->pendingDamage.first + 1) %
+        ARRAY_LEN(surf->pendingDamage.frames);
+    surf->pendingDamage.count--;
+}
+
+/*
+ * Hands the damage of an image that is being released without having been
+ * locked to the next frame the application may lock.
+ */
+static void
+CarryDamage(GbmSurface* surf, GbmSurfaceImage* image)
+{
+    if (image->nextAcquired)
+        DamageMerge(&image->nextAcquired->damage, &image->damage);
+    else
+        DamageMerge(&surf->carriedDamage, &image->damage);
+}
+
+static inline void
+SetImageBo(GbmSurface* surf, GbmSurfaceImage* image, struct gbm_bo* bo)
+{
+    if (image->bo) {
+        ImageMapRemove(&surf->boMap, image->bo);
+        ReleaseCachedImport(surf, image->bo);
+    }
+
+    image->bo = bo;
+
+    if (bo) ImageMapInsert(&surf->boMap, bo, image - surf->images);
+}
+
+static bool
+AddSurfImage(GbmDisplay* display, GbmSurface* surf)
+{
+    GbmPlatformData* data = display->data;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_LEN(surf->images); i++) {
+        if (surf->images[i].image == EGL_NO_IMAGE_KHR &&
+            surf->images[i].bo == NULL) {
+            surf->images[i].image =
+                data->egl.CreateImageKHR(display->devDpy,
+                                         EGL_NO_CONTEXT,
+                                         EGL_STREAM_CONSUMER_IMAGE_NV,
+                                         (EGLClientBuffer)surf->stream,
+                                         NULL);
+            if (surf->images[i].image == EGL_NO_IMAGE_KHR) break;
+
+            ImageMapInsert(&surf->imageMap, surf->images[i].image, i);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool
+ReserveSurfImage(GbmSurface* surf)
+{
+    unsigned int numFree = 0;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_LEN(surf->images); i++) {
+        if (surf->images[i].image == EGL_NO_IMAGE_KHR &&
+            surf->images[i].bo == NULL) {
+            numFree++;
+        }
+    }
+
+    if (numFree <= surf->numPendingImages) return false;
+
+    surf->numPendingImages++;
+
+    return true;
+}
+
+/*
+ * Create the EGLImages for all images the stream added so far. Images must be
+ * created in the order they were added.
+ */
+static bool
+CreatePendingSurfImages(GbmDisplay* display, GbmSurface* surf)
+{
+    while (surf->numPendingImages > 0) {
+        if (!AddSurfImage(display, surf)) return false;
+        surf->numPendingImages--;
+    }
+
+    return true;
+}
+
+static void
+RemoveSurfImage(GbmDisplay* display, GbmSurface* surf, EGLImage img)
+{
+    GbmPlatformData* data = display->data;
+    GbmSurfaceImage* image;
+    int slot = ImageMapFind(&surf->imageMap, img);
+
+    if (slot < 0) return;
+
+    image = &surf->images[slot];
+    ImageMapRemove(&surf->imageMap, img);
+
+    /*
+     * The EGL_NV_stream_consumer_eglimage spec is unclear if removed
+     * images that are currently acquired still need to be released, but
+     * it does say this:
+     *
+     *   If an acquired EGLImage has not yet released when
+     *   eglDestroyImage is called, then, then an implicit
+     *   eglStreamReleaseImageNV will be called.
+     *
+     * so this should be sufficient either way.
+     */
+    data->egl.DestroyImageKHR(display->devDpy, img);
+    image->image = EGL_NO_IMAGE_KHR;
+    image->sync = EGL_NO_SYNC_KHR;
+
+    /* A locked image's fence is closed when the application releases it */
+    if (!image->locked) CloseFenceFd(&image->fenceFd);
+
+    /*
+     * If the image is currently acquired from the stream and available for
+     * locking, remove it from the acquired images list. Either way, an
+     * acquired or locked image no longer counts against the stream's FIFO.
+     */
+    if (image->acquired || image->locked) {
+        assert(surf->numFreeImages < surf->fifoLength);
+        surf->numFreeImages++;
+    }
+
+    if (image->acquired) {
+        /* This frame's damage is lost, so assume the worst for the next */
+        DamageSetFull(&image->damage);
+        CarryDamage(surf, image);
+        UnlinkAcquiredImage(surf, image);
+    }
+
+    /*
+     * A locked image keeps its buffer object until the application releases
+     * it.
+     */
+    if (!image->locked) SetImageBo(surf, image, NULL);
+}
+
+static bool AcquireSurfImage(GbmDisplay* display, GbmSurface* surf)
+{
+    GbmPlatformData* data = display->data;
+    EGLDisplay dpy = display->devDpy;
+    EGLSyncKHR sync = surf->syncs[surf->nextSync];
+    GbmSurfaceImage* image;
+    EGLImage img;
+    int slot;
+    EGLBoolean res;
+
+    res = data->egl.StreamAcquireImageNV(dpy,
+                                         surf->stream,
+                                         &img,
+                                         sync);
+
+    if (!res) {
+        /*
+         * Match Mesa EGL dri2 platform behavior when no buffer is available
+         * even though this function is not called from an EGL entry point
+         */
+        eGbmSetRoutineError(&surf->base, EGL_BAD_SURFACE);
+        return false;
+    }
+
+    surf->nextSync = (surf->nextSync + 1) % surf->fifoLength;
+
+    slot = ImageMapFind(&surf->imageMap, img);
+
+    assert(slot >= 0);
+
+    image = &surf->images[slot];
+
+    /*
+     * In native fence mode, only fall back to waiting on the CPU if no fence
+     * could be exported for this frame. The fence must be exported now,
+     * before the sync object is reused.
+     */
+    if (surf->useFenceFd) {
+        CloseFenceFd(&image->fenceFd);
+        image->fenceFd = data->egl.DupNativeFenceFDANDROID(dpy, sync);
+    }
+
+    image->sync = (image->fenceFd == EGL_NO_NATIVE_FENCE_FD_ANDROID) ?
+        sync : EGL_NO_SYNC_KHR;
+
+    TakeSwapDamage(surf, image);
+    AppendAcquiredImage(surf, image);
+    surf->numFreeImages--;
+    surf->stats.acquired++;
+
+    return true;
+}
+
+/*
+ * Waits for rendering to the acquired image <image> to complete, if that
+ * hasn't been waited for already. If waiting fails, the image is released
+ * back to the stream.
+ */
+static bool
+WaitSurfImage(GbmDisplay* display, GbmSurface* surf, GbmSurfaceImage* image)
+{
+    GbmPlatformData* data = display->data;
+    uint64_t start;
+    EGLint res;
+
+    if (image->sync == EGL_NO_SYNC_KHR) return true;
+
+    start = StatsBeginTimer(surf);
+    eGbmTraceBegin("egl-gbm wait", surf, (int)(image - surf->images));
+
+    res = data->egl.ClientWaitSyncKHR(display->devDpy, image->sync, 0,
+                                      EGL_FOREVER_KHR);
+
+    eGbmTraceEnd();
+
+    image->sync = EGL_NO_SYNC_KHR;
+
+    if (res != EGL_CONDITION_SATISFIED_KHR) {
+        UnlinkAcquiredImage(surf, image);
+        CloseFenceFd(&image->fenceFd);
+        data->egl.StreamReleaseImageNV(display->devDpy,
+                                       surf->stream,
+                                       image->image,
+                                       EGL_NO_SYNC_KHR);
+        assert(surf->numFreeImages < surf->fifoLength);
+        surf->numFreeImages++;
+
+        /* Not clear what error to use. Pretend no buffer was available. */
+        eGbmSetObjectError(&surf->base, EGL_BAD_SURFACE);
+        return false;
+    }
+
+    StatsEndTimer(surf, start, &surf->stats.acquireWaitTime,
+                  &surf->stats.maxAcquireWaitTime);
+
+    return true;
+}
+
+static bool
+PumpSurfEvents(GbmDisplay* display, GbmSurface* surf)
+{
+    GbmPlatformData* data = display->data;
+    EGLenum event;
+    EGLAttrib aux;
+    EGLint evStatus;
+    bool expected;
+
+    /*
+     * Clear the flag before querying so that a swap racing with this loop
+     * sets it again rather than being lost.
+     */
+    expected = __atomic_exchange_n(&surf->pumpNeeded, false, __ATOMIC_ACQ_REL);
+
+    while (true) {
+        evStatus = data->egl.QueryStreamConsumerEventNV(display->devDpy,
+                                                        surf->stream,
+                                                        0,
+                                                        &event,
+                                                        &aux);
+
+        if (evStatus != EGL_TRUE) break;
+
+        switch (event) {
+        case EGL_STREAM_IMAGE_AVAILABLE_NV:
+            /*
+             * The image must be acquired to clear the IMAGE_AVAILABLE event,
+             * so acquire it here rather than in eGbmSurfaceLockFrontBuffer().
+             */
+            if (!expected) surf->trackSwaps = false;
+            if (!CreatePendingSurfImages(display, surf)) goto fail;
+            if (!AcquireSurfImage(display, surf)) goto fail;
+            break;
+        case EGL_STREAM_IMAGE_ADD_NV:
+            if (!ReserveSurfImage(surf)) goto fail;
+            break;
+
+        case EGL_STREAM_IMAGE_REMOVE_NV:
+            /* The removed image may be one that hasn't been created yet */
+            if (!CreatePendingSurfImages(display, surf)) goto fail;
+            RemoveSurfImage(display, surf, (EGLImage)aux);
+            break;
+
+        default:
+            assert(!"Unhandled EGLImage stream consumer event");
+
+        }
+    }
+
+    if (evStatus == EGL_FALSE) goto fail;
+
+    return true;
+
+fail:
+    /* Events may still be pending. Make sure the next call looks again. */
+    __atomic_store_n(&surf->pumpNeeded, true, __ATOMIC_RELEASE);
+    return false;
+}
+
+/*
+ * Release all but the <keep> most recently acquired images that have not been
+ * locked back to the stream.
+ */
+static void
+ReleaseAcquiredImages(GbmDisplay* display, GbmSurface* surf, int keep)
+{
+    GbmSurfaceImage* image;
+    int numAcquired = 0;
+
+    for (image = surf->acquiredImages.first; image; image = image->nextAcquired)
+        numAcquired++;
+
+    while (numAcquired-- > keep) {
+        image = surf->acquiredImages.first;
+        CarryDamage(surf, image);
+        UnlinkAcquiredImage(surf, image);
+
+        image->sync = EGL_NO_SYNC_KHR;
+        CloseFenceFd(&image->fenceFd);
+        display->data->egl.StreamReleaseImageNV(display->devDpy,
+                                                surf->stream,
+                                                image->image,
+                                                EGL_NO_SYNC_KHR);
+        assert(surf->numFreeImages < surf->fifoLength);
+        surf->numFreeImages++;
+        surf->stats.dropped++;
+    }
+}
+
+/*
+ * Returns a new reference to the window surface <eglSurf> created on
+ * <display>, or NULL if <eglSurf> is not such a surface.
+ */
+static GbmSurface*
+RefSurface(GbmDisplay* display, EGLSurface eglSurf)
+{
+    GbmObject* obj = eglSurf ? eGbmRefHandle(eglSurf) : NULL;
+
+    if (!obj) return NULL;
+
+    if (obj->type != EGL_OBJECT_SURFACE_KHR || obj->dpy != display) {
+        eGbmUnrefObject(obj);
+        return NULL;
+    }
+
+    return (GbmSurface*)obj;
+}
+
+/*
+ * Records whether the application found a buffer the last time it asked.
+ * Applications typically poll until one is available, so only the first
+ * query of each run that finds none counts as a stall.
+ */
+static inline void
+StatsSetStalled(GbmSurface* surf, bool stalled)
+{
+    if (stalled && !surf->stats.stalled) surf->stats.stalls++;
+    surf->stats.stalled = stalled;
+}
+
+static int
+HasFreeBuffersLocked(GbmSurface* surf)
+{
+    bool pumped = false;
+
+    if (!surf->trackSwaps ||
+        __atomic_load_n(&surf->pumpNeeded, __ATOMIC_ACQUIRE)) {
+        if (!PumpSurfEvents(surf->base.dpy, surf)) return 0;
+        pumped = true;
+    }
+
+    /*
+     * Skipping the driver query is only an optimization for the common case
+     * of a buffer being available. Make sure none has been returned by the
+     * stream that the swap tracking hasn't seen before reporting none.
+     */
+    if (surf->numFreeImages <= 0 && !pumped &&
+        !PumpSurfEvents(surf->base.dpy, surf)) {
+        return 0;
+    }
+
+    StatsSetStalled(surf, surf->numFreeImages <= 0);
+
+    return surf->numFreeImages > 0;
+}
+
+static int
+HasFreeBuffers(struct gbm_surface* s)
+{
+    GbmSurface* surf = GetSurf(s);
+    int ret;
+
+    if (!surf) return 0;
+
+    pthread_mutex_lock(&surf->mutex);
+    ret = HasFreeBuffersLocked(surf);
+    pthread_mutex_unlock(&surf->mutex);
+
+    return ret;
+}
+
+static struct gbm_bo*
+LockFrontBufferLocked(struct gbm_surface* s, GbmSurface* surf)
+{
+    GbmSurfaceImage* image;
+    GbmPlatformData* data;
+    EGLDisplay dpy;
+    struct gbm_bo* bo;
+    uint32_t i;
+
+    data = surf->base.dpy->data;
+    dpy = surf->base.dpy->devDpy;
+
+    /* Must pump events to ensure images are created before acquiring them */
+    if (!PumpSurfEvents(surf->base.dpy, surf)) return NULL;
+
+    if (surf->mailbox) ReleaseAcquiredImages(surf->base.dpy, surf, 1);
+
+    if (!surf->acquiredImages.first) {
+        StatsSetStalled(surf, true);
+        return NULL;
+    }
+
+    image = surf->acquiredImages.first;
+    assert(image->image);
+
+    if (!image->bo) {
+        uint64_t start = StatsBeginTimer(surf);
+        struct gbm_import_fd_modifier_data buf;
+        uint64_t modifier;
+        EGLint strides[GBM_MAX_PLANES];
+        EGLint offsets[GBM_MAX_PLANES];
+        int fds[GBM_MAX_PLANES];
+        int format;
+        int planes;
+
+        if (!data->egl.ExportDMABUFImageQueryMESA(dpy,
+                                                  image->image,
+                                                  &format,
+                                                  &planes,
+                                                  &modifier)) goto fail;
+
+        if (planes < 1 || planes > GBM_MAX_PLANES) goto fail;
+
+        for (i = 0; i < ARRAY_LEN(fds); i++) {
+            fds[i] = -1;
+            strides[i] = 0;
+            offsets[i] = 0;
+        }
+
+        if (!data->egl.ExportDMABUFImageMESA(dpy, image->image,
+                                             fds, strides, offsets)) {
+            goto fail;
         }
 
         memset(&buf, 0, sizeof(buf));
         buf.width = s->v0.width;
         buf.height = s->v0.height;
         buf.format = s->v0.format;
-        buf.num_fds = 1; /* XXX support planar separate memory objects */
-        buf.fds[0] = fd;
-        buf.strides[0] = stride;
-        buf.offsets[0] = offset;
+        buf.num_fds = planes;
         buf.modifier = modifier;
-        image->bo = gbm_bo_import(surf->base.dpy->gbm,
-                                  GBM_BO_IMPORT_FD_MODIFIER,
-                                  &buf, 0);
 
-        for (i = 0; i < buf.num_fds; i++) {
-            close(buf.fds[i]);
+        for (i = 0; i < (uint32_t)planes; i++) {
+            /*
+             * Planes that live in the same memory object as an earlier plane
+             * may not get a file descriptor of their own, but gbm_bo_import()
+             * wants one for each plane.
+             */
+            buf.fds[i] = (fds[i] >= 0 || i == 0) ? fds[i] : buf.fds[i - 1];
+            buf.strides[i] = strides[i];
+            buf.offsets[i] = offsets[i];
+        }
+
+        bo = (buf.fds[0] >= 0) ? ImportCachedBo(surf, &buf) : NULL;
+
+        for (i = 0; i < ARRAY_LEN(fds); i++) {
+            if (fds[i] >= 0) close(fds[i]);
+        }
+
+        if (!bo) goto fail;
+
+        SetImageBo(surf, image, bo);
+
+        StatsEndTimer(surf, start, &surf->stats.importTime,
+                      &surf->stats.maxImportTime);
+    }
+
+    /*
+     * Only wait for rendering once the buffer has been imported, so the
+     * import overlaps with the GPU finishing the frame.
+     */
+    if (!WaitSurfImage(surf->base.dpy, surf, image)) return NULL;
+
+    UnlinkAcquiredImage(surf, image);
+    image->locked = true;
+    StatsSetStalled(surf, false);
+
+    if (surf->stats.locked == 0 ||
+        surf->numFreeImages < surf->stats.minFreeImages) {
+        surf->stats.minFreeImages = surf->numFreeImages;
+    }
+    surf->stats.freeImagesSum += surf->numFreeImages;
+    surf->stats.locked++;
+
+    if (surf->stats.enabled && surf->stats.interval &&
+        surf->stats.locked % surf->stats.interval == 0) {
+        DumpSurfStats(surf);
+    }
+
+    surf->lastLocked = (int)(image - surf->images);
+
+    return image->bo;
+
+fail:
+    /* XXX Can this be called from outside an EGL entry point? */
+    eGbmSetObjectError(&surf->base, EGL_BAD_ALLOC);
+
+    return NULL;
+
+}
+
+static struct gbm_bo*
+LockFrontBuffer(struct gbm_surface* s)
+{
+    GbmSurface* surf = GetSurf(s);
+    struct gbm_bo* bo;
+
+    if (!surf) return NULL;
+
+    pthread_mutex_lock(&surf->mutex);
+    bo = LockFrontBufferLocked(s, surf);
+    pthread_mutex_unlock(&surf->mutex);
+
+    return bo;
+}
+
+static void
+ReleaseBufferLocked(GbmSurface* surf, struct gbm_bo *bo)
+{
+    GbmSurfaceImage* image;
+    GbmDisplay* display;
+    int slot;
+
+    display = surf->base.dpy;
+    slot = ImageMapFind(&surf->boMap, bo);
+
+    assert(slot >= 0 && surf->images[slot].locked);
+
+    if (slot < 0) return;
+
+    image = &surf->images[slot];
+    image->locked = false;
+    CloseFenceFd(&image->fenceFd);
+
+    if (surf->lastLocked == slot) surf->lastLocked = -1;
+
+    if (image->image == EGL_NO_IMAGE_KHR) {
+        /*
+         * The stream removed this image while it was locked. Release the
+         * buffer object associated with it as well.
+         */
+        SetImageBo(surf, image, NULL);
+        return;
+    }
+
+    display->data->egl.StreamReleaseImageNV(display->devDpy,
+                                            surf->stream,
+                                            image->image,
+                                            EGL_NO_SYNC_KHR);
+    assert(surf->numFreeImages < surf->fifoLength);
+    surf->numFreeImages++;
+}
+
+static void
+ReleaseBuffer(struct gbm_surface* s, struct gbm_bo *bo)
+{
+    GbmSurface* surf = GetSurf(s);
+
+    if (!surf || !bo) return;
+
+    pthread_mutex_lock(&surf->mutex);
+    ReleaseBufferLocked(surf, bo);
+    pthread_mutex_unlock(&surf->mutex);
+}
+
+static int
+BoSlot(struct gbm_surface* s, struct gbm_bo* bo)
+{
+    GbmSurface* surf = GetSurf(s);
+    int slot;
+
+    if (!surf || !bo) return -1;
+
+    pthread_mutex_lock(&surf->mutex);
+    slot = ImageMapFind(&surf->boMap, bo);
+    pthread_mutex_unlock(&surf->mutex);
+
+    return slot;
+}
+
+static void
+TraceFreeImages(struct gbm_surface* s)
+{
+    GbmSurface* surf = GetSurf(s);
+    int numFreeImages;
+
+    if (!surf) return;
+
+    pthread_mutex_lock(&surf->mutex);
+    numFreeImages = surf->numFreeImages;
+    pthread_mutex_unlock(&surf->mutex);
+
+    eGbmTraceCounter("egl-gbm free buffers", surf, numFreeImages);
+}
+
+int
+eGbmSurfaceHasFreeBuffers(struct gbm_surface* s)
+{
+    int ret;
+
+    if (!eGbmTraceEnabled()) return HasFreeBuffers(s);
+
+    eGbmTraceBegin("gbm_surface_has_free_buffers", s, -1);
+    ret = HasFreeBuffers(s);
+    eGbmTraceEnd();
+    TraceFreeImages(s);
+
+    return ret;
+}
+
+struct gbm_bo*
+eGbmSurfaceLockFrontBuffer(struct gbm_surface* s)
+{
+    struct gbm_bo* bo;
+
+    if (!eGbmTraceEnabled()) return LockFrontBuffer(s);
+
+    eGbmTraceBegin("gbm_surface_lock_front_buffer", s, -1);
+    bo = LockFrontBuffer(s);
+    eGbmTraceEnd();
+
+    /* The slot is only known once the frame has been locked */
+    if (bo) eGbmTraceCounter("egl-gbm locked slot", s, BoSlot(s, bo));
+    TraceFreeImages(s);
+
+    return bo;
+}
+
+void
+eGbmSurfaceReleaseBuffer(struct gbm_surface* s, struct gbm_bo *bo)
+{
+    if (!eGbmTraceEnabled()) {
+        ReleaseBuffer(s, bo);
+        return;
+    }
+
+    eGbmTraceBegin("gbm_surface_release_buffer", s, BoSlot(s, bo));
+    ReleaseBuffer(s, bo);
+    eGbmTraceEnd();
+    TraceFreeImages(s);
+}
+
+static void
+DestroySurf(GbmSurface* surf)
+{
+    GbmPlatformData* data = surf->base.dpy->data;
+    EGLDisplay dpy = surf->base.dpy->devDpy;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_LEN(surf->images); i++) {
+        if (surf->images[i].image != EGL_NO_IMAGE_KHR)
+            data->egl.DestroyImageKHR(dpy, surf->images[i].image);
+
+        CloseFenceFd(&surf->images[i].fenceFd);
+    }
+
+    for (i = 0; i < ARRAY_LEN(surf->importCache.entries); i++) {
+        if (surf->importCache.entries[i].bo != NULL)
+            gbm_bo_destroy(surf->importCache.entries[i].bo);
+    }
+
+    if (surf->egl != EGL_NO_SURFACE)
+        data->egl.DestroySurface(dpy, surf->egl);
+    if (surf->stream != EGL_NO_STREAM_KHR)
+        data->egl.DestroyStreamKHR(dpy, surf->stream);
+    for (i = 0; i < ARRAY_LEN(surf->syncs); i++) {
+        if (surf->syncs[i] != EGL_NO_SYNC_KHR)
+            data->egl.DestroySyncKHR(dpy, surf->syncs[i]);
+    }
+
+    pthread_mutex_destroy(&surf->mutex);
+    free(surf->modifiers);
+    free(surf);
+}
+
+/*
+ * Returns every frame to the stream and clears all per-surface state, then
+ * adds <surf> to its display's pool so that a new surface with the same
+ * parameters can reuse it. Returns false if the surface can't be reused, in
+ * which case it is left untouched apart from having had its events pumped.
+ */
+static bool
+PoolSurf(GbmSurface* surf)
+{
+    GbmDisplay* display = surf->base.dpy;
+    GbmSurface* evicted = NULL;
+    GbmSurface** link;
+    const void* boundThread;
+    unsigned int i;
+
+    if (surf->egl == EGL_NO_SURFACE || surf->stream == EGL_NO_STREAM_KHR ||
+        surf->syncs[0] == EGL_NO_SYNC_KHR ||
+        !eGbmGetEnvInt("EGL_GBM_SURFACE_POOL", 1)) {
+        return false;
+    }
+
+    /*
+     * The producer surface may still be current in a context. From the
+     * EGL 1.5 spec, section 3.5.5:
+     *
+     * "If the EGLSurface surface is current to any thread, deletion is
+     * deferred until it is no longer current."
+     *
+     * so it must not be handed to another window surface. Whether it is
+     * current can only be checked for the calling thread.
+     */
+    if (__atomic_load_n(&surf->boundElsewhere, __ATOMIC_ACQUIRE)) return false;
+
+    boundThread = __atomic_load_n(&surf->boundThread, __ATOMIC_ACQUIRE);
+
+    if (boundThread) {
+        EGLSurface draw, read;
+
+        if (boundThread != &threadTag) return false;
+
+        draw = display->data->egl.GetCurrentSurface(EGL_DRAW);
+        read = display->data->egl.GetCurrentSurface(EGL_READ);
+
+        if (draw == surf->egl || draw == (EGLSurface)surf ||
+            read == surf->egl || read == (EGLSurface)surf) {
+            return false;
+        }
+    }
+
+    if (!PumpSurfEvents(display, surf)) return false;
+
+    /*
+     * Buffers the application still has locked can't be taken away from it,
+     * and frames still in flight would show up in the new surface.
+     */
+    for (i = 0; i < ARRAY_LEN(surf->images); i++) {
+        if (surf->images[i].locked) return false;
+    }
+
+    if (surf->pendingDamage.count || !surf->trackSwaps) return false;
+
+    ReleaseAcquiredImages(display, surf, 0);
+
+    if (surf->stats.enabled) DumpSurfStats(surf);
+
+    for (i = 0; i < ARRAY_LEN(surf->images); i++) {
+        CloseFenceFd(&surf->images[i].fenceFd);
+    }
+
+    surf->lastLocked = -1;
+    memset(&surf->stats, 0, sizeof(surf->stats));
+    DamageClear(&surf->carriedDamage);
+    surf->pendingDamage.first = 0;
+    surf->gbmSurf = NULL;
+
+    pthread_mutex_lock(&display->mutex);
+
+    surf->nextPooled = display->surfacePool;
+    display->surfacePool = surf;
+
+    if (++display->numPooledSurfaces > MAX_POOLED_SURFACES) {
+        link = &display->surfacePool;
+        while ((*link)->nextPooled) link = &(*link)->nextPooled;
+        evicted = *link;
+        *link = NULL;
+        display->numPooledSurfaces--;
+    }
+
+    pthread_mutex_unlock(&display->mutex);
+
+    if (evicted) DestroySurf(evicted);
+
+    return true;
+}
+
+/*
+ * Removes a surface matching the given parameters from the display's pool
+ * and returns it, or returns NULL if there is none.
+ */
+static GbmSurface*
+TakePooledSurf(GbmDisplay* display,
+               EGLConfig config,
+               const struct gbm_surface* s,
+               int fifoLength,
+               bool useFenceFd)
+{
+    GbmSurface** link;
+    GbmSurface* surf = NULL;
+
+    pthread_mutex_lock(&display->mutex);
+
+    for (link = &display->surfacePool; *link; link = &(*link)->nextPooled) {
+        GbmSurface* pooled = *link;
+
+        if (pooled->config == config &&
+            pooled->width == s->v0.width &&
+            pooled->height == s->v0.height &&
+            pooled->format == s->v0.format &&
+            pooled->flags == s->v0.flags &&
+            pooled->fifoLength == fifoLength &&
+            (pooled->useFenceFd == useFenceFd ||
+             (useFenceFd && pooled->fenceFdFallback)) &&
+            pooled->numModifiers == s->v0.count &&
+            (!s->v0.count || !memcmp(pooled->modifiers, s->v0.modifiers,
+                                     s->v0.count * sizeof(uint64_t)))) {
+            *link = pooled->nextPooled;
+            pooled->nextPooled = NULL;
+            display->numPooledSurfaces--;
+            surf = pooled;
+            break;
         }
-
-        if (!image->bo) goto fail;
     }
 
-    surf->acquiredImages.first = image->nextAcquired;
-    if (!surf->acquiredImages.first)
-        surf->acquiredImages.last = NULL;
-    image->locked = true;
-
-    return image->bo;
-
-fail:
-    /* XXX Can this be called from outside an EGL entry point? */
-    eGbmSetError(data, EGL_BAD_ALLOC);
-
-    return NULL;
+    pthread_mutex_unlock(&display->mutex);
 
+    return surf;
 }
 
 void
-eGbmSurfaceReleaseBuffer(struct gbm_surface* s, struct gbm_bo *bo)
+eGbmFlushSurfacePool(GbmDisplay* display)
 {
-    GbmSurface* surf = GetSurf(s);
-    GbmDisplay* display;
-    EGLImage img = EGL_NO_IMAGE_KHR;
-    unsigned int i;
-
-    if (!surf || !bo) return;
-
-    display = surf->base.dpy;
-
-    for (i = 0; i < ARRAY_LEN(surf->images); i++) {
-        if (surf->images[i].bo == bo) {
-            surf->images[i].locked = false;
-            img = surf->images[i].image;
-
-            if (!img) {
-                /*
-                 * The stream removed this image while it was locked. Free the
-                 * buffer object associated with it as well.
-                 */
-                gbm_bo_destroy(surf->images[i].bo);
-            }
+    GbmSurface* surf;
 
-            break;
-        }
-    }
+    pthread_mutex_lock(&display->mutex);
+    surf = display->surfacePool;
+    display->surfacePool = NULL;
+    display->numPooledSurfaces = 0;
+    pthread_mutex_unlock(&display->mutex);
 
-    assert(img != EGL_NO_IMAGE_KHR);
+    while (surf) {
+        GbmSurface* next = surf->nextPooled;
 
-    if (img != EGL_NO_IMAGE_KHR) {
-        display->data->egl.StreamReleaseImageNV(display->devDpy,
-                                                surf->stream,
-                                                img,
-                                                EGL_NO_SYNC_KHR);
-        assert(surf->numFreeImages < WINDOW_STREAM_FIFO_LENGTH);
-        surf->numFreeImages++;
+        DestroySurf(surf);
+        surf = next;
     }
 }
 
@@ -401,32 +1647,51 @@ FreeSurface(GbmObject* obj)
 {
     if (obj) {
         GbmSurface* surf = (GbmSurface*)obj;
-        GbmPlatformData* data = obj->dpy->data;
-        EGLDisplay dpy = obj->dpy->devDpy;
-        unsigned int i;
-
-        for (i = 0; i < ARRAY_LEN(surf->images); i++) {
-            if (surf->images[i].image != EGL_NO_IMAGE_KHR)
-                data->egl.DestroyImageKHR(dpy, surf->images[i].image);
+        GbmDisplay* display = obj->dpy;
+        struct gbm_surface* ownedGbmSurf =
+            surf->ownsGbmSurf ? surf->gbmSurf : NULL;
 
-            if (surf->images[i].bo != NULL)
-                gbm_bo_destroy(surf->images[i].bo);
+        if (!PoolSurf(surf)) {
+            if (surf->stats.enabled) DumpSurfStats(surf);
+            DestroySurf(surf);
         }
 
-        if (surf->egl != EGL_NO_SURFACE)
-            data->egl.DestroySurface(dpy, surf->egl);
-        if (surf->stream != EGL_NO_STREAM_KHR)
-            data->egl.DestroyStreamKHR(dpy, surf->stream);
-        if (surf->sync != EGL_NO_SYNC_KHR)
-            data->egl.DestroySyncKHR(dpy, surf->sync);
+        if (ownedGbmSurf) gbm_surface_destroy(ownedGbmSurf);
 
-        /* Drop reference to the display acquired at creation time */
-        eGbmUnrefObject(&obj->dpy->base);
-
-        free(obj);
+        /*
+         * Drop reference to the display acquired at creation time. Pooled
+         * surfaces don't keep the display alive; the pool is flushed when
+         * the display is terminated or freed instead.
+         */
+        eGbmUnrefObject(&display->base);
     }
 }
 
+/* Initializes the state that is reset each time a surface is (re)used */
+static void
+InitSurfState(GbmSurface* surf, GbmDisplay* display, struct gbm_surface* s)
+{
+    int interval;
+
+    surf->base.dpy = display;
+    surf->base.type = EGL_OBJECT_SURFACE_KHR;
+    surf->base.refCount = 1;
+    surf->base.destroyed = false;
+    surf->base.free = FreeSurface;
+    surf->gbmSurf = s;
+    surf->ownsGbmSurf = false;
+    surf->boundThread = NULL;
+    surf->boundElsewhere = false;
+    surf->mailbox = !!eGbmGetEnvInt("EGL_GBM_MAILBOX", 0);
+    surf->pumpNeeded = true;
+    surf->trackSwaps = true;
+    /* The counters are only reported through the trace */
+    surf->stats.enabled = getenv("EGL_GBM_STATS") != NULL &&
+        eGbmTraceEnabled();
+    interval = eGbmGetEnvInt("EGL_GBM_STATS_INTERVAL", 0);
+    surf->stats.interval = interval > 0 ? (unsigned int)interval : 0;
+}
+
 EGLSurface
 eGbmCreatePlatformWindowSurfaceHook(EGLDisplay dpy,
                                     EGLConfig config,
@@ -440,13 +1705,17 @@ eGbmCreatePlatformWindowSurfaceHook(EGLDisplay dpy,
     EGLint surfType;
     EGLint err = EGL_BAD_ALLOC;
     EGLBoolean res;
-    const EGLint surfAttrs[] = {
-        /* XXX Merge in relevant <attribs> here as well */
-        EGL_WIDTH, s->v0.width,
-        EGL_HEIGHT, s->v0.height,
+    int fifoLength = WINDOW_STREAM_FIFO_LENGTH;
+    static const uint64_t linearModifier = DRM_FORMAT_MOD_LINEAR;
+    const uint64_t* scanoutModifiers = NULL;
+    int numScanoutModifiers = 0;
+    unsigned int i;
+    EGLint surfAttrs[] = {
+        EGL_WIDTH, 0,
+        EGL_HEIGHT, 0,
         EGL_NONE
     };
-    static const EGLint streamAttrs[] = {
+    EGLint streamAttrs[] = {
         EGL_STREAM_FIFO_LENGTH_KHR, WINDOW_STREAM_FIFO_LENGTH,
         EGL_NONE
     };
@@ -454,8 +1723,12 @@ eGbmCreatePlatformWindowSurfaceHook(EGLDisplay dpy,
         EGL_SYNC_STATUS_KHR, EGL_SIGNALED_KHR,
         EGL_NONE
     };
-
-    (void)attribs;
+    static const EGLint fenceSyncAttrs[] = {
+        EGL_SYNC_STATUS_KHR, EGL_SIGNALED_KHR,
+        EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+        EGL_NONE
+    };
+    bool useFenceFd = false;
 
     if (!display) {
         /*  No platform data. Can't set error EGL_NO_DISPLAY */
@@ -465,6 +1738,34 @@ eGbmCreatePlatformWindowSurfaceHook(EGLDisplay dpy,
     data = display->data;
     dpy = display->devDpy;
 
+    fifoLength = eGbmGetEnvInt("EGL_GBM_FIFO_LENGTH", fifoLength);
+
+    if (fifoLength < MIN_WINDOW_STREAM_FIFO_LENGTH ||
+        fifoLength > MAX_WINDOW_STREAM_FIFO_LENGTH) {
+        fifoLength = WINDOW_STREAM_FIFO_LENGTH;
+    }
+
+    for (i = 0; attribs && attribs[i] != EGL_NONE; i += 2) {
+        if (attribs[i] == EGL_STREAM_FIFO_LENGTH_KHR) {
+            if (attribs[i + 1] < MIN_WINDOW_STREAM_FIFO_LENGTH ||
+                attribs[i + 1] > MAX_WINDOW_STREAM_FIFO_LENGTH) {
+                err = EGL_BAD_ATTRIBUTE;
+                goto fail;
+            }
+
+            fifoLength = (int)attribs[i + 1];
+        } else if (attribs[i] == EGL_SYNC_NATIVE_FENCE_ANDROID) {
+            if (!eGbmHasExtension(display->exts, ANDROID_native_fence_sync)) {
+                err = EGL_BAD_ATTRIBUTE;
+                goto fail;
+            }
+
+            useFenceFd = (attribs[i + 1] != EGL_FALSE);
+        }
+    }
+
+    streamAttrs[1] = fifoLength;
+
     if (!s) {
         err = EGL_BAD_NATIVE_WINDOW;
         goto fail;
@@ -482,6 +1783,14 @@ eGbmCreatePlatformWindowSurfaceHook(EGLDisplay dpy,
         goto fail;
     }
 
+    /* Skip creating the stream and everything else if possible */
+    surf = TakePooledSurf(display, config, s, fifoLength, useFenceFd);
+
+    if (surf) {
+        InitSurfState(surf, display, s);
+        goto publish;
+    }
+
     surf = calloc(1, sizeof(*surf));
 
     if (!surf) {
@@ -489,27 +1798,88 @@ eGbmCreatePlatformWindowSurfaceHook(EGLDisplay dpy,
         goto fail;
     }
 
-    surf->base.dpy = display;
-    surf->base.type = EGL_OBJECT_SURFACE_KHR;
-    surf->base.refCount = 1;
-    surf->base.free = FreeSurface;
+    pthread_mutex_init(&surf->mutex, NULL);
+
+    InitSurfState(surf, display, s);
+    surf->config = config;
+    surf->width = s->v0.width;
+    surf->height = s->v0.height;
+    surf->format = s->v0.format;
+    surf->flags = s->v0.flags;
     surf->stream = data->egl.CreateStreamKHR(dpy, streamAttrs);
-    surf->numFreeImages = WINDOW_STREAM_FIFO_LENGTH;
+    surf->fifoLength = fifoLength;
+    surf->numFreeImages = fifoLength;
+    surf->lastLocked = -1;
+
+    for (i = 0; i < ARRAY_LEN(surf->images); i++) {
+        surf->images[i].fenceFd = -1;
+    }
+
+    if (s->v0.count) {
+        surf->modifiers = malloc(s->v0.count * sizeof(*surf->modifiers));
+
+        if (!surf->modifiers) {
+            err = EGL_BAD_ALLOC;
+            goto fail;
+        }
+
+        memcpy(surf->modifiers, s->v0.modifiers,
+               s->v0.count * sizeof(*surf->modifiers));
+        surf->numModifiers = s->v0.count;
+    }
 
     if (!surf->stream) {
         err = EGL_BAD_ALLOC;
         goto fail;
     }
 
-    if (!data->egl.StreamImageConsumerConnectNV(dpy,
-                                                surf->stream,
-                                                s->v0.count,
-                                                s->v0.modifiers,
-                                                NULL)) {
+    /*
+     * If the application didn't ask for specific modifiers, a surface meant
+     * for scanout would otherwise get whatever layout the driver prefers for
+     * rendering, which may not be one the display engine can scan out with
+     * compression. Offer the primary planes' modifiers instead, falling
+     * back to the driver's choice if none of them work for the stream.
+     * Setting EGL_GBM_SCANOUT_MODIFIERS to 0 skips this.
+     *
+     * Buffers rendered on a different device than the GBM device's are
+     * always linear, whatever the application asked for, since that's the
+     * only layout both devices are guaranteed to agree on.
+     */
+    if (display->prime) {
+        scanoutModifiers = &linearModifier;
+        numScanoutModifiers = 1;
+    } else if (s->v0.count == 0 && (s->v0.flags & GBM_BO_USE_SCANOUT) &&
+               eGbmGetEnvInt("EGL_GBM_SCANOUT_MODIFIERS", 1)) {
+        eGbmGetScanoutModifiers(display, s->v0.format,
+                                &scanoutModifiers, &numScanoutModifiers);
+    }
+
+    res = EGL_FALSE;
+
+    if (numScanoutModifiers) {
+        res = data->egl.StreamImageConsumerConnectNV(dpy,
+                                                     surf->stream,
+                                                     numScanoutModifiers,
+                                                     scanoutModifiers,
+                                                     NULL);
+    }
+
+    if (!res && !display->prime) {
+        res = data->egl.StreamImageConsumerConnectNV(dpy,
+                                                     surf->stream,
+                                                     s->v0.count,
+                                                     s->v0.modifiers,
+                                                     NULL);
+    }
+
+    if (!res) {
         err = EGL_BAD_ALLOC;
         goto fail;
     }
 
+    surfAttrs[1] = s->v0.width;
+    surfAttrs[3] = s->v0.height;
+
     surf->egl = data->egl.CreateStreamProducerSurfaceKHR(dpy,
                                                          config,
                                                          surf->stream,
@@ -526,20 +1896,47 @@ eGbmCreatePlatformWindowSurfaceHook(EGLDisplay dpy,
         goto fail;
     }
 
-    surf->sync = data->egl.CreateSyncKHR(dpy,
-                                         EGL_SYNC_FENCE_KHR,
-                                         syncAttrs);
+    surf->useFenceFd = useFenceFd;
 
-    if (!surf->sync) {
-        err = EGL_BAD_ALLOC;
-        goto fail;
+    for (i = 0; surf->useFenceFd && i < (unsigned int)fifoLength; i++) {
+        surf->syncs[i] = data->egl.CreateSyncKHR(dpy,
+                                                 EGL_SYNC_NATIVE_FENCE_ANDROID,
+                                                 fenceSyncAttrs);
+
+        /*
+         * Fall back to waiting on the CPU if such syncs aren't reusable, or
+         * there aren't enough of them. The whole ring has to be of one kind,
+         * since the surface's mode decides how every frame is waited for.
+         */
+        if (surf->syncs[i] == EGL_NO_SYNC_KHR) {
+            while (i-- > 0) {
+                data->egl.DestroySyncKHR(dpy, surf->syncs[i]);
+                surf->syncs[i] = EGL_NO_SYNC_KHR;
+            }
+
+            surf->useFenceFd = false;
+        }
     }
 
-    if (!PumpSurfEvents(display, surf)) {
-        err = EGL_BAD_ALLOC;
-        goto fail;
+    for (i = 0; !surf->useFenceFd && i < (unsigned int)fifoLength; i++) {
+        surf->syncs[i] = data->egl.CreateSyncKHR(dpy,
+                                                 EGL_SYNC_FENCE_KHR,
+                                                 syncAttrs);
+
+        if (!surf->syncs[i]) {
+            err = EGL_BAD_ALLOC;
+            goto fail;
+        }
     }
 
+    surf->fenceFdFallback = useFenceFd && !surf->useFenceFd;
+
+    /*
+     * Stream events, and with them the creation of the stream's images, are
+     * processed the first time the application queries or locks a buffer.
+     */
+
+publish:
     /* The reference to the display object is retained by surf */
     if (!eGbmAddObject(&surf->base)) {
         err = EGL_BAD_ALLOC;
@@ -551,28 +1948,384 @@ eGbmCreatePlatformWindowSurfaceHook(EGLDisplay dpy,
     return (EGLSurface)surf;
 
 fail:
-    FreeSurface(&surf->base);
+    /*
+     * Never pool a surface the application didn't get, since it may be
+     * incomplete.
+     */
+    if (surf) DestroySurf(surf);
 
-    eGbmSetError(display->data, err);
+    eGbmSetObjectError(&display->base, err);
+    eGbmUnrefObject(&display->base);
 
     return EGL_NO_SURFACE;
 }
 
+EGLSurface
+eGbmCreateOffscreenSurface(EGLDisplay dpy,
+                           EGLConfig config,
+                           uint32_t width,
+                           uint32_t height,
+                           uint32_t format,
+                           const EGLAttrib* attribs,
+                           struct gbm_surface** buffers)
+{
+    GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
+    struct gbm_surface* s = NULL;
+    EGLSurface eglSurf = EGL_NO_SURFACE;
+    EGLint err = EGL_SUCCESS;
+
+    if (!display) {
+        /*  No platform data. Can't set error EGL_NO_DISPLAY */
+        return EGL_NO_SURFACE;
+    }
+
+    if (display->base.type != EGL_OBJECT_DISPLAY_KHR) {
+        eGbmUnrefObject(&display->base);
+        return EGL_NO_SURFACE;
+    }
+
+    if (!buffers || !width || !height) {
+        err = EGL_BAD_PARAMETER;
+        goto done;
+    }
+
+    /*
+     * The buffers are never scanned out, so there's no need to restrict
+     * their layout to what the display engine supports. Unlike a pbuffer,
+     * which is private to the driver, each rendered frame is then handed to
+     * the application as a gbm_bo through the same stream as for a window
+     * surface.
+     */
+    s = gbm_surface_create(display->gbm, width, height, format,
+                           GBM_BO_USE_RENDERING);
+
+    if (!s) {
+        err = EGL_BAD_ALLOC;
+        goto done;
+    }
+
+    /* This sets the EGL error if it fails */
+    eglSurf = eGbmCreatePlatformWindowSurfaceHook(dpy, config, s, attribs);
+
+    if (eglSurf == EGL_NO_SURFACE) {
+        gbm_surface_destroy(s);
+        goto done;
+    }
+
+    /* Not visible to the application before this returns */
+    GetSurf(s)->ownsGbmSurf = true;
+    *buffers = s;
+
+done:
+    if (err != EGL_SUCCESS) eGbmSetObjectError(&display->base, err);
+    eGbmUnrefObject(&display->base);
+
+    return eglSurf;
+}
+
+/*
+ * Called when the driver translates the handle of a window surface, which
+ * it does in particular when the surface is made current.
+ */
 void*
 eGbmSurfaceUnwrap(GbmObject* obj)
 {
-    return ((GbmSurface*)obj)->egl;
+    GbmSurface* surf = (GbmSurface*)obj;
+    const void* expected = NULL;
+
+    if (!__atomic_compare_exchange_n(&surf->boundThread, &expected,
+                                     &threadTag, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE) &&
+        expected != &threadTag) {
+        __atomic_store_n(&surf->boundElsewhere, true, __ATOMIC_RELEASE);
+    }
+
+    return surf->egl;
+}
+
+/*
+ * Stores a new file descriptor referring to the fence of the image in <slot>
+ * in <fd>, or EGL_NO_NATIVE_FENCE_FD_ANDROID if the image has no pending
+ * fence. Returns 0 on success, or a negative errno value if the fence exists
+ * but couldn't be duplicated.
+ */
+static int
+DupBufferFence(const GbmSurface* surf, int slot, EGLint* fd)
+{
+    if (slot < 0 || surf->images[slot].fenceFd < 0) {
+        *fd = EGL_NO_NATIVE_FENCE_FD_ANDROID;
+        return 0;
+    }
+
+    *fd = dup(surf->images[slot].fenceFd);
+
+    return (*fd < 0) ? -errno : 0;
+}
+
+EGLBoolean
+eGbmQuerySurfaceHook(EGLDisplay dpy,
+                     EGLSurface eglSurf,
+                     EGLint attribute,
+                     EGLint* value)
+{
+    GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
+    GbmSurface* surf;
+    EGLBoolean ret = EGL_FALSE;
+
+    if (!display) {
+        /*  No platform data. Can't set error EGL_NO_DISPLAY */
+        return EGL_FALSE;
+    }
+
+    surf = RefSurface(display, eglSurf);
+
+    if (!surf) {
+        /* Not a window surface. Let the driver handle it. */
+        ret = display->data->egl.QuerySurface(display->devDpy,
+                                              eglSurf,
+                                              attribute,
+                                              value);
+        goto done;
+    }
+
+    switch (attribute) {
+    case EGL_SYNC_NATIVE_FENCE_FD_ANDROID:
+        if (!surf->useFenceFd) {
+            eGbmSetObjectError(&surf->base, EGL_BAD_ATTRIBUTE);
+            break;
+        }
+
+        /*
+         * Return a new file descriptor referring to the fence of the most
+         * recently locked buffer, or EGL_NO_NATIVE_FENCE_FD_ANDROID if
+         * rendering had already completed when it was acquired. The caller
+         * owns the returned file descriptor.
+         */
+        pthread_mutex_lock(&surf->mutex);
+        ret = DupBufferFence(surf, surf->lastLocked, value) == 0;
+        pthread_mutex_unlock(&surf->mutex);
+
+        if (!ret) eGbmSetObjectError(&surf->base, EGL_BAD_ALLOC);
+        break;
+
+    default:
+        ret = display->data->egl.QuerySurface(display->devDpy,
+                                              surf->egl,
+                                              attribute,
+                                              value);
+        break;
+    }
+
+done:
+    if (surf) eGbmUnrefObject(&surf->base);
+    eGbmUnrefObject(&display->base);
+
+    return ret;
+}
+
+typedef enum {
+    GBM_SWAP_PLAIN,
+    GBM_SWAP_WITH_DAMAGE_EXT,
+    GBM_SWAP_WITH_DAMAGE_KHR,
+} GbmSwapVariant;
+
+static EGLBoolean
+DriverSwapBuffers(GbmPlatformData* data,
+                  EGLDisplay dpy,
+                  EGLSurface eglSurf,
+                  const EGLint* rects,
+                  EGLint numRects,
+                  GbmSwapVariant variant)
+{
+    /* Drivers without the damage entry points get a full swap instead */
+    if (variant == GBM_SWAP_WITH_DAMAGE_EXT &&
+        data->egl.SwapBuffersWithDamageEXT) {
+        return data->egl.SwapBuffersWithDamageEXT(dpy, eglSurf,
+                                                  rects, numRects);
+    }
+
+    if (variant == GBM_SWAP_WITH_DAMAGE_KHR &&
+        data->egl.SwapBuffersWithDamageKHR) {
+        return data->egl.SwapBuffersWithDamageKHR(dpy, eglSurf,
+                                                  rects, numRects);
+    }
+
+    return data->egl.SwapBuffers(dpy, eglSurf);
+}
+
+static EGLBoolean
+SwapSurface(EGLDisplay dpy,
+            EGLSurface eglSurf,
+            const EGLint* rects,
+            EGLint numRects,
+            GbmSwapVariant variant)
+{
+    GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
+    GbmSurface* surf;
+    EGLBoolean ret;
+
+    if (!display) {
+        /*  No platform data. Can't set error EGL_NO_DISPLAY */
+        return EGL_FALSE;
+    }
+
+    surf = RefSurface(display, eglSurf);
+
+    if (!surf) {
+        /* Not a window surface. Let the driver handle it. */
+        ret = DriverSwapBuffers(display->data, display->devDpy, eglSurf,
+                                rects, numRects, variant);
+        goto done;
+    }
+
+    pthread_mutex_lock(&surf->mutex);
+
+    if (surf->mailbox) {
+        /*
+         * Return all frames the application hasn't locked yet to the stream
+         * so that this swap can't block on a full FIFO, and so that the next
+         * gbm_surface_lock_front_buffer returns this frame. Errors here will
+         * surface again in gbm_surface_lock_front_buffer.
+         */
+        PumpSurfEvents(display, surf);
+        ReleaseAcquiredImages(display, surf, 0);
+    }
+
+    /*
+     * Queue the damage before swapping, since the frame may be acquired by
+     * another thread as soon as it reaches the stream.
+     */
+    QueueSwapDamage(surf, variant == GBM_SWAP_PLAIN ? NULL : rects, numRects);
+
+    pthread_mutex_unlock(&surf->mutex);
+
+    ret = DriverSwapBuffers(display->data, display->devDpy, surf->egl,
+                            rects, numRects, variant);
+
+    if (!ret) {
+        pthread_mutex_lock(&surf->mutex);
+        UnqueueSwapDamage(surf);
+        pthread_mutex_unlock(&surf->mutex);
+    }
+
+    /*
+     * Set this even if the swap failed, since the stream may still have
+     * changed, e.g. if the window was resized.
+     */
+    __atomic_store_n(&surf->pumpNeeded, true, __ATOMIC_RELEASE);
+
+done:
+    if (surf) eGbmUnrefObject(&surf->base);
+    eGbmUnrefObject(&display->base);
+
+    return ret;
+}
+
+EGLBoolean
+eGbmSwapBuffersHook(EGLDisplay dpy, EGLSurface eglSurf)
+{
+    return SwapSurface(dpy, eglSurf, NULL, 0, GBM_SWAP_PLAIN);
+}
+
+EGLBoolean
+eGbmSwapBuffersWithDamageEXTHook(EGLDisplay dpy,
+                                 EGLSurface eglSurf,
+                                 const EGLint* rects,
+                                 EGLint numRects)
+{
+    return SwapSurface(dpy, eglSurf, rects, numRects,
+                       GBM_SWAP_WITH_DAMAGE_EXT);
+}
+
+EGLBoolean
+eGbmSwapBuffersWithDamageKHRHook(EGLDisplay dpy,
+                                 EGLSurface eglSurf,
+                                 const EGLint* rects,
+                                 EGLint numRects)
+{
+    return SwapSurface(dpy, eglSurf, rects, numRects,
+                       GBM_SWAP_WITH_DAMAGE_KHR);
+}
+
+int
+eGbmSurfaceGetBufferDamage(struct gbm_surface* s,
+                           struct gbm_bo* bo,
+                           int32_t* rects,
+                           int maxRects)
+{
+    GbmSurface* surf = GetSurf(s);
+    GbmDamage damage;
+    bool locked;
+    int slot;
+
+    if (!surf || !bo) return -1;
+
+    pthread_mutex_lock(&surf->mutex);
+
+    slot = ImageMapFind(&surf->boMap, bo);
+    locked = slot >= 0 && surf->images[slot].locked;
+    if (locked) damage = surf->images[slot].damage;
+
+    pthread_mutex_unlock(&surf->mutex);
+
+    if (!locked) return -1;
+
+    if (damage.full) return -1;
+
+    if (damage.numRects > maxRects) DamageCollapse(&damage);
+    if (damage.numRects > maxRects) return -1;
+
+    memcpy(rects, damage.rects, damage.numRects * 4 * sizeof(*rects));
+
+    return damage.numRects;
+}
+
+int
+eGbmSurfaceGetBufferFence(struct gbm_surface* s,
+                          struct gbm_bo* bo,
+                          int* fenceFd)
+{
+    GbmSurface* surf = GetSurf(s);
+    EGLint fd;
+    int slot;
+    int ret;
+
+    if (!surf || !bo || !fenceFd) return -EINVAL;
+
+    pthread_mutex_lock(&surf->mutex);
+
+    slot = ImageMapFind(&surf->boMap, bo);
+
+    if (slot < 0 || !surf->images[slot].locked)
+        ret = -EINVAL;
+    else
+        ret = DupBufferFence(surf, slot, &fd);
+
+    pthread_mutex_unlock(&surf->mutex);
+
+    if (ret == 0) *fenceFd = fd;
+
+    return ret;
 }
 
 EGLBoolean
 eGbmDestroySurfaceHook(EGLDisplay dpy, EGLSurface eglSurf)
 {
     GbmDisplay* display = (GbmDisplay*)eGbmRefHandle(dpy);
+    GbmSurface* surf;
     EGLBoolean ret = EGL_FALSE;
 
     if (!display) return ret;
 
-    if (eGbmDestroyHandle(eglSurf)) ret = EGL_TRUE;
+    surf = RefSurface(display, eglSurf);
+
+    if (!surf) {
+        /* Not a window surface, e.g. a pbuffer. Let the driver handle it. */
+        ret = display->data->egl.DestroySurface(display->devDpy, eglSurf);
+    } else {
+        eGbmUnrefObject(&surf->base);
+        if (eGbmDestroyHandle(eglSurf)) ret = EGL_TRUE;
+    }
 
     eGbmUnrefObject(&display->base);
 
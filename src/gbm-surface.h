@@ -7,7 +7,9 @@
 #ifndef GBM_SURFACE_H
 #define GBM_SURFACE_H
 
+#include "gbm-platform.h"
 #include "gbm-handle.h"
+#include "egl-gbm.h"
 
 #include <EGL/egl.h>
 #include <gbm.h>
@@ -20,7 +22,44 @@ EGLSurface eGbmCreatePlatformWindowSurfaceHook(EGLDisplay dpy,
                                                void* nativeWin,
                                                const EGLAttrib* attribs);
 void* eGbmSurfaceUnwrap(GbmObject* obj);
+EGLBoolean eGbmQuerySurfaceHook(EGLDisplay dpy,
+                                EGLSurface eglSurf,
+                                EGLint attribute,
+                                EGLint* value);
+EGLBoolean eGbmSwapBuffersHook(EGLDisplay dpy, EGLSurface eglSurf);
+EGLBoolean eGbmSwapBuffersWithDamageEXTHook(EGLDisplay dpy,
+                                            EGLSurface eglSurf,
+                                            const EGLint* rects,
+                                            EGLint numRects);
+EGLBoolean eGbmSwapBuffersWithDamageKHRHook(EGLDisplay dpy,
+                                            EGLSurface eglSurf,
+                                            const EGLint* rects,
+                                            EGLint numRects);
+
+/* See PFNEGLGBMSURFACEGETBUFFERDAMAGEPROC in egl-gbm.h */
+EGBM_EXPORT int eGbmSurfaceGetBufferDamage(struct gbm_surface* s,
+                                           struct gbm_bo* bo,
+                                           int32_t* rects,
+                                           int maxRects);
+
+/* See PFNEGLGBMSURFACEGETBUFFERFENCEPROC in egl-gbm.h */
+EGBM_EXPORT int eGbmSurfaceGetBufferFence(struct gbm_surface* s,
+                                          struct gbm_bo* bo,
+                                          int* fenceFd);
+
+/* See PFNEGLGBMCREATEOFFSCREENSURFACEPROC in egl-gbm.h */
+EGBM_EXPORT EGLSurface eGbmCreateOffscreenSurface(EGLDisplay dpy,
+                                                  EGLConfig config,
+                                                  uint32_t width,
+                                                  uint32_t height,
+                                                  uint32_t format,
+                                                  const EGLAttrib* attribs,
+                                                  struct gbm_surface** buffers);
+
 EGLBoolean
 eGbmDestroySurfaceHook(EGLDisplay dpy, EGLSurface eglSurf);
 
+/* Destroys the window surfaces kept for reuse on <display> */
+void eGbmFlushSurfacePool(struct GbmDisplayRec* display);
+
 #endif /* GBM_SURFACE_H */
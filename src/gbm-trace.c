@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "gbm-trace.h"
+#include "gbm-utils.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+int eGbmTraceFd = -1;
+
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static pid_t tracePid;
+
+static void
+OpenTraceMarker(void)
+{
+    static const char* const paths[] = {
+        "/sys/kernel/tracing/trace_marker",
+        "/sys/kernel/debug/tracing/trace_marker",
+    };
+    unsigned int i;
+    int fd = -1;
+
+    if (!eGbmGetEnvInt("EGL_GBM_TRACE", 0)) return;
+
+    for (i = 0; i < sizeof(paths) / sizeof(paths[0]) && fd < 0; i++)
+        fd = open(paths[i], O_WRONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        fprintf(stderr, "egl-gbm: EGL_GBM_TRACE is set, but no trace_marker "
+                "file could be opened\n");
+        return;
+    }
+
+    tracePid = getpid();
+    eGbmTraceFd = fd;
+}
+
+void
+eGbmTraceInit(void)
+{
+    pthread_once(&traceOnce, OpenTraceMarker);
+}
+
+static void
+WriteMarker(const char* buf, int len)
+{
+    if (len <= 0) return;
+
+    /* Long names are truncated rather than dropped */
+    if (len >= 256) len = 255;
+
+    /* Nothing useful can be done if this fails */
+    if (write(eGbmTraceFd, buf, len) < 0) return;
+}
+
+void
+eGbmTraceBegin(const char* name, const void* obj, int slot)
+{
+    char buf[256];
+    int len;
+
+    if (!eGbmTraceEnabled()) return;
+
+    if (slot >= 0) {
+        len = snprintf(buf, sizeof(buf), "B|%d|%s obj=%p slot=%d",
+                       (int)tracePid, name, obj, slot);
+    } else {
+        len = snprintf(buf, sizeof(buf), "B|%d|%s obj=%p",
+                       (int)tracePid, name, obj);
+    }
+
+    WriteMarker(buf, len);
+}
+
+void
+eGbmTraceEnd(void)
+{
+    char buf[32];
+
+    if (!eGbmTraceEnabled()) return;
+
+    WriteMarker(buf, snprintf(buf, sizeof(buf), "E|%d", (int)tracePid));
+}
+
+void
+eGbmTraceCounter(const char* name, const void* obj, int64_t value)
+{
+    char buf[256];
+
+    if (!eGbmTraceEnabled()) return;
+
+    WriteMarker(buf, snprintf(buf, sizeof(buf), "C|%d|%s %p|%" PRId64,
+                              (int)tracePid, name, obj, value));
+}
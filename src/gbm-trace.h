@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef GBM_TRACE_H
+#define GBM_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Optional begin/end events written to the ftrace trace_marker file in the
+ * format understood by Perfetto and systrace. Tracing is enabled by setting
+ * the EGL_GBM_TRACE environment variable to a non-zero value, and is
+ * otherwise a single branch per call.
+ */
+extern int eGbmTraceFd;
+
+void eGbmTraceInit(void);
+
+static inline bool
+eGbmTraceEnabled(void)
+{
+    return eGbmTraceFd >= 0;
+}
+
+/*
+ * Begin a slice called <name>. <obj> identifies the EGL or GBM object the
+ * slice operates on and may be NULL. <slot> is the index of the stream image
+ * involved, or -1 if there is none.
+ */
+void eGbmTraceBegin(const char* name, const void* obj, int slot);
+void eGbmTraceEnd(void);
+
+/* Record the value of a counter called <name> belonging to <obj> */
+void eGbmTraceCounter(const char* name, const void* obj, int64_t value);
+
+#endif /* GBM_TRACE_H */
@@ -5,55 +5,302 @@
  */
 
 #include "gbm-utils.h"
+#include "gbm-display.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 
 #if HAS_MINCORE
 #include <unistd.h>
 #include <dlfcn.h>
 #endif
 
-EGLBoolean
-eGbmFindExtension(const char* extension, const char* extensions)
+/* Sorted by strcmp(), and in the same order as GbmExtension */
+static const char* const ExtensionNames[] = {
+    "EGL_ANDROID_native_fence_sync",
+    "EGL_EXT_device_base",
+    "EGL_EXT_device_drm",
+    "EGL_EXT_device_drm_render_node",
+    "EGL_EXT_device_query",
+    "EGL_EXT_image_dma_buf_import",
+    "EGL_EXT_image_dma_buf_import_modifiers",
+    "EGL_EXT_pixel_format_float",
+    "EGL_EXT_platform_device",
+    "EGL_EXT_sync_reuse",
+    "EGL_KHR_display_reference",
+    "EGL_KHR_image_base",
+    "EGL_KHR_stream",
+    "EGL_KHR_stream_producer_eglsurface",
+    "EGL_MESA_image_dma_buf_export",
+    "EGL_NV_stream_consumer_eglimage",
+};
+
+_Static_assert(sizeof(ExtensionNames) / sizeof(ExtensionNames[0]) ==
+               EGBM_EXT_COUNT, "ExtensionNames doesn't match GbmExtension");
+_Static_assert(EGBM_EXT_COUNT <= sizeof(GbmExtensionSet) * 8,
+               "Too many extensions for GbmExtensionSet");
+
+static int
+FindExtensionName(const char* name, size_t len)
 {
-    const char* start;
-    const char* where;
-    const char* terminator;
+    int lo = 0;
+    int hi = EGBM_EXT_COUNT - 1;
+    int mid;
+    int cmp;
 
-    start = extensions;
-    for (;;) {
-        where = strstr(start, extension);
-        if (!where) {
-            break;
-        }
-        terminator = where + strlen(extension);
-        if (where == start || *(where - 1) == ' ') {
-            if (*terminator == ' ' || *terminator == '\0') {
-                return EGL_TRUE;
-            }
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        cmp = strncmp(name, ExtensionNames[mid], len);
+
+        /* The token is a prefix of the name, so it sorts before it */
+        if (!cmp && ExtensionNames[mid][len] != '\0') cmp = -1;
+
+        if (!cmp) return mid;
+
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+
+    return -1;
+}
+
+GbmExtensionSet
+eGbmParseExtensions(const char* extensions)
+{
+    GbmExtensionSet set = 0;
+    const char* end;
+    int ext;
+
+    if (!extensions) return 0;
+
+    while (*extensions) {
+        while (*extensions == ' ') extensions++;
+
+        for (end = extensions; *end && *end != ' '; end++);
+
+        if (end != extensions) {
+            ext = FindExtensionName(extensions, end - extensions);
+            if (ext >= 0) set |= (GbmExtensionSet)1 << ext;
         }
-        start = terminator;
+
+        extensions = end;
     }
 
-    return EGL_FALSE;
+    return set;
 }
 
+static pthread_once_t errorLogOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t errorLogKey;
+static int errorLogRate;
+
+/* Per thread, so logging never contends with other threads */
+static __thread uint64_t errorLogWindow;
+static __thread int errorLogCount;
+static __thread unsigned int errorLogSuppressed;
+
 void
-eGbmSetErrorInternal(GbmPlatformData *data, EGLint error,
-                          const char *file, int line)
+eGbmErrorLogFlush(void)
 {
-    static const char *defaultMsg = "GBM external platform error";
-    char msg[256];
+    if (!errorLogSuppressed) return;
 
-    if (!data || !data->driver.setError) return;
+    fprintf(stderr, "egl-gbm: suppressed=%u\n", errorLogSuppressed);
+    errorLogSuppressed = 0;
+}
 
-    if (!file || (snprintf(msg, sizeof(msg), "%s:%d: %s",
-                           file, line, defaultMsg) <= 0)) {
-        data->driver.setError(error, EGL_DEBUG_MSG_ERROR_KHR, defaultMsg);
+static void
+ErrorLogThreadExit(void* value)
+{
+    (void)value;
+
+    eGbmErrorLogFlush();
+}
+
+static void
+ReadErrorLogRate(void)
+{
+    int rate = eGbmGetEnvInt("EGL_GBM_LOG_ERRORS", 0);
+
+    /* Without the key, suppressed errors could go unreported */
+    if (rate > 0 && pthread_key_create(&errorLogKey, ErrorLogThreadExit))
+        rate = 0;
+
+    errorLogRate = rate > 0 ? rate : 0;
+}
+
+void
+eGbmErrorLogInit(void)
+{
+    pthread_once(&errorLogOnce, ReadErrorLogRate);
+}
+
+static const char*
+ErrorName(EGLint error)
+{
+    switch (error) {
+#define ERROR_NAME(e) case e: return #e
+    ERROR_NAME(EGL_NOT_INITIALIZED);
+    ERROR_NAME(EGL_BAD_ACCESS);
+    ERROR_NAME(EGL_BAD_ALLOC);
+    ERROR_NAME(EGL_BAD_ATTRIBUTE);
+    ERROR_NAME(EGL_BAD_CONFIG);
+    ERROR_NAME(EGL_BAD_CONTEXT);
+    ERROR_NAME(EGL_BAD_CURRENT_SURFACE);
+    ERROR_NAME(EGL_BAD_DISPLAY);
+    ERROR_NAME(EGL_BAD_MATCH);
+    ERROR_NAME(EGL_BAD_NATIVE_PIXMAP);
+    ERROR_NAME(EGL_BAD_NATIVE_WINDOW);
+    ERROR_NAME(EGL_BAD_PARAMETER);
+    ERROR_NAME(EGL_BAD_SURFACE);
+    ERROR_NAME(EGL_BAD_DEVICE_EXT);
+#undef ERROR_NAME
+    default:
+        return "unknown";
+    }
+}
+
+static void
+LogError(const GbmObject *obj, EGLint error, const char *msg)
+{
+    uint64_t now = eGbmGetTimeNs();
+
+    if (now - errorLogWindow >= 1000000000ull) {
+        eGbmErrorLogFlush();
+        errorLogWindow = now;
+        errorLogCount = 0;
+    }
+
+    if (errorLogCount >= errorLogRate) {
+        /* Make sure the count is reported if the thread exits first */
+        if (!errorLogSuppressed++)
+            pthread_setspecific(errorLogKey, &errorLogSuppressed);
         return;
     }
 
-    data->driver.setError(error, EGL_DEBUG_MSG_ERROR_KHR, msg);
+    errorLogCount++;
+
+    /* Objects are named by the handles the application knows them by */
+    if (!obj) {
+        fprintf(stderr, "egl-gbm: error=0x%04x (%s) msg=\"%s\"\n",
+                (unsigned int)error, ErrorName(error), msg);
+    } else if (obj->type == EGL_OBJECT_SURFACE_KHR) {
+        fprintf(stderr,
+                "egl-gbm: error=0x%04x (%s) display=%p surface=%p "
+                "msg=\"%s\"\n",
+                (unsigned int)error, ErrorName(error), (void*)obj->dpy,
+                (const void*)obj, msg);
+    } else {
+        fprintf(stderr,
+                "egl-gbm: error=0x%04x (%s) display=%p msg=\"%s\"\n",
+                (unsigned int)error, ErrorName(error), (void*)obj->dpy, msg);
+    }
+}
+
+void
+eGbmSetErrorInternal(GbmPlatformData *data,
+                     const GbmObject *obj,
+                     EGLint error,
+                     EGLint type,
+                     const char *msg)
+{
+    if (errorLogRate && type != EGL_DEBUG_MSG_INFO_KHR)
+        LogError(obj, error, msg);
+
+    if (!data && obj) data = obj->dpy->data;
+
+    /*
+     * Routine errors are passed on as well: the driver's setError is also
+     * what sets the error eglGetError returns, and the message type keeps
+     * them away from debug callbacks that didn't ask for informational
+     * messages.
+     */
+    if (!data || !data->driver.setError) return;
+
+    data->driver.setError(error, type, msg);
+}
+
+int
+eGbmGetEnvInt(const char* name, int defaultValue)
+{
+    const char* str = getenv(name);
+    char* end;
+    long val;
+
+    if (!str || !*str) return defaultValue;
+
+    errno = 0;
+    val = strtol(str, &end, 0);
+
+    if (errno || *end != '\0' || val < INT_MIN || val > INT_MAX)
+        return defaultValue;
+
+    return (int)val;
+}
+
+void
+eGbmAttribListInit(GbmAttribList* list)
+{
+    list->attribs = list->inlineAttribs;
+    list->nAttribs = 0;
+    list->size = GBM_ATTRIB_LIST_INLINE_SIZE;
+    list->attribs[0] = EGL_NONE;
+}
+
+/*
+ * Appends an attribute to <list>, keeping it terminated by EGL_NONE. Returns
+ * false if growing the list failed, in which case it's left unchanged.
+ */
+bool
+eGbmAttribListAppend(GbmAttribList* list, EGLint name, EGLint value)
+{
+    if (list->nAttribs + 3 > list->size) {
+        EGLint size = list->size * 2;
+        EGLint* attribs;
+
+        if (list->attribs == list->inlineAttribs) {
+            attribs = malloc(size * sizeof(*attribs));
+            if (attribs) {
+                memcpy(attribs, list->inlineAttribs,
+                       (list->nAttribs + 1) * sizeof(*attribs));
+            }
+        } else {
+            attribs = realloc(list->attribs, size * sizeof(*attribs));
+        }
+
+        if (!attribs) return false;
+
+        list->attribs = attribs;
+        list->size = size;
+    }
+
+    list->attribs[list->nAttribs++] = name;
+    list->attribs[list->nAttribs++] = value;
+    list->attribs[list->nAttribs] = EGL_NONE;
+
+    return true;
+}
+
+void
+eGbmAttribListFree(GbmAttribList* list)
+{
+    if (list->attribs != list->inlineAttribs) free(list->attribs);
+
+    eGbmAttribListInit(list);
+}
+
+uint64_t
+eGbmGetTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
 #if HAS_MINCORE && defined(RTLD_DEFAULT)
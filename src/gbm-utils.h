@@ -8,8 +8,11 @@
 #define GBM_UTILS_H
 
 #include "gbm-platform.h"
+#include "gbm-handle.h"
 
 #include <EGL/egl.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #if defined(__QNX__)
 #define HAS_MINCORE 0
@@ -17,18 +20,111 @@
 #define HAS_MINCORE 1
 #endif
 
-#ifdef NDEBUG
-#define eGbmSetError(data, err) \
-    eGbmSetErrorInternal(data, err, NULL, 0);
-#else
+#define EGBM_STRINGIFY_(x) #x
+#define EGBM_STRINGIFY(x) EGBM_STRINGIFY_(x)
+
+/*
+ * The message passed along with the error names the call site, and is built
+ * at compile time, since errors are also raised on hot paths, such as when
+ * an application polls for a buffer that isn't available yet.
+ */
+#define EGBM_ERROR_MESSAGE \
+    __FILE__ ":" EGBM_STRINGIFY(__LINE__) ": GBM external platform error"
+
 #define eGbmSetError(data, err) \
-    eGbmSetErrorInternal(data, err, __FILE__, __LINE__);
-#endif
+    eGbmSetErrorInternal(data, NULL, err, EGL_DEBUG_MSG_ERROR_KHR, \
+                         EGBM_ERROR_MESSAGE)
+
+/*
+ * For errors raised on behalf of the display or surface <obj>, which is then
+ * named in the error log.
+ */
+#define eGbmSetObjectError(obj, err) \
+    eGbmSetErrorInternal(NULL, obj, err, EGL_DEBUG_MSG_ERROR_KHR, \
+                         EGBM_ERROR_MESSAGE)
+
+/*
+ * For errors that are part of normal operation, such as no buffer being
+ * available yet. These are reported to the debug callback as informational
+ * messages, and never logged.
+ */
+#define eGbmSetRoutineError(obj, err) \
+    eGbmSetErrorInternal(NULL, obj, err, EGL_DEBUG_MSG_INFO_KHR, \
+                         EGBM_ERROR_MESSAGE)
+
+/*
+ * Extensions this library is interested in. Extension strings are parsed once
+ * into a bitmask of these, which can then be tested in constant time. Keep in
+ * the same order as the names in gbm-utils.c.
+ */
+typedef enum {
+    EGBM_EXT_ANDROID_native_fence_sync,
+    EGBM_EXT_EXT_device_base,
+    EGBM_EXT_EXT_device_drm,
+    EGBM_EXT_EXT_device_drm_render_node,
+    EGBM_EXT_EXT_device_query,
+    EGBM_EXT_EXT_image_dma_buf_import,
+    EGBM_EXT_EXT_image_dma_buf_import_modifiers,
+    EGBM_EXT_EXT_pixel_format_float,
+    EGBM_EXT_EXT_platform_device,
+    EGBM_EXT_EXT_sync_reuse,
+    EGBM_EXT_KHR_display_reference,
+    EGBM_EXT_KHR_image_base,
+    EGBM_EXT_KHR_stream,
+    EGBM_EXT_KHR_stream_producer_eglsurface,
+    EGBM_EXT_MESA_image_dma_buf_export,
+    EGBM_EXT_NV_stream_consumer_eglimage,
+    EGBM_EXT_COUNT
+} GbmExtension;
+
+typedef uint64_t GbmExtensionSet;
+
+#define eGbmHasExtension(set, ext) \
+    (((set) & ((GbmExtensionSet)1 << EGBM_EXT_##ext)) != 0)
+
+/*
+ * The number of values an attribute list built with GbmAttribList can hold,
+ * including the terminating EGL_NONE, before it spills to the heap.
+ */
+#define GBM_ATTRIB_LIST_INLINE_SIZE 64
 
-EGLBoolean eGbmFindExtension(const char* extension, const char* extensions);
-void eGbmSetErrorInternal(GbmPlatformData *data, EGLint error,
-                          const char *file, int line);
+/*
+ * An attribute list being rewritten before it's passed on to the driver.
+ * Meant to live on the stack, so that typical lists need no allocation.
+ */
+typedef struct GbmAttribListRec {
+    EGLint* attribs;
+    /* The number of values in <attribs>, not counting EGL_NONE */
+    EGLint nAttribs;
+    EGLint size;
+    EGLint inlineAttribs[GBM_ATTRIB_LIST_INLINE_SIZE];
+} GbmAttribList;
+
+GbmExtensionSet eGbmParseExtensions(const char* extensions);
+/* <data> may be NULL if <obj> isn't, in which case <obj>'s display's is used */
+void eGbmSetErrorInternal(GbmPlatformData *data,
+                          const GbmObject *obj,
+                          EGLint error,
+                          EGLint type,
+                          const char *msg);
+
+/*
+ * Optional logging of errors to stderr, enabled by setting EGL_GBM_LOG_ERRORS
+ * to the maximum number of errors to log per second and thread. The number
+ * of errors that weren't logged is reported when a second ends, the thread
+ * exits, or eGbmErrorLogFlush() is called from it.
+ */
+void eGbmErrorLogInit(void);
+void eGbmErrorLogFlush(void);
 
 EGLBoolean eGbmPointerIsDereferenceable(void* p);
 
+int eGbmGetEnvInt(const char* name, int defaultValue);
+
+void eGbmAttribListInit(GbmAttribList* list);
+bool eGbmAttribListAppend(GbmAttribList* list, EGLint name, EGLint value);
+void eGbmAttribListFree(GbmAttribList* list);
+
+uint64_t eGbmGetTimeNs(void);
+
 #endif /* GBM_UTILS_H */
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * Microbenchmarks of the paths taken for every frame or EGL call, run
+ * against the stub driver with "meson test --benchmark". The argument
+ * selects the benchmark, and an optional second argument scales the number
+ * of iterations.
+ */
+
+#include "test-utils.h"
+#include "gbm-handle.h"
+#include "gbm-utils.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <drm_fourcc.h>
+
+#define MAX_THREADS 64
+
+static unsigned int scale = 1;
+
+typedef struct HandleThreadRec {
+    pthread_t thread;
+    pthread_barrier_t* barrier;
+    GbmObject* obj;
+    unsigned int iterations;
+} HandleThread;
+
+static void*
+HandleThreadMain(void* arg)
+{
+    HandleThread* t = arg;
+    unsigned int i;
+
+    pthread_barrier_wait(t->barrier);
+
+    for (i = 0; i < t->iterations; i++) {
+        GbmObject* obj = eGbmRefHandle(t->obj);
+
+        CHECK(obj == t->obj);
+        eGbmUnrefObject(obj);
+    }
+
+    return NULL;
+}
+
+/*
+ * Looks up and releases handles on <numThreads> threads, either all the same
+ * one, which is what happens when several threads use one display, or one
+ * per thread.
+ */
+static void
+BenchHandles(int numThreads, bool shared)
+{
+    static TestObject objs[MAX_THREADS];
+    HandleThread threads[MAX_THREADS];
+    pthread_barrier_t barrier;
+    unsigned int iterations = 200000 * scale;
+    uint64_t start, elapsed;
+    int i;
+
+    for (i = 0; i < numThreads; i++) {
+        TestInitObject(&objs[i]);
+        CHECK(eGbmAddObject(&objs[i].base));
+    }
+
+    CHECK(!pthread_barrier_init(&barrier, NULL, numThreads + 1));
+
+    for (i = 0; i < numThreads; i++) {
+        threads[i].barrier = &barrier;
+        threads[i].obj = shared ? &objs[0].base : &objs[i].base;
+        threads[i].iterations = iterations;
+        CHECK(!pthread_create(&threads[i].thread, NULL, HandleThreadMain,
+                              &threads[i]));
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = eGbmGetTimeNs();
+
+    for (i = 0; i < numThreads; i++) pthread_join(threads[i].thread, NULL);
+
+    elapsed = eGbmGetTimeNs() - start;
+    pthread_barrier_destroy(&barrier);
+
+    for (i = 0; i < numThreads; i++) CHECK(eGbmDestroyHandle(&objs[i].base));
+
+    printf("handle ref/unref (%s), %2d threads: %8.2f Mops/s\n",
+           shared ? "shared" : "private", numThreads,
+           (double)iterations * numThreads * 1000.0 / (double)elapsed);
+}
+
+static void
+BenchChooseConfig(TestDisplay* t, bool nativeVisual)
+{
+    const EGLint attribs[] = {
+        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        nativeVisual ? EGL_NATIVE_VISUAL_ID : EGL_NONE, DRM_FORMAT_XRGB8888,
+        EGL_NONE
+    };
+    unsigned int iterations = 100000 * scale;
+    EGLConfig configs[64];
+    EGLint numConfigs;
+    uint64_t start, elapsed;
+    unsigned int i;
+
+    CHECK(t->egl.ChooseConfig(t->dpy, attribs, configs, 64, &numConfigs));
+    CHECK(numConfigs > 0);
+
+    start = eGbmGetTimeNs();
+
+    for (i = 0; i < iterations; i++)
+        t->egl.ChooseConfig(t->dpy, attribs, configs, 64, &numConfigs);
+
+    elapsed = eGbmGetTimeNs() - start;
+
+    printf("eglChooseConfig (%s native visual): %8.1f ns/call\n",
+           nativeVisual ? "with" : "without",
+           (double)elapsed / iterations);
+}
+
+/*
+ * Runs the frame loop of a typical compositor: wait for a free buffer,
+ * render, swap, then lock the new front buffer and release it again once it
+ * has been displayed.
+ */
+static void
+BenchLockRelease(TestDisplay* t, bool mailbox)
+{
+    unsigned int iterations = 100000 * scale;
+    TestWindow w;
+    uint64_t start, elapsed;
+    unsigned int i;
+
+    setenv("EGL_GBM_MAILBOX", mailbox ? "1" : "0", 1);
+    CHECK(TestCreateWindow(t, &w, 1920, 1080, NULL));
+
+    start = eGbmGetTimeNs();
+
+    for (i = 0; i < iterations; i++) {
+        struct gbm_bo* bo;
+
+        CHECK(gbm_surface_has_free_buffers(w.gbmSurf));
+        CHECK(t->egl.SwapBuffers(t->dpy, w.surf));
+        CHECK((bo = gbm_surface_lock_front_buffer(w.gbmSurf)));
+        gbm_surface_release_buffer(w.gbmSurf, bo);
+    }
+
+    elapsed = eGbmGetTimeNs() - start;
+
+    TestDestroyWindow(t, &w);
+    unsetenv("EGL_GBM_MAILBOX");
+
+    printf("swap/lock/release (%s): %10.0f cycles/s\n",
+           mailbox ? "mailbox" : "fifo",
+           (double)iterations * 1e9 / (double)elapsed);
+}
+
+int
+main(int argc, char** argv)
+{
+    TestDisplay t;
+    int n;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s handles|choose-config|lock-release "
+                "[scale]\n", argv[0]);
+        return 2;
+    }
+
+    if (argc > 2 && atoi(argv[2]) > 0) scale = (unsigned int)atoi(argv[2]);
+
+    if (!strcmp(argv[1], "handles")) {
+        for (n = 1; n <= MAX_THREADS; n *= 2) BenchHandles(n, true);
+        for (n = 1; n <= MAX_THREADS; n *= 2) BenchHandles(n, false);
+    } else if (!strcmp(argv[1], "choose-config")) {
+        TestOpenDisplay(&t);
+        BenchChooseConfig(&t, false);
+        BenchChooseConfig(&t, true);
+        TestCloseDisplay(&t);
+    } else if (!strcmp(argv[1], "lock-release")) {
+        TestOpenDisplay(&t);
+        BenchLockRelease(&t, true);
+        BenchLockRelease(&t, false);
+        TestCloseDisplay(&t);
+    } else {
+        fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+        return 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,1142 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "egl-stub.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <drm_fourcc.h>
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
+
+/* The number of buffers each producer surface adds to its stream */
+#define STUB_EXTRA_BUFFERS 1
+#define STUB_MAX_STREAM_IMAGES 8
+#define STUB_MAX_EVENTS 64
+
+typedef struct StubConfigRec {
+    EGLint r, g, b, a;
+    EGLint depth;
+    EGLint surfaceType;
+} StubConfig;
+
+typedef enum {
+    /* Owned by the producer */
+    STUB_IMAGE_FREE,
+    /* Presented, waiting to be acquired by the consumer */
+    STUB_IMAGE_QUEUED,
+    STUB_IMAGE_ACQUIRED,
+} StubImageState;
+
+typedef struct StubImageRec {
+    /* NULL if the image was imported from a dma-buf */
+    struct StubStreamRec* stream;
+    StubImageState state;
+    int fd;
+    bool created;
+    bool removed;
+    /* When rendering the frame last presented in the image completes */
+    uint64_t renderDone;
+} StubImage;
+
+typedef struct StubStreamRec {
+    EGLint fifoLength;
+    bool connected;
+    uint64_t modifier;
+    struct StubSurfaceRec* producer;
+    EGLint width;
+    EGLint height;
+
+    /* Least recently presented first */
+    StubImage* images[STUB_MAX_STREAM_IMAGES];
+    int numImages;
+
+    /* Presented frames, oldest first */
+    StubImage* queue[STUB_MAX_STREAM_IMAGES];
+    int numQueued;
+    uint32_t numPresented;
+
+    struct {
+        EGLenum event;
+        EGLAttrib aux;
+    } events[STUB_MAX_EVENTS];
+    unsigned int firstEvent;
+    unsigned int numEvents;
+} StubStream;
+
+typedef struct StubSurfaceRec {
+    /* NULL for pbuffers */
+    StubStream* stream;
+    EGLint width;
+    EGLint height;
+} StubSurface;
+
+typedef struct StubSyncRec {
+    EGLenum syncType;
+    /* When the frame the sync was last used to acquire is rendered */
+    uint64_t signalTime;
+} StubSync;
+
+static const StubConfig Configs[] = {
+#define STUB_CONFIGS(_DEPTH, _TYPE) \
+    { 8, 8, 8, 0, _DEPTH, _TYPE }, \
+    { 8, 8, 8, 8, _DEPTH, _TYPE }, \
+    { 5, 6, 5, 0, _DEPTH, _TYPE }, \
+    { 10, 10, 10, 0, _DEPTH, _TYPE }, \
+    { 10, 10, 10, 2, _DEPTH, _TYPE }
+    STUB_CONFIGS(0, EGL_STREAM_BIT_KHR | EGL_PBUFFER_BIT),
+    STUB_CONFIGS(24, EGL_STREAM_BIT_KHR | EGL_PBUFFER_BIT),
+    STUB_CONFIGS(0, EGL_PBUFFER_BIT),
+    STUB_CONFIGS(24, EGL_PBUFFER_BIT),
+#undef STUB_CONFIGS
+};
+
+static const char ClientExtensions[] =
+    "EGL_EXT_client_extensions "
+    "EGL_EXT_device_base "
+    "EGL_EXT_device_query "
+    "EGL_EXT_platform_base "
+    "EGL_EXT_platform_device";
+
+static const char DisplayExtensions[] =
+    "EGL_ANDROID_native_fence_sync "
+    "EGL_EXT_image_dma_buf_import "
+    "EGL_EXT_image_dma_buf_import_modifiers "
+    "EGL_EXT_sync_reuse "
+    "EGL_KHR_fence_sync "
+    "EGL_KHR_image_base "
+    "EGL_KHR_stream "
+    "EGL_KHR_stream_producer_eglsurface "
+    "EGL_MESA_image_dma_buf_export "
+    "EGL_NV_stream_consumer_eglimage";
+
+/* Only their addresses are used */
+static char stubDevice;
+static char stubDisplay;
+
+static bool initialized;
+static __thread EGLint lastError = EGL_SUCCESS;
+
+static StubEglCounts counts;
+static uint64_t syncLatency;
+static int maxNativeFenceSyncs = -1;
+static int numNativeFenceSyncs;
+static __thread EGLSurface currentSurface = EGL_NO_SURFACE;
+
+static uint64_t
+NowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static EGLBoolean
+SetError(EGLint error)
+{
+    lastError = error;
+    return EGL_FALSE;
+}
+
+static bool
+IsConfig(EGLConfig config)
+{
+    const StubConfig* cfg = config;
+
+    return cfg >= Configs && cfg < Configs + ARRAY_LEN(Configs);
+}
+
+static EGLint
+ConfigId(const StubConfig* cfg)
+{
+    return (EGLint)(cfg - Configs) + 1;
+}
+
+static bool
+GetAttrib(const StubConfig* cfg, EGLint attrib, EGLint* value)
+{
+    switch (attrib) {
+    case EGL_CONFIG_ID: *value = ConfigId(cfg); return true;
+    case EGL_RED_SIZE: *value = cfg->r; return true;
+    case EGL_GREEN_SIZE: *value = cfg->g; return true;
+    case EGL_BLUE_SIZE: *value = cfg->b; return true;
+    case EGL_ALPHA_SIZE: *value = cfg->a; return true;
+    case EGL_DEPTH_SIZE: *value = cfg->depth; return true;
+    case EGL_SURFACE_TYPE: *value = cfg->surfaceType; return true;
+    case EGL_NATIVE_VISUAL_ID: *value = 0; return true;
+    case EGL_COLOR_COMPONENT_TYPE_EXT:
+        *value = EGL_COLOR_COMPONENT_TYPE_FIXED_EXT;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool
+ConfigMatches(const StubConfig* cfg, const EGLint* attribs)
+{
+    EGLint value;
+    int i;
+
+    for (i = 0; attribs && attribs[i] != EGL_NONE; i += 2) {
+        if (attribs[i + 1] == EGL_DONT_CARE) continue;
+        if (!GetAttrib(cfg, attribs[i], &value)) continue;
+
+        switch (attribs[i]) {
+        case EGL_CONFIG_ID:
+            if (value != attribs[i + 1]) return false;
+            break;
+        case EGL_SURFACE_TYPE:
+            if ((value & attribs[i + 1]) != attribs[i + 1]) return false;
+            break;
+        default:
+            if (value < attribs[i + 1]) return false;
+            break;
+        }
+    }
+
+    return true;
+}
+
+static void
+QueueEvent(StubStream* stream, EGLenum event, EGLAttrib aux)
+{
+    unsigned int i;
+
+    if (stream->numEvents == ARRAY_LEN(stream->events)) abort();
+
+    i = (stream->firstEvent + stream->numEvents++) % ARRAY_LEN(stream->events);
+    stream->events[i].event = event;
+    stream->events[i].aux = aux;
+}
+
+static StubImage*
+NewImage(StubStream* stream)
+{
+    StubImage* image = calloc(1, sizeof(*image));
+
+    if (!image) return NULL;
+
+    image->stream = stream;
+    image->fd = memfd_create("egl-stub-image", MFD_CLOEXEC);
+
+    if (image->fd < 0) {
+        free(image);
+        return NULL;
+    }
+
+    counts.streamImages++;
+
+    return image;
+}
+
+/*
+ * Creates an image for the dma-buf of plane 0 in <attribs>. The image keeps
+ * its own file descriptor, so the dma-buf stays alive as long as the image
+ * does, as it would in a driver.
+ */
+static StubImage*
+ImportImage(const EGLint* attribs)
+{
+    StubImage* image;
+    int fd = -1;
+
+    for (; attribs && attribs[0] != EGL_NONE; attribs += 2) {
+        if (attribs[0] == EGL_DMA_BUF_PLANE0_FD_EXT) fd = attribs[1];
+    }
+
+    if (fd < 0) return NULL;
+
+    if (!(image = calloc(1, sizeof(*image)))) return NULL;
+
+    if ((image->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        free(image);
+        return NULL;
+    }
+
+    counts.imports++;
+    counts.importsCreated++;
+
+    return image;
+}
+
+static void
+FreeImage(StubImage* image)
+{
+    if (image->stream)
+        counts.streamImages--;
+    else
+        counts.imports--;
+
+    if (image->fd >= 0) close(image->fd);
+    free(image);
+}
+
+static bool
+AddStreamImage(StubStream* stream)
+{
+    StubImage* image;
+
+    if (stream->numImages == ARRAY_LEN(stream->images)) return false;
+
+    if (!(image = NewImage(stream))) return false;
+
+    stream->images[stream->numImages++] = image;
+    QueueEvent(stream, EGL_STREAM_IMAGE_ADD_NV, (EGLAttrib)image);
+
+    return true;
+}
+
+/* Forgets <image>, which the consumer no longer references */
+static void
+DropStreamImage(StubStream* stream, StubImage* image)
+{
+    int i;
+
+    for (i = 0; i < stream->numImages; i++) {
+        if (stream->images[i] == image) {
+            memmove(&stream->images[i], &stream->images[i + 1],
+                    (stream->numImages - i - 1) * sizeof(stream->images[0]));
+            stream->numImages--;
+            break;
+        }
+    }
+
+    FreeImage(image);
+}
+
+static EGLBoolean
+PresentFrame(EGLDisplay dpy, EGLSurface surface)
+{
+    StubSurface* surf = surface;
+    StubStream* stream;
+    StubImage* image = NULL;
+    uint32_t frame;
+    int i;
+
+    if (dpy != &stubDisplay || !surf) return SetError(EGL_BAD_SURFACE);
+
+    /* Nothing to present for pbuffers */
+    if (!(stream = surf->stream)) return EGL_TRUE;
+
+    /*
+     * A real driver would block until the consumer returns a buffer. Fail
+     * instead, since nothing else can make progress in a single thread.
+     */
+    if (stream->numQueued >= stream->fifoLength)
+        return SetError(EGL_BAD_ACCESS);
+
+    for (i = 0; i < stream->numImages; i++) {
+        if (stream->images[i]->state == STUB_IMAGE_FREE &&
+            !stream->images[i]->removed) {
+            image = stream->images[i];
+            break;
+        }
+    }
+
+    if (!image) return SetError(EGL_BAD_ACCESS);
+
+    /* The contents only tell which frame the buffer holds */
+    frame = stream->numPresented + 1;
+    if (pwrite(image->fd, &frame, sizeof(frame), 0) != sizeof(frame))
+        return SetError(EGL_BAD_ALLOC);
+
+    stream->numPresented = frame;
+
+    /* Hand out the buffers round robin, as a swap chain would */
+    memmove(&stream->images[i], &stream->images[i + 1],
+            (stream->numImages - i - 1) * sizeof(stream->images[0]));
+    stream->images[stream->numImages - 1] = image;
+
+    image->state = STUB_IMAGE_QUEUED;
+    image->renderDone = NowNs() + syncLatency;
+    stream->queue[stream->numQueued++] = image;
+    QueueEvent(stream, EGL_STREAM_IMAGE_AVAILABLE_NV, 0);
+    counts.presented++;
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubChooseConfig(EGLDisplay dpy,
+                 const EGLint* attribs,
+                 EGLConfig* configs,
+                 EGLint configSize,
+                 EGLint* numConfig)
+{
+    unsigned int i;
+
+    if (dpy != &stubDisplay || !initialized)
+        return SetError(EGL_NOT_INITIALIZED);
+    if (!numConfig) return SetError(EGL_BAD_PARAMETER);
+
+    *numConfig = 0;
+
+    for (i = 0; i < ARRAY_LEN(Configs); i++) {
+        if (configs && *numConfig >= configSize) break;
+        if (!ConfigMatches(&Configs[i], attribs)) continue;
+
+        if (configs) configs[*numConfig] = (EGLConfig)&Configs[i];
+        (*numConfig)++;
+    }
+
+    return EGL_TRUE;
+}
+
+static EGLint
+StubClientWaitSyncKHR(EGLDisplay dpy,
+                      EGLSyncKHR sync,
+                      EGLint flags,
+                      EGLTimeKHR timeout)
+{
+    StubSync* stubSync = sync;
+    uint64_t now = NowNs();
+
+    (void)flags;
+    (void)timeout;
+
+    if (dpy != &stubDisplay || !stubSync) {
+        SetError(EGL_BAD_PARAMETER);
+        return EGL_FALSE;
+    }
+
+    counts.waits++;
+
+    if (stubSync->signalTime > now) {
+        uint64_t delay = stubSync->signalTime - now;
+        struct timespec ts = {
+            .tv_sec = delay / 1000000000ull,
+            .tv_nsec = delay % 1000000000ull,
+        };
+
+        while (nanosleep(&ts, &ts) && errno == EINTR);
+    }
+
+    return EGL_CONDITION_SATISFIED_KHR;
+}
+
+static EGLImageKHR
+StubCreateImageKHR(EGLDisplay dpy,
+                   EGLContext ctx,
+                   EGLenum target,
+                   EGLClientBuffer buffer,
+                   const EGLint* attribs)
+{
+    StubStream* stream = (StubStream*)buffer;
+    StubImage* image;
+    int i;
+
+    (void)ctx;
+
+    if (dpy != &stubDisplay) {
+        SetError(EGL_BAD_DISPLAY);
+        return EGL_NO_IMAGE_KHR;
+    }
+
+    if (target == EGL_LINUX_DMA_BUF_EXT) {
+        if (!(image = ImportImage(attribs))) SetError(EGL_BAD_PARAMETER);
+        return image ? (EGLImageKHR)image : EGL_NO_IMAGE_KHR;
+    }
+
+    if (target != EGL_STREAM_CONSUMER_IMAGE_NV || !stream) {
+        SetError(EGL_BAD_PARAMETER);
+        return EGL_NO_IMAGE_KHR;
+    }
+
+    /* The consumer creates images in the order they were added */
+    for (i = 0; i < stream->numImages; i++) {
+        if (!stream->images[i]->created) {
+            stream->images[i]->created = true;
+            return (EGLImageKHR)stream->images[i];
+        }
+    }
+
+    SetError(EGL_BAD_MATCH);
+    return EGL_NO_IMAGE_KHR;
+}
+
+static EGLImage
+StubCreateImage(EGLDisplay dpy,
+                EGLContext ctx,
+                EGLenum target,
+                EGLClientBuffer buffer,
+                const EGLAttrib* attribs)
+{
+    (void)attribs;
+
+    return StubCreateImageKHR(dpy, ctx, target, buffer, NULL);
+}
+
+static EGLSurface
+StubCreatePbufferSurface(EGLDisplay dpy,
+                         EGLConfig config,
+                         const EGLint* attribs)
+{
+    StubSurface* surf;
+    int i;
+
+    if (dpy != &stubDisplay || !IsConfig(config)) {
+        SetError(EGL_BAD_CONFIG);
+        return EGL_NO_SURFACE;
+    }
+
+    if (!(surf = calloc(1, sizeof(*surf)))) {
+        SetError(EGL_BAD_ALLOC);
+        return EGL_NO_SURFACE;
+    }
+
+    counts.surfaces++;
+
+    for (i = 0; attribs && attribs[i] != EGL_NONE; i += 2) {
+        if (attribs[i] == EGL_WIDTH) surf->width = attribs[i + 1];
+        if (attribs[i] == EGL_HEIGHT) surf->height = attribs[i + 1];
+    }
+
+    return (EGLSurface)surf;
+}
+
+static EGLStreamKHR
+StubCreateStreamKHR(EGLDisplay dpy, const EGLint* attribs)
+{
+    StubStream* stream;
+    int i;
+
+    if (dpy != &stubDisplay) {
+        SetError(EGL_BAD_DISPLAY);
+        return EGL_NO_STREAM_KHR;
+    }
+
+    if (!(stream = calloc(1, sizeof(*stream)))) {
+        SetError(EGL_BAD_ALLOC);
+        return EGL_NO_STREAM_KHR;
+    }
+
+    stream->fifoLength = 1;
+
+    for (i = 0; attribs && attribs[i] != EGL_NONE; i += 2) {
+        if (attribs[i] == EGL_STREAM_FIFO_LENGTH_KHR)
+            stream->fifoLength = attribs[i + 1];
+    }
+
+    if (stream->fifoLength < 1 ||
+        stream->fifoLength + STUB_EXTRA_BUFFERS > STUB_MAX_STREAM_IMAGES) {
+        free(stream);
+        SetError(EGL_BAD_ATTRIBUTE);
+        return EGL_NO_STREAM_KHR;
+    }
+
+    counts.streams++;
+
+    return (EGLStreamKHR)stream;
+}
+
+static EGLSyncKHR
+StubCreateSyncKHR(EGLDisplay dpy, EGLenum type, const EGLint* attribs)
+{
+    StubSync* sync;
+
+    (void)attribs;
+
+    if (dpy != &stubDisplay) {
+        SetError(EGL_BAD_DISPLAY);
+        return EGL_NO_SYNC_KHR;
+    }
+
+    if (type != EGL_SYNC_FENCE_KHR &&
+        (type != EGL_SYNC_NATIVE_FENCE_ANDROID ||
+         (maxNativeFenceSyncs >= 0 &&
+          numNativeFenceSyncs >= maxNativeFenceSyncs))) {
+        SetError(EGL_BAD_ATTRIBUTE);
+        return EGL_NO_SYNC_KHR;
+    }
+
+    if (!(sync = calloc(1, sizeof(*sync)))) {
+        SetError(EGL_BAD_ALLOC);
+        return EGL_NO_SYNC_KHR;
+    }
+
+    sync->syncType = type;
+    counts.syncs++;
+    if (type == EGL_SYNC_NATIVE_FENCE_ANDROID) numNativeFenceSyncs++;
+
+    return (EGLSyncKHR)sync;
+}
+
+static EGLSurface
+StubCreateStreamProducerSurfaceKHR(EGLDisplay dpy,
+                                   EGLConfig config,
+                                   EGLStreamKHR streamHandle,
+                                   const EGLint* attribs)
+{
+    StubStream* stream = streamHandle;
+    StubSurface* surf;
+    int i;
+
+    if (dpy != &stubDisplay || !IsConfig(config) ||
+        !(((const StubConfig*)config)->surfaceType & EGL_STREAM_BIT_KHR)) {
+        SetError(EGL_BAD_MATCH);
+        return EGL_NO_SURFACE;
+    }
+
+    if (!stream || !stream->connected || stream->producer) {
+        SetError(EGL_BAD_STATE_KHR);
+        return EGL_NO_SURFACE;
+    }
+
+    if (!(surf = calloc(1, sizeof(*surf)))) {
+        SetError(EGL_BAD_ALLOC);
+        return EGL_NO_SURFACE;
+    }
+
+    surf->stream = stream;
+    counts.surfaces++;
+
+    for (i = 0; attribs && attribs[i] != EGL_NONE; i += 2) {
+        if (attribs[i] == EGL_WIDTH) surf->width = attribs[i + 1];
+        if (attribs[i] == EGL_HEIGHT) surf->height = attribs[i + 1];
+    }
+
+    stream->producer = surf;
+    stream->width = surf->width;
+    stream->height = surf->height;
+
+    /* The producer allocates its buffers up front */
+    for (i = 0; i < stream->fifoLength + STUB_EXTRA_BUFFERS; i++) {
+        if (!AddStreamImage(stream)) abort();
+    }
+
+    return (EGLSurface)surf;
+}
+
+static EGLBoolean
+StubDestroyImageKHR(EGLDisplay dpy, EGLImageKHR img)
+{
+    StubImage* image = img;
+
+    if (dpy != &stubDisplay || !image) return SetError(EGL_BAD_PARAMETER);
+
+    if (!image->stream) {
+        FreeImage(image);
+        return EGL_TRUE;
+    }
+
+    /* Destroying an acquired image releases it implicitly */
+    if (image->state == STUB_IMAGE_ACQUIRED) image->state = STUB_IMAGE_FREE;
+
+    image->created = false;
+
+    if (image->removed) DropStreamImage(image->stream, image);
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubDestroyImage(EGLDisplay dpy, EGLImage image)
+{
+    return StubDestroyImageKHR(dpy, image);
+}
+
+static EGLBoolean
+StubDestroyStreamKHR(EGLDisplay dpy, EGLStreamKHR streamHandle)
+{
+    StubStream* stream = streamHandle;
+    int i;
+
+    if (dpy != &stubDisplay || !stream) return SetError(EGL_BAD_STREAM_KHR);
+
+    if (stream->producer) stream->producer->stream = NULL;
+
+    for (i = 0; i < stream->numImages; i++) FreeImage(stream->images[i]);
+
+    free(stream);
+    counts.streams--;
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubDestroySurface(EGLDisplay dpy, EGLSurface surface)
+{
+    StubSurface* surf = surface;
+
+    if (dpy != &stubDisplay || !surf) return SetError(EGL_BAD_SURFACE);
+
+    if (surf->stream) surf->stream->producer = NULL;
+
+    free(surf);
+    counts.surfaces--;
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubDestroySyncKHR(EGLDisplay dpy, EGLSyncKHR sync)
+{
+    if (dpy != &stubDisplay || !sync) return SetError(EGL_BAD_PARAMETER);
+
+    if (((StubSync*)sync)->syncType == EGL_SYNC_NATIVE_FENCE_ANDROID)
+        numNativeFenceSyncs--;
+
+    free(sync);
+    counts.syncs--;
+
+    return EGL_TRUE;
+}
+
+static EGLint
+StubDupNativeFenceFDANDROID(EGLDisplay dpy, EGLSyncKHR syncHandle)
+{
+    StubSync* sync = syncHandle;
+
+    if (dpy != &stubDisplay || !sync ||
+        sync->syncType != EGL_SYNC_NATIVE_FENCE_ANDROID) {
+        SetError(EGL_BAD_PARAMETER);
+        return EGL_NO_NATIVE_FENCE_FD_ANDROID;
+    }
+
+    /* Any file descriptor stands in for the fence of pending rendering */
+    if (sync->signalTime > NowNs()) return eventfd(0, EFD_CLOEXEC);
+
+    return EGL_NO_NATIVE_FENCE_FD_ANDROID;
+}
+
+static EGLBoolean
+StubExportDMABUFImageMESA(EGLDisplay dpy,
+                          EGLImageKHR img,
+                          int* fds,
+                          EGLint* strides,
+                          EGLint* offsets)
+{
+    StubImage* image = img;
+
+    if (dpy != &stubDisplay || !image || !image->stream) {
+        return SetError(EGL_BAD_PARAMETER);
+    }
+
+    if ((fds[0] = dup(image->fd)) < 0) return SetError(EGL_BAD_ALLOC);
+
+    strides[0] = image->stream->width * 4;
+    offsets[0] = 0;
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubExportDMABUFImageQueryMESA(EGLDisplay dpy,
+                               EGLImageKHR img,
+                               int* fourcc,
+                               int* numPlanes,
+                               EGLuint64KHR* modifiers)
+{
+    StubImage* image = img;
+
+    if (dpy != &stubDisplay || !image || !image->stream) {
+        return SetError(EGL_BAD_PARAMETER);
+    }
+
+    if (fourcc) *fourcc = DRM_FORMAT_XRGB8888;
+    if (numPlanes) *numPlanes = 1;
+    if (modifiers) *modifiers = image->stream->modifier;
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubGetConfigAttrib(EGLDisplay dpy,
+                    EGLConfig config,
+                    EGLint attribute,
+                    EGLint* value)
+{
+    if (dpy != &stubDisplay || !IsConfig(config))
+        return SetError(EGL_BAD_CONFIG);
+
+    if (!GetAttrib(config, attribute, value))
+        return SetError(EGL_BAD_ATTRIBUTE);
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubGetConfigs(EGLDisplay dpy,
+               EGLConfig* configs,
+               EGLint configSize,
+               EGLint* numConfig)
+{
+    return StubChooseConfig(dpy, NULL, configs, configSize, numConfig);
+}
+
+static EGLSurface
+StubGetCurrentSurface(EGLint readdraw)
+{
+    (void)readdraw;
+
+    return currentSurface;
+}
+
+static EGLint
+StubGetError(void)
+{
+    EGLint error = lastError;
+
+    lastError = EGL_SUCCESS;
+
+    return error;
+}
+
+static EGLDisplay
+StubGetPlatformDisplay(EGLenum platform,
+                       void* nativeDisplay,
+                       const EGLAttrib* attribs)
+{
+    (void)attribs;
+
+    if (platform != EGL_PLATFORM_DEVICE_EXT || nativeDisplay != &stubDevice) {
+        SetError(EGL_BAD_PARAMETER);
+        return EGL_NO_DISPLAY;
+    }
+
+    return (EGLDisplay)&stubDisplay;
+}
+
+static EGLBoolean
+StubInitialize(EGLDisplay dpy, EGLint* major, EGLint* minor)
+{
+    if (dpy != &stubDisplay) return SetError(EGL_BAD_DISPLAY);
+
+    initialized = true;
+
+    if (major) *major = 1;
+    if (minor) *minor = 5;
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubQueryDevicesEXT(EGLint maxDevices,
+                    EGLDeviceEXT* devices,
+                    EGLint* numDevices)
+{
+    if (!numDevices) return SetError(EGL_BAD_PARAMETER);
+
+    *numDevices = 1;
+
+    if (devices) {
+        if (maxDevices < 1) return SetError(EGL_BAD_PARAMETER);
+        devices[0] = (EGLDeviceEXT)&stubDevice;
+    }
+
+    return EGL_TRUE;
+}
+
+static const char*
+StubQueryDeviceStringEXT(EGLDeviceEXT device, EGLint name)
+{
+    if (device != &stubDevice) {
+        SetError(EGL_BAD_DEVICE_EXT);
+        return NULL;
+    }
+
+    switch (name) {
+    case EGL_EXTENSIONS:
+        return "EGL_EXT_device_drm";
+    case EGL_DRM_DEVICE_FILE_EXT:
+        return STUB_DRM_DEVICE_FILE;
+    default:
+        SetError(EGL_BAD_PARAMETER);
+        return NULL;
+    }
+}
+
+static EGLint
+StubQueryStreamConsumerEventNV(EGLDisplay dpy,
+                               EGLStreamKHR streamHandle,
+                               EGLTime timeout,
+                               EGLenum* event,
+                               EGLAttrib* aux)
+{
+    StubStream* stream = streamHandle;
+
+    (void)timeout;
+
+    if (dpy != &stubDisplay || !stream) return SetError(EGL_BAD_STREAM_KHR);
+
+    if (!stream->numEvents) return EGL_TIMEOUT_EXPIRED_KHR;
+
+    *event = stream->events[stream->firstEvent].event;
+    *aux = stream->events[stream->firstEvent].aux;
+    stream->firstEvent = (stream->firstEvent + 1) % ARRAY_LEN(stream->events);
+    stream->numEvents--;
+
+    return EGL_TRUE;
+}
+
+static const char*
+StubQueryString(EGLDisplay dpy, EGLint name)
+{
+    if (dpy == EGL_NO_DISPLAY && name == EGL_EXTENSIONS)
+        return ClientExtensions;
+
+    if (dpy != &stubDisplay || !initialized) {
+        SetError(EGL_NOT_INITIALIZED);
+        return NULL;
+    }
+
+    switch (name) {
+    case EGL_EXTENSIONS:
+        return DisplayExtensions;
+    case EGL_VENDOR:
+        return "egl-gbm stub";
+    case EGL_VERSION:
+        return "1.5 egl-gbm stub";
+    default:
+        SetError(EGL_BAD_PARAMETER);
+        return NULL;
+    }
+}
+
+static EGLBoolean
+StubQuerySurface(EGLDisplay dpy,
+                 EGLSurface surface,
+                 EGLint attribute,
+                 EGLint* value)
+{
+    StubSurface* surf = surface;
+
+    if (dpy != &stubDisplay || !surf) return SetError(EGL_BAD_SURFACE);
+
+    switch (attribute) {
+    case EGL_WIDTH:
+        *value = surf->width;
+        return EGL_TRUE;
+    case EGL_HEIGHT:
+        *value = surf->height;
+        return EGL_TRUE;
+    default:
+        return SetError(EGL_BAD_ATTRIBUTE);
+    }
+}
+
+static EGLBoolean
+StubStreamImageConsumerConnectNV(EGLDisplay dpy,
+                                 EGLStreamKHR streamHandle,
+                                 EGLint numModifiers,
+                                 const EGLuint64KHR* modifiers,
+                                 const EGLAttrib* attribs)
+{
+    StubStream* stream = streamHandle;
+
+    (void)attribs;
+
+    if (dpy != &stubDisplay || !stream) return SetError(EGL_BAD_STREAM_KHR);
+    if (stream->connected) return SetError(EGL_BAD_STATE_KHR);
+
+    stream->connected = true;
+    stream->modifier = numModifiers > 0 ? modifiers[0] : DRM_FORMAT_MOD_LINEAR;
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubStreamAcquireImageNV(EGLDisplay dpy,
+                         EGLStreamKHR streamHandle,
+                         EGLImage* img,
+                         EGLSync sync)
+{
+    StubStream* stream = streamHandle;
+    StubImage* image;
+
+    if (dpy != &stubDisplay || !stream) return SetError(EGL_BAD_STREAM_KHR);
+
+    if (!stream->numQueued || !stream->queue[0]->created)
+        return SetError(EGL_BAD_STATE_KHR);
+
+    image = stream->queue[0];
+    memmove(&stream->queue[0], &stream->queue[1],
+            --stream->numQueued * sizeof(stream->queue[0]));
+
+    image->state = STUB_IMAGE_ACQUIRED;
+    *img = (EGLImage)image;
+    counts.acquired++;
+
+    if (sync) ((StubSync*)sync)->signalTime = image->renderDone;
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubStreamReleaseImageNV(EGLDisplay dpy,
+                         EGLStreamKHR streamHandle,
+                         EGLImage img,
+                         EGLSync sync)
+{
+    StubImage* image = img;
+
+    (void)sync;
+
+    if (dpy != &stubDisplay || !streamHandle)
+        return SetError(EGL_BAD_STREAM_KHR);
+
+    if (!image || image->stream != streamHandle ||
+        image->state != STUB_IMAGE_ACQUIRED) {
+        return SetError(EGL_BAD_PARAMETER);
+    }
+
+    image->state = STUB_IMAGE_FREE;
+    counts.released++;
+
+    return EGL_TRUE;
+}
+
+static EGLBoolean
+StubSwapBuffers(EGLDisplay dpy, EGLSurface surface)
+{
+    return PresentFrame(dpy, surface);
+}
+
+static EGLBoolean
+StubSwapBuffersWithDamageEXT(EGLDisplay dpy,
+                             EGLSurface surface,
+                             const EGLint* rects,
+                             EGLint numRects)
+{
+    (void)rects;
+    (void)numRects;
+
+    return PresentFrame(dpy, surface);
+}
+
+static EGLBoolean
+StubSwapBuffersWithDamageKHR(EGLDisplay dpy,
+                             EGLSurface surface,
+                             const EGLint* rects,
+                             EGLint numRects)
+{
+    (void)rects;
+    (void)numRects;
+
+    return PresentFrame(dpy, surface);
+}
+
+static EGLBoolean
+StubTerminate(EGLDisplay dpy)
+{
+    if (dpy != &stubDisplay) return SetError(EGL_BAD_DISPLAY);
+
+    initialized = false;
+
+    return EGL_TRUE;
+}
+
+static void*
+StubGetProcAddress(const char* name)
+{
+    /* Assigning to the prototype first checks the stub's signature */
+#define DO_EGL_FUNC(_PROTO, _FUNC) \
+    if (!strcmp(name, "egl" #_FUNC)) { \
+        _PROTO func = Stub##_FUNC; \
+        return (void*)func; \
+    }
+#include "gbm-egl-imports.h"
+#undef DO_EGL_FUNC
+
+    return NULL;
+}
+
+static EGLBoolean
+StubSetError(EGLint error, EGLint msgType, const char* msg)
+{
+    (void)msgType;
+    (void)msg;
+
+    lastError = error;
+
+    return EGL_TRUE;
+}
+
+bool
+StubEglLoadPlatform(EGLExtPlatform* platform)
+{
+    static const EGLExtDriver driver = {
+        .getProcAddress = StubGetProcAddress,
+        .setError = StubSetError,
+    };
+
+    memset(platform, 0, sizeof(*platform));
+
+    return loadEGLExternalPlatform(GBM_EXTERNAL_VERSION_MAJOR,
+                                   GBM_EXTERNAL_VERSION_MINOR,
+                                   &driver,
+                                   platform);
+}
+
+EGLint
+StubEglTakeError(void)
+{
+    return StubGetError();
+}
+
+const StubEglCounts*
+StubEglGetCounts(void)
+{
+    return &counts;
+}
+
+void
+StubEglSetSyncLatency(uint64_t ns)
+{
+    syncLatency = ns;
+}
+
+void
+StubEglSetNativeFenceSyncs(int max)
+{
+    maxNativeFenceSyncs = max;
+}
+
+void
+StubEglSetCurrentSurface(EGLSurface surface)
+{
+    currentSurface = surface;
+}
+
+int
+StubEglChurnImages(EGLSurface producer, int numImages)
+{
+    StubSurface* surf = producer;
+    StubStream* stream = surf ? surf->stream : NULL;
+    int numRemoved = 0;
+    int i;
+
+    if (!stream) return 0;
+
+    /*
+     * Frames in the FIFO can't be taken back, but buffers the consumer holds
+     * can, as a driver reallocating its swap chain for a resize would.
+     */
+    for (i = 0; i < stream->numImages && numRemoved < numImages; i++) {
+        StubImage* image = stream->images[i];
+
+        if (image->removed || image->state == STUB_IMAGE_QUEUED) continue;
+
+        image->removed = true;
+        QueueEvent(stream, EGL_STREAM_IMAGE_REMOVE_NV, (EGLAttrib)image);
+        numRemoved++;
+    }
+
+    for (i = 0; i < numRemoved; i++) {
+        if (!AddStreamImage(stream)) abort();
+    }
+
+    return numRemoved;
+}
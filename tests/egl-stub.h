@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef EGL_STUB_H
+#define EGL_STUB_H
+
+#include "gbm-platform.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A fake EGL driver that implements the entry points in gbm-egl-imports.h
+ * well enough to run this library without a GPU. It exposes one EGLDevice
+ * whose DRM device file is STUB_DRM_DEVICE_FILE, a fixed set of configs, and
+ * EGLStreams whose producer surfaces "render" a frame when swapped. That
+ * writes the frame's number, counting from 1 for each stream, as a uint32_t
+ * at the start of one of the stream's buffers, and queues the buffer.
+ * Stream images are backed by memfds, so they can be exported as dma-bufs
+ * and imported into the stub GBM device.
+ *
+ * The stub is not thread safe. Only the handle table may be used from
+ * multiple threads at once.
+ */
+
+/* Any device file works, as long as the stub GBM device opens the same one */
+#define STUB_DRM_DEVICE_FILE "/dev/null"
+
+/*
+ * Loads this library into <platform> as libEGL would, with the stub as the
+ * driver. Returns false if loadEGLExternalPlatform() fails.
+ */
+bool StubEglLoadPlatform(EGLExtPlatform* platform);
+
+/* Returns and clears the last error set by the stub or the platform */
+EGLint StubEglTakeError(void);
+
+/*
+ * The number of objects of each kind currently allocated by the stub, which
+ * must all be zero once every display has been terminated, and the number of
+ * operations performed since the program started.
+ */
+typedef struct StubEglCountsRec {
+    int streams;
+    int surfaces;
+    int syncs;
+    /* Buffers of streams, whether the consumer created images for them */
+    int streamImages;
+    /* Images imported from dma-bufs */
+    int imports;
+
+    unsigned int importsCreated;
+    unsigned int presented;
+    unsigned int acquired;
+    unsigned int released;
+    unsigned int waits;
+} StubEglCounts;
+
+const StubEglCounts* StubEglGetCounts(void);
+
+/*
+ * Makes rendering of each presented frame complete <ns> nanoseconds after it
+ * was presented. Until then, eglClientWaitSyncKHR blocks on the sync object
+ * the frame was acquired with, and native fence syncs have a fence.
+ */
+void StubEglSetSyncLatency(uint64_t ns);
+
+/*
+ * Makes the creation of EGL_SYNC_NATIVE_FENCE_ANDROID syncs fail once <max> of
+ * them exist, or never if <max> is negative
+ */
+void StubEglSetNativeFenceSyncs(int max);
+
+/*
+ * Makes <surface> the calling thread's current draw and read surface, as
+ * eglMakeCurrent would
+ */
+void StubEglSetCurrentSurface(EGLSurface surface);
+
+/*
+ * Removes up to <numImages> buffers from the stream of the producer surface
+ * <producer>, and adds as many new ones, as a driver would when resizing its
+ * swap chain. Buffers in the FIFO are left alone. Returns the number of
+ * buffers replaced.
+ */
+int StubEglChurnImages(EGLSurface producer, int numImages);
+
+#endif /* EGL_STUB_H */
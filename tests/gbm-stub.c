@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "gbm-stub.h"
+#include "egl-stub.h"
+
+#include <gbmint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <drm_fourcc.h>
+
+typedef struct StubGbmBoRec {
+    struct gbm_bo base;
+    int numPlanes;
+    int fds[GBM_MAX_PLANES];
+    uint32_t strides[GBM_MAX_PLANES];
+    uint32_t offsets[GBM_MAX_PLANES];
+    uint64_t modifier;
+} StubGbmBo;
+
+typedef struct StubGbmSurfaceRec {
+    /* Reserved for the EGL platform library */
+    void* eglPriv;
+    struct gbm_surface base;
+} StubGbmSurface;
+
+static int numBos;
+
+static void
+BoDestroy(struct gbm_bo* bo)
+{
+    StubGbmBo* stubBo = (StubGbmBo*)bo;
+    int i;
+
+    for (i = 0; i < stubBo->numPlanes; i++) close(stubBo->fds[i]);
+
+    free(stubBo);
+    numBos--;
+}
+
+static StubGbmBo*
+NewBo(struct gbm_device* gbm,
+      uint32_t width,
+      uint32_t height,
+      uint32_t format,
+      uint64_t modifier)
+{
+    StubGbmBo* bo = calloc(1, sizeof(*bo));
+
+    if (!bo) return NULL;
+
+    bo->base.gbm = gbm;
+    bo->base.v0.width = width;
+    bo->base.v0.height = height;
+    bo->base.v0.format = format;
+    bo->modifier = modifier;
+    numBos++;
+
+    return bo;
+}
+
+static struct gbm_bo*
+BoImport(struct gbm_device* gbm, uint32_t type, void* buffer, uint32_t usage)
+{
+    struct gbm_import_fd_modifier_data* data = buffer;
+    StubGbmBo* bo;
+    uint32_t i;
+
+    (void)usage;
+
+    if (type != GBM_BO_IMPORT_FD_MODIFIER || !data ||
+        data->num_fds < 1 || data->num_fds > GBM_MAX_PLANES) {
+        return NULL;
+    }
+
+    bo = NewBo(gbm, data->width, data->height, data->format, data->modifier);
+
+    if (!bo) return NULL;
+
+    bo->base.v0.stride = data->strides[0];
+
+    for (i = 0; i < data->num_fds; i++) {
+        if ((bo->fds[i] = dup(data->fds[i])) < 0) {
+            BoDestroy(&bo->base);
+            return NULL;
+        }
+
+        bo->numPlanes++;
+        bo->strides[i] = data->strides[i];
+        bo->offsets[i] = data->offsets[i];
+    }
+
+    return &bo->base;
+}
+
+static int
+BoGetPlanes(struct gbm_bo* bo)
+{
+    return ((StubGbmBo*)bo)->numPlanes;
+}
+
+static int
+BoGetPlaneFd(struct gbm_bo* bo, int plane)
+{
+    StubGbmBo* stubBo = (StubGbmBo*)bo;
+
+    if (plane < 0 || plane >= stubBo->numPlanes) return -1;
+
+    return dup(stubBo->fds[plane]);
+}
+
+static uint32_t
+BoGetStride(struct gbm_bo* bo, int plane)
+{
+    StubGbmBo* stubBo = (StubGbmBo*)bo;
+
+    return (plane >= 0 && plane < stubBo->numPlanes) ?
+        stubBo->strides[plane] : 0;
+}
+
+static uint32_t
+BoGetOffset(struct gbm_bo* bo, int plane)
+{
+    StubGbmBo* stubBo = (StubGbmBo*)bo;
+
+    return (plane >= 0 && plane < stubBo->numPlanes) ?
+        stubBo->offsets[plane] : 0;
+}
+
+static uint64_t
+BoGetModifier(struct gbm_bo* bo)
+{
+    return ((StubGbmBo*)bo)->modifier;
+}
+
+static struct gbm_surface*
+SurfaceCreate(struct gbm_device* gbm,
+              uint32_t width,
+              uint32_t height,
+              uint32_t format,
+              uint32_t flags,
+              const uint64_t* modifiers,
+              const unsigned count)
+{
+    /* Modifiers are only ever passed by applications, never this library */
+    if (count) return NULL;
+
+    (void)modifiers;
+
+    return StubGbmCreateSurface(gbm, width, height, format, flags);
+}
+
+static void
+DeviceDestroy(struct gbm_device* gbm)
+{
+    close(gbm->v0.fd);
+    free(gbm);
+}
+
+struct gbm_device*
+StubGbmCreateDevice(void)
+{
+    struct gbm_device* gbm = calloc(1, sizeof(*gbm));
+
+    if (!gbm) return NULL;
+
+    gbm->v0.fd = open(STUB_DRM_DEVICE_FILE, O_RDWR | O_CLOEXEC);
+
+    if (gbm->v0.fd < 0) {
+        free(gbm);
+        return NULL;
+    }
+
+    /* Makes the device recognizable by eglGetPlatformDisplay */
+    gbm->dummy = gbm_create_device;
+    gbm->v0.backend_version = GBM_BACKEND_ABI_VERSION;
+    gbm->v0.name = "nvidia";
+    gbm->v0.destroy = DeviceDestroy;
+    gbm->v0.bo_import = BoImport;
+    gbm->v0.bo_get_planes = BoGetPlanes;
+    gbm->v0.bo_get_plane_fd = BoGetPlaneFd;
+    gbm->v0.bo_get_stride = BoGetStride;
+    gbm->v0.bo_get_offset = BoGetOffset;
+    gbm->v0.bo_get_modifier = BoGetModifier;
+    gbm->v0.bo_destroy = BoDestroy;
+    gbm->v0.surface_create = SurfaceCreate;
+    gbm->v0.surface_destroy = StubGbmDestroySurface;
+
+    return gbm;
+}
+
+struct gbm_bo*
+StubGbmCreateBo(struct gbm_device* gbm,
+                uint32_t width,
+                uint32_t height,
+                uint32_t format)
+{
+    StubGbmBo* bo = NewBo(gbm, width, height, format, DRM_FORMAT_MOD_LINEAR);
+
+    if (!bo) return NULL;
+
+    if ((bo->fds[0] = memfd_create("gbm-stub-bo", MFD_CLOEXEC)) < 0) {
+        free(bo);
+        numBos--;
+        return NULL;
+    }
+
+    bo->numPlanes = 1;
+    bo->strides[0] = width * 4;
+    bo->base.v0.stride = bo->strides[0];
+
+    return &bo->base;
+}
+
+int
+StubGbmGetNumBos(void)
+{
+    return numBos;
+}
+
+void
+StubGbmDestroyDevice(struct gbm_device* gbm)
+{
+    if (gbm) DeviceDestroy(gbm);
+}
+
+struct gbm_surface*
+StubGbmCreateSurface(struct gbm_device* gbm,
+                     uint32_t width,
+                     uint32_t height,
+                     uint32_t format,
+                     uint32_t flags)
+{
+    StubGbmSurface* surf = calloc(1, sizeof(*surf));
+
+    if (!surf) return NULL;
+
+    surf->base.gbm = gbm;
+    surf->base.v0.width = width;
+    surf->base.v0.height = height;
+    surf->base.v0.format = format;
+    surf->base.v0.flags = flags;
+
+    return &surf->base;
+}
+
+void
+StubGbmDestroySurface(struct gbm_surface* s)
+{
+    if (s) {
+        StubGbmSurface* surf =
+            (StubGbmSurface*)((char*)s - offsetof(StubGbmSurface, base));
+
+        free(surf);
+    }
+}
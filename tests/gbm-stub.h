@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef GBM_STUB_H
+#define GBM_STUB_H
+
+#include <gbm.h>
+#include <stdint.h>
+
+/*
+ * A GBM device laid out like those of the NVIDIA GBM backend, so that libgbm
+ * dispatches gbm_surface_* calls to this library once eglInitialize
+ * installed its callbacks. Buffer objects can only be created with
+ * StubGbmCreateBo() or imported from dma-buf file descriptors.
+ */
+struct gbm_device* StubGbmCreateDevice(void);
+void StubGbmDestroyDevice(struct gbm_device* gbm);
+
+/*
+ * Creates a single plane, pitch linear buffer object backed by a memfd, as
+ * an application would allocate with gbm_bo_create(). It is destroyed with
+ * gbm_bo_destroy().
+ */
+struct gbm_bo* StubGbmCreateBo(struct gbm_device* gbm,
+                               uint32_t width,
+                               uint32_t height,
+                               uint32_t format);
+
+/* Returns the number of buffer objects that haven't been destroyed yet */
+int StubGbmGetNumBos(void);
+
+/*
+ * Surfaces have room for the EGL platform's private pointer in front of the
+ * gbm_surface, as those of the NVIDIA GBM backend do.
+ */
+struct gbm_surface* StubGbmCreateSurface(struct gbm_device* gbm,
+                                         uint32_t width,
+                                         uint32_t height,
+                                         uint32_t format,
+                                         uint32_t flags);
+void StubGbmDestroySurface(struct gbm_surface* s);
+
+#endif /* GBM_STUB_H */
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * Tests of the handle table, on TestObjects that count how often they were
+ * freed.
+ */
+
+#include "test-utils.h"
+
+#include <pthread.h>
+
+#define NUM_OBJECTS 1024
+#define NUM_THREADS 8
+
+static void
+TestLifetime(void)
+{
+    TestObject obj;
+    int unknown;
+
+    TestInitObject(&obj);
+
+    CHECK(eGbmAddObject(&obj.base) == &obj.base);
+    CHECK(eGbmRefHandle(&obj.base) == &obj.base);
+    CHECK(obj.base.refCount == 2);
+    eGbmUnrefObject(&obj.base);
+    CHECK(obj.base.refCount == 1 && !obj.numFrees);
+
+    /* Adding an object twice would corrupt its bucket */
+    CHECK(!eGbmAddObject(&obj.base));
+
+    /* Lookups never dereference the handle */
+    CHECK(!eGbmRefHandle((GbmHandle)&unknown));
+    CHECK(!eGbmRefHandle(NULL));
+    CHECK(!eGbmDestroyHandle((GbmHandle)&unknown));
+
+    CHECK(eGbmDestroyHandle(&obj.base));
+    CHECK(obj.numFrees == 1);
+    CHECK(!eGbmRefHandle(&obj.base));
+    CHECK(!eGbmDestroyHandle(&obj.base));
+}
+
+static void
+TestDestroyWhileReferenced(void)
+{
+    TestObject obj;
+
+    TestInitObject(&obj);
+    CHECK(eGbmAddObject(&obj.base));
+    CHECK(eGbmRefHandle(&obj.base) == &obj.base);
+
+    /* The object lives on until the last reference is dropped... */
+    CHECK(eGbmDestroyHandle(&obj.base));
+    CHECK(!obj.numFrees && obj.base.destroyed);
+
+    /* ...but can only be destroyed once */
+    CHECK(!eGbmDestroyHandle(&obj.base));
+
+    eGbmUnrefObject(&obj.base);
+    CHECK(obj.numFrees == 1);
+    CHECK(!eGbmRefHandle(&obj.base));
+}
+
+/* Adjacent objects make sure buckets with several entries are covered */
+static void
+TestManyObjects(void)
+{
+    static TestObject objs[NUM_OBJECTS];
+    int i;
+
+    for (i = 0; i < NUM_OBJECTS; i++) {
+        TestInitObject(&objs[i]);
+        CHECK(eGbmAddObject(&objs[i].base));
+    }
+
+    for (i = 0; i < NUM_OBJECTS; i += 2)
+        CHECK(eGbmDestroyHandle(&objs[i].base));
+
+    for (i = 0; i < NUM_OBJECTS; i++) {
+        GbmObject* obj = eGbmRefHandle(&objs[i].base);
+
+        if (i % 2) {
+            CHECK(obj == &objs[i].base);
+            eGbmUnrefObject(obj);
+        } else {
+            CHECK(!obj && objs[i].numFrees == 1);
+        }
+    }
+
+    for (i = NUM_OBJECTS - 1; i > 0; i -= 2)
+        CHECK(eGbmDestroyHandle(&objs[i].base));
+
+    for (i = 0; i < NUM_OBJECTS; i++) {
+        CHECK(!eGbmRefHandle(&objs[i].base));
+        CHECK(objs[i].numFrees == 1);
+    }
+}
+
+static void*
+RefThreadMain(void* arg)
+{
+    TestObject* objs = arg;
+    int i, j;
+
+    for (i = 0; i < 10000; i++) {
+        for (j = 0; j < 4; j++) {
+            GbmObject* obj = eGbmRefHandle(&objs[j].base);
+
+            CHECK(obj == &objs[j].base);
+            eGbmUnrefObject(obj);
+        }
+    }
+
+    return NULL;
+}
+
+/* The last reference may be dropped by any thread, but only once */
+static void
+TestConcurrentRefs(void)
+{
+    static TestObject objs[4];
+    pthread_t threads[NUM_THREADS];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        TestInitObject(&objs[i]);
+        CHECK(eGbmAddObject(&objs[i].base));
+    }
+
+    for (i = 0; i < NUM_THREADS; i++)
+        CHECK(!pthread_create(&threads[i], NULL, RefThreadMain, objs));
+
+    for (i = 0; i < NUM_THREADS; i++) pthread_join(threads[i], NULL);
+
+    for (i = 0; i < 4; i++) {
+        CHECK(objs[i].base.refCount == 1 && !objs[i].numFrees);
+        CHECK(eGbmDestroyHandle(&objs[i].base));
+        CHECK(objs[i].numFrees == 1);
+    }
+}
+
+int
+main(void)
+{
+    TestLifetime();
+    TestDestroyWhileReferenced();
+    TestManyObjects();
+    TestConcurrentRefs();
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * The hooks the tests call, as libEGL would after looking them up with
+ * getHookAddress. Multiple inclusion is intended.
+ */
+DO_HOOK(PFNEGLCHOOSECONFIGPROC, ChooseConfig)
+DO_HOOK(PFNEGLCREATEIMAGEKHRPROC, CreateImageKHR)
+DO_HOOK(PFNEGLCREATEPLATFORMWINDOWSURFACEPROC, CreatePlatformWindowSurface)
+DO_HOOK(PFNEGLDESTROYIMAGEKHRPROC, DestroyImageKHR)
+DO_HOOK(PFNEGLDESTROYSURFACEPROC, DestroySurface)
+DO_HOOK(PFNEGLGETCONFIGATTRIBPROC, GetConfigAttrib)
+DO_HOOK(PFNEGLINITIALIZEPROC, Initialize)
+DO_HOOK(PFNEGLQUERYSURFACEPROC, QuerySurface)
+DO_HOOK(PFNEGLSWAPBUFFERSPROC, SwapBuffers)
+DO_HOOK(PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC, SwapBuffersWithDamageKHR)
+DO_HOOK(PFNEGLTERMINATEPROC, Terminate)
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * Tests of the cache of EGLImages imported from gbm_bos with
+ * EGL_NATIVE_PIXMAP_KHR, counting the driver's dma-buf imports.
+ */
+
+#include "test-utils.h"
+#include "gbm-display.h"
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <drm_fourcc.h>
+
+#define NUM_BOS (MAX_IMAGE_CACHE_ENTRIES + 1)
+
+static int userDataDestroyed;
+
+static struct gbm_bo*
+CreateBo(TestDisplay* t)
+{
+    struct gbm_bo* bo = StubGbmCreateBo(t->gbm, 64, 64, DRM_FORMAT_XRGB8888);
+
+    CHECK(bo);
+
+    return bo;
+}
+
+static EGLImageKHR
+CreateImage(TestDisplay* t, struct gbm_bo* bo)
+{
+    return t->egl.CreateImageKHR(t->dpy, EGL_NO_CONTEXT, EGL_NATIVE_PIXMAP_KHR,
+                                 (EGLClientBuffer)bo, NULL);
+}
+
+/* Imports a bo for <numPlanes> planes of <fds> with a stride of 256 bytes */
+static struct gbm_bo*
+ImportBo(TestDisplay* t, const int* fds, int numPlanes, uint32_t offset)
+{
+    struct gbm_import_fd_modifier_data data = {
+        .width = 64,
+        .height = 64,
+        .format = DRM_FORMAT_XRGB8888,
+        .num_fds = numPlanes,
+        .modifier = DRM_FORMAT_MOD_LINEAR,
+    };
+    struct gbm_bo* bo;
+    int i;
+
+    for (i = 0; i < numPlanes; i++) {
+        data.fds[i] = fds[i];
+        data.strides[i] = 256;
+        data.offsets[i] = offset;
+    }
+
+    bo = gbm_bo_import(t->gbm, GBM_BO_IMPORT_FD_MODIFIER, &data, 0);
+    CHECK(bo);
+
+    return bo;
+}
+
+static void
+DestroyUserData(struct gbm_bo* bo, void* data)
+{
+    (void)bo;
+    (void)data;
+
+    userDataDestroyed++;
+}
+
+static void
+TestCacheHit(TestDisplay* t)
+{
+    const StubEglCounts* counts = StubEglGetCounts();
+    unsigned int numImports = counts->importsCreated;
+    struct gbm_bo* bo = CreateBo(t);
+    EGLImageKHR image, other;
+
+    CHECK((image = CreateImage(t, bo)) != EGL_NO_IMAGE_KHR);
+    CHECK(CreateImage(t, bo) == image);
+    CHECK(counts->importsCreated == numImports + 1);
+
+    /* Each creation takes a reference the application has to drop */
+    CHECK(t->egl.DestroyImageKHR(t->dpy, image));
+    CHECK(t->egl.DestroyImageKHR(t->dpy, image));
+    CHECK(!t->egl.DestroyImageKHR(t->dpy, image));
+    CHECK(StubEglTakeError() == EGL_BAD_PARAMETER);
+
+    /* An idle image is found again without importing the bo... */
+    CHECK(CreateImage(t, bo) == image);
+    CHECK(t->egl.DestroyImageKHR(t->dpy, image));
+    CHECK(counts->importsCreated == numImports + 1);
+    CHECK(counts->imports == 1);
+
+    /*
+     * ...and outlives the bo, but isn't handed out for a new bo, even if it
+     * gets the destroyed one's address
+     */
+    gbm_bo_destroy(bo);
+    CHECK(counts->imports == 1);
+    bo = CreateBo(t);
+    CHECK((other = CreateImage(t, bo)) != EGL_NO_IMAGE_KHR);
+    CHECK(other != image);
+    CHECK(counts->importsCreated == numImports + 2);
+    CHECK(t->egl.DestroyImageKHR(t->dpy, other));
+    gbm_bo_destroy(bo);
+}
+
+static void
+TestDestroyBoWhileReferenced(TestDisplay* t)
+{
+    const StubEglCounts* counts = StubEglGetCounts();
+    struct gbm_bo* bo = CreateBo(t);
+    EGLImageKHR image;
+
+    CHECK((image = CreateImage(t, bo)) != EGL_NO_IMAGE_KHR);
+
+    /* The image stays valid */
+    gbm_bo_destroy(bo);
+    CHECK(counts->imports == 1);
+    CHECK(t->egl.DestroyImageKHR(t->dpy, image));
+    CHECK(counts->imports == 1);
+}
+
+/* The bo's user data belongs to the application, and is never touched */
+static void
+TestAppUserData(TestDisplay* t)
+{
+    const StubEglCounts* counts = StubEglGetCounts();
+    unsigned int numImports = counts->importsCreated;
+    struct gbm_bo* bo = CreateBo(t);
+    int data;
+    EGLImageKHR image;
+
+    CHECK((image = CreateImage(t, bo)) != EGL_NO_IMAGE_KHR);
+    CHECK(gbm_bo_get_user_data(bo) == NULL);
+
+    gbm_bo_set_user_data(bo, &data, DestroyUserData);
+    CHECK(CreateImage(t, bo) == image);
+    CHECK(gbm_bo_get_user_data(bo) == &data);
+    CHECK(counts->importsCreated == numImports + 1);
+    CHECK(t->egl.DestroyImageKHR(t->dpy, image));
+    CHECK(t->egl.DestroyImageKHR(t->dpy, image));
+
+    gbm_bo_destroy(bo);
+    CHECK(userDataDestroyed == 1);
+}
+
+/* bos are identified by the dma-buf and layout of every plane */
+static void
+TestBufferIdentity(TestDisplay* t)
+{
+    const StubEglCounts* counts = StubEglGetCounts();
+    unsigned int numImports = counts->importsCreated;
+    int fds[3];
+    struct gbm_bo* bos[4];
+    EGLImageKHR images[4];
+    int i;
+
+    for (i = 0; i < 3; i++)
+        CHECK((fds[i] = memfd_create("test-images", MFD_CLOEXEC)) >= 0);
+
+    /* Another bo for the same dma-bufs shares the image... */
+    bos[0] = ImportBo(t, (int[]){ fds[0], fds[1] }, 2, 0);
+    bos[1] = ImportBo(t, (int[]){ fds[0], fds[1] }, 2, 0);
+    CHECK((images[0] = CreateImage(t, bos[0])) != EGL_NO_IMAGE_KHR);
+    CHECK(CreateImage(t, bos[1]) == images[0]);
+    CHECK(counts->importsCreated == numImports + 1);
+
+    /* ...but not one whose second plane is elsewhere, or at other offsets */
+    bos[2] = ImportBo(t, (int[]){ fds[0], fds[2] }, 2, 0);
+    bos[3] = ImportBo(t, (int[]){ fds[0], fds[1] }, 2, 4096);
+    CHECK((images[2] = CreateImage(t, bos[2])) != EGL_NO_IMAGE_KHR);
+    CHECK((images[3] = CreateImage(t, bos[3])) != EGL_NO_IMAGE_KHR);
+    CHECK(images[2] != images[0] && images[3] != images[0] &&
+          images[2] != images[3]);
+    CHECK(counts->importsCreated == numImports + 3);
+
+    CHECK(t->egl.DestroyImageKHR(t->dpy, images[0]));
+    CHECK(t->egl.DestroyImageKHR(t->dpy, images[0]));
+    CHECK(t->egl.DestroyImageKHR(t->dpy, images[2]));
+    CHECK(t->egl.DestroyImageKHR(t->dpy, images[3]));
+
+    for (i = 0; i < 4; i++) gbm_bo_destroy(bos[i]);
+    for (i = 0; i < 3; i++) close(fds[i]);
+}
+
+static void
+TestEviction(TestDisplay* t)
+{
+    const StubEglCounts* counts = StubEglGetCounts();
+    struct gbm_bo* bos[NUM_BOS];
+    EGLImageKHR images[NUM_BOS];
+    unsigned int numImports = counts->importsCreated;
+    int i;
+
+    for (i = 0; i < NUM_BOS; i++) bos[i] = CreateBo(t);
+
+    /* Only a few images the application no longer uses are kept */
+    for (i = 0; i < MAX_IDLE_IMAGE_CACHE_ENTRIES + 2; i++) {
+        CHECK((images[i] = CreateImage(t, bos[i])) != EGL_NO_IMAGE_KHR);
+        CHECK(t->egl.DestroyImageKHR(t->dpy, images[i]));
+    }
+
+    CHECK(counts->imports == MAX_IDLE_IMAGE_CACHE_ENTRIES);
+
+    /* The least recently used ones go first */
+    CHECK(CreateImage(t, bos[MAX_IDLE_IMAGE_CACHE_ENTRIES + 1]) ==
+          images[MAX_IDLE_IMAGE_CACHE_ENTRIES + 1]);
+    CHECK(counts->importsCreated ==
+          numImports + MAX_IDLE_IMAGE_CACHE_ENTRIES + 2);
+    CHECK(CreateImage(t, bos[0]) != EGL_NO_IMAGE_KHR);
+    CHECK(counts->importsCreated ==
+          numImports + MAX_IDLE_IMAGE_CACHE_ENTRIES + 3);
+    CHECK(t->egl.DestroyImageKHR(t->dpy,
+                                 images[MAX_IDLE_IMAGE_CACHE_ENTRIES + 1]));
+
+    /*
+     * Images the application still uses are never evicted. Once they fill
+     * the cache, more images are passed through to the driver.
+     */
+    for (i = 0; i < NUM_BOS; i++)
+        CHECK((images[i] = CreateImage(t, bos[i])) != EGL_NO_IMAGE_KHR);
+
+    CHECK(counts->imports == NUM_BOS);
+
+    CHECK(t->egl.DestroyImageKHR(t->dpy, images[NUM_BOS - 1]));
+    CHECK(counts->imports == NUM_BOS - 1);
+
+    /* bos[0] was referenced twice */
+    CHECK(t->egl.DestroyImageKHR(t->dpy, images[0]));
+
+    for (i = 0; i < NUM_BOS - 1; i++)
+        CHECK(t->egl.DestroyImageKHR(t->dpy, images[i]));
+
+    CHECK(counts->imports == MAX_IDLE_IMAGE_CACHE_ENTRIES);
+
+    for (i = 0; i < NUM_BOS; i++) gbm_bo_destroy(bos[i]);
+}
+
+static void
+TestInvalidParameters(TestDisplay* t)
+{
+    static const EGLint attribs[] = {
+        EGL_IMAGE_PRESERVED_KHR, EGL_TRUE,
+        EGL_WIDTH, 64,
+        EGL_NONE
+    };
+    struct gbm_bo* bo = CreateBo(t);
+    int ctx;
+
+    CHECK(t->egl.CreateImageKHR(t->dpy, (EGLContext)&ctx,
+                                EGL_NATIVE_PIXMAP_KHR, (EGLClientBuffer)bo,
+                                NULL) == EGL_NO_IMAGE_KHR);
+    CHECK(StubEglTakeError() == EGL_BAD_PARAMETER);
+
+    CHECK(t->egl.CreateImageKHR(t->dpy, EGL_NO_CONTEXT, EGL_NATIVE_PIXMAP_KHR,
+                                (EGLClientBuffer)bo,
+                                attribs) == EGL_NO_IMAGE_KHR);
+    CHECK(StubEglTakeError() == EGL_BAD_PARAMETER);
+
+    CHECK(CreateImage(t, NULL) == EGL_NO_IMAGE_KHR);
+    CHECK(StubEglTakeError() == EGL_BAD_PARAMETER);
+
+    CHECK(gbm_bo_get_user_data(bo) == NULL);
+    gbm_bo_destroy(bo);
+}
+
+/* Terminating the display destroys cached images, including referenced ones */
+static void
+TestTerminate(void)
+{
+    TestDisplay t;
+    struct gbm_bo* bos[2];
+
+    TestOpenDisplay(&t);
+
+    bos[0] = CreateBo(&t);
+    bos[1] = CreateBo(&t);
+    CHECK(CreateImage(&t, bos[0]) != EGL_NO_IMAGE_KHR);
+    CHECK(t.egl.DestroyImageKHR(t.dpy, CreateImage(&t, bos[1])));
+    CHECK(StubEglGetCounts()->imports == 2);
+
+    CHECK(t.egl.Terminate(t.dpy));
+    CHECK(StubEglGetCounts()->imports == 0);
+
+    gbm_bo_destroy(bos[0]);
+    gbm_bo_destroy(bos[1]);
+
+    TestCloseDisplay(&t);
+}
+
+int
+main(void)
+{
+    TestRunWithDisplay(TestCacheHit);
+    TestRunWithDisplay(TestDestroyBoWhileReferenced);
+    TestRunWithDisplay(TestAppUserData);
+    TestRunWithDisplay(TestBufferIdentity);
+    TestRunWithDisplay(TestEviction);
+    TestRunWithDisplay(TestInvalidParameters);
+    TestTerminate();
+
+    return 0;
+}
@@ -0,0 +1,717 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * Tests of window and offscreen surfaces, mostly as scripted frame sequences
+ * replayed against the stub driver. The stub numbers the frames of each
+ * stream from 1, so the contents of a locked buffer tell which frame it
+ * holds. Each
+ * frame is also swapped with a damage rectangle whose x coordinate is the
+ * frame's number, which tells what a locked buffer's damage was made of.
+ */
+
+#include "test-utils.h"
+#include "gbm-surface.h"
+#include "gbm-utils.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <gbmint.h>
+
+#define WIDTH 256
+#define HEIGHT 256
+#define MAX_FRAMES 64
+
+typedef enum {
+    /* Swap frame <arg> */
+    STEP_SWAP,
+    /* Swap frame <arg>, which must fail because the FIFO is full */
+    STEP_SWAP_FAILS,
+    STEP_HAS_FREE,
+    STEP_NO_FREE,
+    /*
+     * Lock frame <arg>, whose damage must consist of <count> rectangles, or
+     * be the whole buffer if <count> is -1
+     */
+    STEP_LOCK,
+    STEP_LOCK_FAILS,
+    /* Release the buffer frame <arg> was locked in */
+    STEP_RELEASE,
+    /* Replace <arg> of the stream's buffers, <count> of which can be */
+    STEP_CHURN,
+    /* The stream must have <arg> buffers */
+    STEP_CHECK_BUFFERS,
+    /* The application and this library must hold <arg> buffer objects */
+    STEP_CHECK_BOS,
+    STEP_END,
+} StepOp;
+
+typedef struct StepRec {
+    StepOp op;
+    int arg;
+    int count;
+} Step;
+
+typedef struct ReplayRec {
+    TestDisplay* t;
+    TestWindow* w;
+    struct gbm_bo* locked[MAX_FRAMES];
+} Replay;
+
+static void
+SwapFrame(TestDisplay* t, TestWindow* w, int frame, bool success)
+{
+    /* In EGL's bottom-left origin convention */
+    const EGLint rect[4] = { frame, 0, 1, 1 };
+
+    CHECK(!t->egl.SwapBuffersWithDamageKHR(t->dpy, w->surf, rect, 1) ==
+          !success);
+}
+
+/*
+ * Returns the frame whose damage came last in <bo>'s damage, or -1 if the
+ * whole buffer is damaged
+ */
+static int
+DamagedFrame(TestWindow* w, struct gbm_bo* bo, int* numRects)
+{
+    int32_t rects[MAX_FRAMES * 4];
+
+    *numRects = eGbmSurfaceGetBufferDamage(w->gbmSurf, bo, rects, MAX_FRAMES);
+
+    if (*numRects <= 0) return -1;
+
+    /* Damage carried over from dropped frames comes first */
+    CHECK(rects[*numRects * 4 - 4 + 1] == HEIGHT - 1);
+
+    return rects[*numRects * 4 - 4];
+}
+
+static void
+RunStep(Replay* r, const Step* step)
+{
+    const StubEglCounts* counts = StubEglGetCounts();
+    struct gbm_bo* bo;
+    int numRects;
+
+    switch (step->op) {
+    case STEP_SWAP:
+        SwapFrame(r->t, r->w, step->arg, true);
+        break;
+    case STEP_SWAP_FAILS:
+        SwapFrame(r->t, r->w, step->arg, false);
+        CHECK(StubEglTakeError() == EGL_BAD_ACCESS);
+        break;
+    case STEP_HAS_FREE:
+        CHECK(gbm_surface_has_free_buffers(r->w->gbmSurf));
+        break;
+    case STEP_NO_FREE:
+        CHECK(!gbm_surface_has_free_buffers(r->w->gbmSurf));
+        break;
+    case STEP_LOCK:
+        CHECK((bo = gbm_surface_lock_front_buffer(r->w->gbmSurf)));
+        CHECK(TestGetFrame(bo) == (uint32_t)step->arg);
+
+        if (step->count < 0) {
+            CHECK(DamagedFrame(r->w, bo, &numRects) < 0 && numRects < 0);
+        } else {
+            CHECK(DamagedFrame(r->w, bo, &numRects) == step->arg);
+            CHECK(numRects == step->count);
+        }
+
+        CHECK(!r->locked[step->arg]);
+        r->locked[step->arg] = bo;
+        break;
+    case STEP_LOCK_FAILS:
+        CHECK(!gbm_surface_lock_front_buffer(r->w->gbmSurf));
+        break;
+    case STEP_RELEASE:
+        CHECK((bo = r->locked[step->arg]));
+        gbm_surface_release_buffer(r->w->gbmSurf, bo);
+        r->locked[step->arg] = NULL;
+        break;
+    case STEP_CHURN:
+        CHECK(StubEglChurnImages(TestDriverSurface(r->t, r->w), step->arg) ==
+              step->count);
+        break;
+    case STEP_CHECK_BUFFERS:
+        CHECK(counts->streamImages == step->arg);
+        break;
+    case STEP_CHECK_BOS:
+        CHECK(StubGbmGetNumBos() == step->arg);
+        break;
+    case STEP_END:
+        break;
+    }
+}
+
+static void
+ReplaySteps(TestDisplay* t, bool mailbox, const Step* steps)
+{
+    Replay r;
+    TestWindow w;
+    int i;
+
+    memset(&r, 0, sizeof(r));
+    r.t = t;
+    r.w = &w;
+
+    setenv("EGL_GBM_MAILBOX", mailbox ? "1" : "0", 1);
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, NULL));
+    unsetenv("EGL_GBM_MAILBOX");
+
+    for (; steps->op != STEP_END; steps++) RunStep(&r, steps);
+
+    for (i = 0; i < MAX_FRAMES; i++) CHECK(!r.locked[i]);
+
+    TestDestroyWindow(t, &w);
+}
+
+static void
+TestFifo(TestDisplay* t)
+{
+    static const Step steps[] = {
+        /* Frames are locked in the order they were swapped */
+        { STEP_HAS_FREE },
+        { STEP_SWAP, 1 },
+        { STEP_SWAP, 2 },
+        { STEP_NO_FREE },
+        { STEP_LOCK, 1, 1 },
+        { STEP_NO_FREE },
+        { STEP_RELEASE, 1 },
+        { STEP_HAS_FREE },
+        { STEP_LOCK, 2, 1 },
+        { STEP_LOCK_FAILS },
+        { STEP_RELEASE, 2 },
+
+        /* Nothing is dropped, so the producer blocks once the FIFO is full */
+        { STEP_SWAP, 3 },
+        { STEP_SWAP, 4 },
+        { STEP_SWAP_FAILS, 5 },
+        { STEP_LOCK, 3, 1 },
+        { STEP_SWAP, 5 },
+        { STEP_RELEASE, 3 },
+        { STEP_LOCK, 4, 1 },
+        { STEP_RELEASE, 4 },
+        { STEP_LOCK, 5, 1 },
+        { STEP_RELEASE, 5 },
+
+        /* Each of the stream's buffers was imported once */
+        { STEP_CHECK_BUFFERS, 3 },
+        { STEP_CHECK_BOS, 3 },
+        { STEP_END },
+    };
+
+    ReplaySteps(t, false, steps);
+}
+
+static void
+TestMailbox(TestDisplay* t)
+{
+    static const Step steps[] = {
+        /* Only the newest frame can be locked, with the damage of all */
+        { STEP_SWAP, 1 },
+        { STEP_SWAP, 2 },
+        { STEP_SWAP, 3 },
+        { STEP_SWAP, 4 },
+        { STEP_HAS_FREE },
+        { STEP_LOCK, 4, 4 },
+        { STEP_LOCK_FAILS },
+
+        /* Swapping never blocks while a buffer is locked */
+        { STEP_SWAP, 5 },
+        { STEP_SWAP, 6 },
+        { STEP_SWAP, 7 },
+        { STEP_LOCK, 7, 3 },
+        { STEP_NO_FREE },
+        { STEP_RELEASE, 4 },
+        { STEP_HAS_FREE },
+        { STEP_SWAP, 8 },
+        { STEP_RELEASE, 7 },
+        { STEP_LOCK, 8, 1 },
+        { STEP_RELEASE, 8 },
+        { STEP_CHECK_BUFFERS, 3 },
+        { STEP_END },
+    };
+
+    ReplaySteps(t, true, steps);
+}
+
+static void
+TestChurn(TestDisplay* t)
+{
+    static const Step steps[] = {
+        { STEP_SWAP, 1 },
+        { STEP_LOCK, 1, 1 },
+        { STEP_CHECK_BOS, 1 },
+
+        /*
+         * The locked buffer is removed along with the others, but stays
+         * valid until it is released. The next swap makes the surface
+         * notice.
+         */
+        { STEP_CHURN, 3, 3 },
+        { STEP_CHECK_BUFFERS, 6 },
+        { STEP_SWAP, 2 },
+        { STEP_LOCK, 2, 1 },
+        { STEP_CHECK_BUFFERS, 3 },
+        { STEP_CHECK_BOS, 2 },
+        { STEP_RELEASE, 1 },
+        { STEP_HAS_FREE },
+        { STEP_RELEASE, 2 },
+
+        /*
+         * Frames in the FIFO survive, and can still be locked. Buffer
+         * objects of removed buffers are kept in case they come back.
+         */
+        { STEP_SWAP, 3 },
+        { STEP_CHURN, 3, 2 },
+        { STEP_LOCK, 3, 1 },
+        { STEP_CHECK_BOS, 3 },
+        { STEP_SWAP, 4 },
+        { STEP_RELEASE, 3 },
+        { STEP_LOCK, 4, 1 },
+        { STEP_RELEASE, 4 },
+        { STEP_CHECK_BUFFERS, 3 },
+        { STEP_CHECK_BOS, 4 },
+        { STEP_END },
+    };
+
+    ReplaySteps(t, false, steps);
+}
+
+/*
+ * A frame that is dropped after its buffer was removed from the stream
+ * passes on that it may have damaged anything.
+ */
+static void
+TestChurnMailbox(TestDisplay* t)
+{
+    static const Step steps[] = {
+        { STEP_SWAP, 1 },
+        { STEP_HAS_FREE },
+        { STEP_CHURN, 3, 3 },
+        { STEP_SWAP, 2 },
+        { STEP_LOCK, 2, -1 },
+        { STEP_RELEASE, 2 },
+        { STEP_SWAP, 3 },
+        { STEP_LOCK, 3, 1 },
+        { STEP_RELEASE, 3 },
+        { STEP_END },
+    };
+
+    ReplaySteps(t, true, steps);
+}
+
+/* Frames swapped without damage damage the whole buffer */
+static void
+TestFullDamage(TestDisplay* t)
+{
+    TestWindow w;
+    struct gbm_bo* bo;
+    int32_t rects[4];
+
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, NULL));
+    CHECK(t->egl.SwapBuffers(t->dpy, w.surf));
+    CHECK((bo = gbm_surface_lock_front_buffer(w.gbmSurf)));
+    CHECK(eGbmSurfaceGetBufferDamage(w.gbmSurf, bo, rects, 1) == -1);
+    gbm_surface_release_buffer(w.gbmSurf, bo);
+
+    /* Buffers that aren't locked have no damage to report */
+    CHECK(eGbmSurfaceGetBufferDamage(w.gbmSurf, bo, rects, 1) == -1);
+
+    TestDestroyWindow(t, &w);
+}
+
+/*
+ * Runs many frames with the buffers replaced every so often, and checks that
+ * nothing accumulates.
+ */
+static void
+TestLongRun(TestDisplay* t, bool mailbox)
+{
+    const StubEglCounts* counts = StubEglGetCounts();
+    struct gbm_bo* prev = NULL;
+    int numFds = TestCountFds();
+    TestWindow w;
+    int i;
+
+    setenv("EGL_GBM_MAILBOX", mailbox ? "1" : "0", 1);
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, NULL));
+    unsetenv("EGL_GBM_MAILBOX");
+
+    for (i = 0; i < 1000; i++) {
+        struct gbm_bo* bo;
+        int numRects;
+
+        CHECK(gbm_surface_has_free_buffers(w.gbmSurf));
+        SwapFrame(t, &w, i % MAX_FRAMES, true);
+
+        if (i % 100 == 50)
+            CHECK(StubEglChurnImages(TestDriverSurface(t, &w), 2) == 2);
+
+        /* Keep the previous frame locked, as a compositor scanning it out */
+        CHECK((bo = gbm_surface_lock_front_buffer(w.gbmSurf)));
+        CHECK(TestGetFrame(bo) == (uint32_t)i + 1);
+        CHECK(DamagedFrame(&w, bo, &numRects) == i % MAX_FRAMES ||
+              numRects < 0);
+        if (prev) gbm_surface_release_buffer(w.gbmSurf, prev);
+        prev = bo;
+
+        /* Each buffer and buffer object has one file descriptor */
+        CHECK(counts->streamImages == 3);
+        CHECK(StubGbmGetNumBos() <= 5);
+        CHECK(TestCountFds() ==
+              numFds + counts->streamImages + StubGbmGetNumBos());
+    }
+
+    gbm_surface_release_buffer(w.gbmSurf, prev);
+    TestDestroyWindow(t, &w);
+}
+
+static void
+TestLongRunFifo(TestDisplay* t)
+{
+    TestLongRun(t, false);
+}
+
+static void
+TestLongRunMailbox(TestDisplay* t)
+{
+    TestLongRun(t, true);
+}
+
+static void
+TestFenceFd(TestDisplay* t)
+{
+    static const EGLAttrib attribs[] = {
+        EGL_SYNC_NATIVE_FENCE_ANDROID, EGL_TRUE,
+        EGL_NONE
+    };
+    const StubEglCounts* counts = StubEglGetCounts();
+    unsigned int numWaits = counts->waits;
+    TestWindow w;
+    struct gbm_bo* bo;
+    EGLint fd;
+    int fenceFd = -1;
+
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, attribs));
+
+    /*
+     * A frame that is still rendering comes with its fence, which the
+     * application waits for instead of this library
+     */
+    StubEglSetSyncLatency(100000000);
+    CHECK(t->egl.SwapBuffers(t->dpy, w.surf));
+    CHECK((bo = gbm_surface_lock_front_buffer(w.gbmSurf)));
+    CHECK(counts->waits == numWaits);
+    CHECK(eGbmSurfaceGetBufferFence(w.gbmSurf, bo, &fenceFd) == 0);
+    CHECK(fenceFd >= 0);
+    close(fenceFd);
+    CHECK(t->egl.QuerySurface(t->dpy, w.surf,
+                              EGL_SYNC_NATIVE_FENCE_FD_ANDROID, &fd));
+    CHECK(fd >= 0);
+    close(fd);
+    gbm_surface_release_buffer(w.gbmSurf, bo);
+    CHECK(eGbmSurfaceGetBufferFence(w.gbmSurf, bo, &fenceFd) == -EINVAL);
+
+    /* One that completed doesn't need any */
+    StubEglSetSyncLatency(0);
+    CHECK(t->egl.SwapBuffers(t->dpy, w.surf));
+    CHECK((bo = gbm_surface_lock_front_buffer(w.gbmSurf)));
+    CHECK(eGbmSurfaceGetBufferFence(w.gbmSurf, bo, &fenceFd) == 0);
+    CHECK(fenceFd == EGL_NO_NATIVE_FENCE_FD_ANDROID);
+    CHECK(t->egl.QuerySurface(t->dpy, w.surf,
+                              EGL_SYNC_NATIVE_FENCE_FD_ANDROID, &fd));
+    CHECK(fd == EGL_NO_NATIVE_FENCE_FD_ANDROID);
+    gbm_surface_release_buffer(w.gbmSurf, bo);
+
+    TestDestroyWindow(t, &w);
+}
+
+static void
+TestFenceFdFallback(TestDisplay* t)
+{
+    static const EGLAttrib attribs[] = {
+        EGL_SYNC_NATIVE_FENCE_ANDROID, EGL_TRUE,
+        EGL_NONE
+    };
+    const StubEglCounts* counts = StubEglGetCounts();
+    unsigned int numWaits = counts->waits;
+    TestWindow w;
+    struct gbm_bo* bo;
+    EGLint fd;
+    int fenceFd;
+
+    StubEglSetNativeFenceSyncs(0);
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, attribs));
+    StubEglSetNativeFenceSyncs(-1);
+    StubEglTakeError();
+
+    /* The surface works, but waits for rendering on the CPU instead */
+    CHECK(!t->egl.QuerySurface(t->dpy, w.surf,
+                               EGL_SYNC_NATIVE_FENCE_FD_ANDROID, &fd));
+    CHECK(StubEglTakeError() == EGL_BAD_ATTRIBUTE);
+
+    CHECK(t->egl.SwapBuffers(t->dpy, w.surf));
+    CHECK((bo = gbm_surface_lock_front_buffer(w.gbmSurf)));
+    CHECK(counts->waits == numWaits + 1);
+    CHECK(eGbmSurfaceGetBufferFence(w.gbmSurf, bo, &fenceFd) == 0);
+    CHECK(fenceFd == EGL_NO_NATIVE_FENCE_FD_ANDROID);
+    gbm_surface_release_buffer(w.gbmSurf, bo);
+
+    /* Otherwise the pool would hand this surface out again below */
+    setenv("EGL_GBM_SURFACE_POOL", "0", 1);
+    TestDestroyWindow(t, &w);
+
+    /* The whole sync ring falls back, even if only a later sync failed */
+    StubEglSetNativeFenceSyncs(1);
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, attribs));
+    StubEglSetNativeFenceSyncs(-1);
+    StubEglTakeError();
+    CHECK(counts->syncs == 2);
+    CHECK(!t->egl.QuerySurface(t->dpy, w.surf,
+                               EGL_SYNC_NATIVE_FENCE_FD_ANDROID, &fd));
+    CHECK(StubEglTakeError() == EGL_BAD_ATTRIBUTE);
+    TestDestroyWindow(t, &w);
+    unsetenv("EGL_GBM_SURFACE_POOL");
+}
+
+/* Locking a frame waits until it has been rendered */
+static void
+TestSyncLatency(TestDisplay* t)
+{
+    const StubEglCounts* counts = StubEglGetCounts();
+    const uint64_t latency = 20000000;
+    unsigned int numWaits = counts->waits;
+    TestWindow w;
+    struct gbm_bo* bo;
+    uint64_t start;
+
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, NULL));
+
+    StubEglSetSyncLatency(latency);
+    CHECK(t->egl.SwapBuffers(t->dpy, w.surf));
+
+    /* Acquiring the frame doesn't wait for it... */
+    start = eGbmGetTimeNs();
+    CHECK(gbm_surface_has_free_buffers(w.gbmSurf));
+    CHECK(counts->waits == numWaits);
+
+    /* ...locking it does */
+    CHECK((bo = gbm_surface_lock_front_buffer(w.gbmSurf)));
+    CHECK(eGbmGetTimeNs() - start >= latency / 2);
+    CHECK(counts->waits == numWaits + 1);
+    StubEglSetSyncLatency(0);
+
+    gbm_surface_release_buffer(w.gbmSurf, bo);
+    TestDestroyWindow(t, &w);
+}
+
+static void
+TestPool(TestDisplay* t)
+{
+    static const EGLAttrib fifo3[] = {
+        EGL_STREAM_FIFO_LENGTH_KHR, 3,
+        EGL_NONE
+    };
+    const StubEglCounts* counts = StubEglGetCounts();
+    TestWindow w;
+    struct gbm_bo* bo;
+
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, NULL));
+    SwapFrame(t, &w, 1, true);
+    SwapFrame(t, &w, 2, true);
+    TestDestroyWindow(t, &w);
+
+    /* A surface with the same parameters reuses the stream... */
+    CHECK(counts->streams == 1);
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, NULL));
+    CHECK(counts->streams == 1);
+
+    /* ...without any of the old surface's frames */
+    CHECK(!gbm_surface_lock_front_buffer(w.gbmSurf));
+    SwapFrame(t, &w, 3, true);
+    CHECK((bo = gbm_surface_lock_front_buffer(w.gbmSurf)));
+    CHECK(TestGetFrame(bo) == 3);
+    gbm_surface_release_buffer(w.gbmSurf, bo);
+    TestDestroyWindow(t, &w);
+
+    /* Different parameters need a new one */
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, fifo3));
+    CHECK(counts->streams == 2);
+    TestDestroyWindow(t, &w);
+
+    /* A surface that is still current can't be handed out again */
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, NULL));
+    CHECK(counts->streams == 2);
+    StubEglSetCurrentSurface(TestDriverSurface(t, &w));
+    TestDestroyWindow(t, &w);
+    StubEglSetCurrentSurface(EGL_NO_SURFACE);
+    CHECK(counts->streams == 1);
+
+    setenv("EGL_GBM_SURFACE_POOL", "0", 1);
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, fifo3));
+    CHECK(counts->streams == 1);
+    TestDestroyWindow(t, &w);
+    unsetenv("EGL_GBM_SURFACE_POOL");
+    CHECK(counts->streams == 0);
+}
+
+/* Without EGL_GBM_MAILBOX, every swapped frame is handed out in order */
+static void
+TestDefaultMode(TestDisplay* t)
+{
+    TestWindow w;
+    struct gbm_bo* bo;
+    int frame;
+
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, NULL));
+    SwapFrame(t, &w, 1, true);
+    SwapFrame(t, &w, 2, true);
+
+    for (frame = 1; frame <= 2; frame++) {
+        CHECK((bo = gbm_surface_lock_front_buffer(w.gbmSurf)));
+        CHECK(TestGetFrame(bo) == (uint32_t)frame);
+        gbm_surface_release_buffer(w.gbmSurf, bo);
+    }
+
+    TestDestroyWindow(t, &w);
+}
+
+/*
+ * The age of window surface buffers is left to the driver, which can't report
+ * it for the stub's producer surfaces
+ */
+static void
+TestBufferAge(TestDisplay* t)
+{
+    TestWindow w;
+    EGLint age = -1;
+
+    CHECK(TestCreateWindow(t, &w, WIDTH, HEIGHT, NULL));
+    SwapFrame(t, &w, 1, true);
+
+    CHECK(!t->egl.QuerySurface(t->dpy, w.surf, EGL_BUFFER_AGE_EXT, &age));
+    CHECK(StubEglTakeError() == EGL_BAD_ATTRIBUTE);
+    CHECK(age == -1);
+
+    TestDestroyWindow(t, &w);
+}
+
+/*
+ * Configs only match the format their buffers are exported in, not the one
+ * with red and blue swapped
+ */
+static void
+TestNativeVisual(TestDisplay* t)
+{
+    const EGLint attribs[] = {
+        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+        EGL_NATIVE_VISUAL_ID, GBM_FORMAT_XBGR8888,
+        EGL_NONE
+    };
+    EGLConfig config = TestChooseWindowConfig(t, GBM_FORMAT_XRGB8888);
+    EGLint numConfigs = -1;
+    EGLint visual = 0;
+
+    CHECK(t->egl.GetConfigAttrib(t->dpy, config, EGL_NATIVE_VISUAL_ID,
+                                 &visual));
+    CHECK(visual == GBM_FORMAT_XRGB8888);
+
+    CHECK(t->egl.ChooseConfig(t->dpy, attribs, NULL, 0, &numConfigs));
+    CHECK(numConfigs == 0);
+}
+
+/* Offscreen surfaces hand their frames out as gbm_bos, like windows do */
+static void
+TestOffscreen(TestDisplay* t)
+{
+    const StubEglCounts* counts = StubEglGetCounts();
+    EGLConfig config = TestChooseWindowConfig(t, GBM_FORMAT_XRGB8888);
+    struct gbm_surface* unused = NULL;
+    TestWindow w;
+    struct gbm_bo* bo;
+
+    w.surf = eGbmCreateOffscreenSurface(t->dpy, config, WIDTH, HEIGHT,
+                                        GBM_FORMAT_XRGB8888, NULL,
+                                        &w.gbmSurf);
+    CHECK(w.surf != EGL_NO_SURFACE);
+    CHECK(counts->streams == 1);
+
+    SwapFrame(t, &w, 1, true);
+    CHECK((bo = gbm_surface_lock_front_buffer(w.gbmSurf)));
+    CHECK(TestGetFrame(bo) == 1);
+    CHECK(gbm_bo_get_width(bo) == WIDTH && gbm_bo_get_height(bo) == HEIGHT);
+    gbm_surface_release_buffer(w.gbmSurf, bo);
+
+    /* The gbm_surface is destroyed along with the EGLSurface */
+    CHECK(t->egl.DestroySurface(t->dpy, w.surf));
+
+    CHECK(eGbmCreateOffscreenSurface(t->dpy, config, 0, HEIGHT,
+                                     GBM_FORMAT_XRGB8888, NULL,
+                                     &unused) == EGL_NO_SURFACE);
+    CHECK(StubEglTakeError() == EGL_BAD_PARAMETER);
+    CHECK(!unused);
+}
+
+/*
+ * GBM devices of other drivers are refused even when rendering on a selected
+ * device, since window surfaces would need their surface functions
+ */
+static void
+TestForeignDevice(void)
+{
+    EGLExtPlatform platform;
+    struct gbm_device* gbm;
+    EGLDisplay dpy;
+    int numFds = TestCountFds();
+
+    CHECK(StubEglLoadPlatform(&platform));
+    CHECK((gbm = StubGbmCreateDevice()));
+    setenv("EGL_GBM_RENDER_DEVICE", STUB_DRM_DEVICE_FILE, 1);
+
+    dpy = platform.exports.getPlatformDisplay(platform.data,
+                                              EGL_PLATFORM_GBM_KHR,
+                                              gbm, NULL);
+    CHECK(dpy != EGL_NO_DISPLAY);
+    CHECK(eGbmDestroyHandle(dpy));
+
+    gbm->v0.name = "mesa";
+    dpy = platform.exports.getPlatformDisplay(platform.data,
+                                              EGL_PLATFORM_GBM_KHR,
+                                              gbm, NULL);
+    CHECK(dpy == EGL_NO_DISPLAY);
+
+    unsetenv("EGL_GBM_RENDER_DEVICE");
+    CHECK(platform.exports.unloadEGLExternalPlatform(platform.data));
+    StubGbmDestroyDevice(gbm);
+    CHECK(TestCountFds() == numFds);
+}
+
+int
+main(void)
+{
+    TestRunWithDisplay(TestFifo);
+    TestRunWithDisplay(TestMailbox);
+    TestRunWithDisplay(TestChurn);
+    TestRunWithDisplay(TestChurnMailbox);
+    TestRunWithDisplay(TestFullDamage);
+    TestRunWithDisplay(TestLongRunFifo);
+    TestRunWithDisplay(TestLongRunMailbox);
+    TestRunWithDisplay(TestFenceFd);
+    TestRunWithDisplay(TestFenceFdFallback);
+    TestRunWithDisplay(TestSyncLatency);
+    TestRunWithDisplay(TestPool);
+    TestRunWithDisplay(TestDefaultMode);
+    TestRunWithDisplay(TestBufferAge);
+    TestRunWithDisplay(TestNativeVisual);
+    TestRunWithDisplay(TestOffscreen);
+    TestForeignDevice();
+
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "test-utils.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <drm_fourcc.h>
+
+int
+TestCountFds(void)
+{
+    DIR* dir = opendir("/proc/self/fd");
+    int n = 0;
+
+    CHECK(dir);
+
+    while (readdir(dir)) n++;
+
+    closedir(dir);
+
+    return n;
+}
+
+static void
+FreeTestObject(GbmObject* obj)
+{
+    ((TestObject*)obj)->numFrees++;
+}
+
+void
+TestInitObject(TestObject* obj)
+{
+    memset(obj, 0, sizeof(*obj));
+    obj->base.type = EGL_OBJECT_SURFACE_KHR;
+    obj->base.refCount = 1;
+    obj->base.free = FreeTestObject;
+}
+
+void
+TestOpenDisplay(TestDisplay* t)
+{
+    memset(t, 0, sizeof(*t));
+    t->numFds = TestCountFds();
+
+    CHECK(StubEglLoadPlatform(&t->platform));
+
+#define DO_HOOK(_PROTO, _FUNC) \
+    t->egl._FUNC = (_PROTO)t->platform.exports.getHookAddress( \
+        t->platform.data, "egl" #_FUNC); \
+    CHECK(t->egl._FUNC);
+#include "test-hooks.h"
+#undef DO_HOOK
+
+    CHECK((t->gbm = StubGbmCreateDevice()));
+    CHECK(t->platform.exports.isValidNativeDisplay(t->platform.data, t->gbm));
+
+    t->dpy = t->platform.exports.getPlatformDisplay(t->platform.data,
+                                                    EGL_PLATFORM_GBM_KHR,
+                                                    t->gbm,
+                                                    NULL);
+    CHECK(t->dpy != EGL_NO_DISPLAY);
+    CHECK(t->egl.Initialize(t->dpy, NULL, NULL));
+}
+
+void
+TestCloseDisplay(TestDisplay* t)
+{
+    const StubEglCounts* counts = StubEglGetCounts();
+
+    CHECK(t->egl.Terminate(t->dpy));
+
+    /* libEGL never frees displays, but the stub device is about to go away */
+    CHECK(eGbmDestroyHandle(t->dpy));
+    CHECK(t->platform.exports.unloadEGLExternalPlatform(t->platform.data));
+    StubGbmDestroyDevice(t->gbm);
+
+    CHECK(counts->streams == 0);
+    CHECK(counts->surfaces == 0);
+    CHECK(counts->syncs == 0);
+    CHECK(counts->streamImages == 0);
+    CHECK(counts->imports == 0);
+    CHECK(StubGbmGetNumBos() == 0);
+    CHECK(TestCountFds() == t->numFds);
+
+    memset(t, 0, sizeof(*t));
+}
+
+void
+TestRunWithDisplay(void (*test)(TestDisplay* t))
+{
+    TestDisplay t;
+
+    TestOpenDisplay(&t);
+    test(&t);
+    TestCloseDisplay(&t);
+}
+
+EGLConfig
+TestChooseWindowConfig(TestDisplay* t, uint32_t format)
+{
+    const EGLint attribs[] = {
+        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+        EGL_NATIVE_VISUAL_ID, (EGLint)format,
+        EGL_NONE
+    };
+    EGLConfig config = NULL;
+    EGLint numConfigs = 0;
+
+    CHECK(t->egl.ChooseConfig(t->dpy, attribs, &config, 1, &numConfigs));
+    CHECK(numConfigs == 1);
+
+    return config;
+}
+
+bool
+TestCreateWindow(TestDisplay* t,
+                 TestWindow* w,
+                 uint32_t width,
+                 uint32_t height,
+                 const EGLAttrib* attribs)
+{
+    EGLConfig config = TestChooseWindowConfig(t, DRM_FORMAT_XRGB8888);
+
+    w->gbmSurf = StubGbmCreateSurface(t->gbm, width, height,
+                                      DRM_FORMAT_XRGB8888,
+                                      GBM_BO_USE_SCANOUT |
+                                      GBM_BO_USE_RENDERING);
+    CHECK(w->gbmSurf);
+
+    w->surf = t->egl.CreatePlatformWindowSurface(t->dpy, config,
+                                                 w->gbmSurf, attribs);
+
+    if (w->surf == EGL_NO_SURFACE) {
+        StubGbmDestroySurface(w->gbmSurf);
+        w->gbmSurf = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+void
+TestDestroyWindow(TestDisplay* t, TestWindow* w)
+{
+    CHECK(t->egl.DestroySurface(t->dpy, w->surf));
+    StubGbmDestroySurface(w->gbmSurf);
+    w->gbmSurf = NULL;
+    w->surf = EGL_NO_SURFACE;
+}
+
+EGLSurface
+TestDriverSurface(TestDisplay* t, TestWindow* w)
+{
+    return t->platform.exports.getInternalHandle(t->dpy,
+                                                 EGL_OBJECT_SURFACE_KHR,
+                                                 w->surf);
+}
+
+uint32_t
+TestGetFrame(struct gbm_bo* bo)
+{
+    int fd = gbm_bo_get_fd_for_plane(bo, 0);
+    uint32_t frame = 0;
+
+    CHECK(fd >= 0);
+    CHECK(pread(fd, &frame, sizeof(frame), 0) == sizeof(frame));
+    close(fd);
+
+    return frame;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2021, NVIDIA CORPORATION. All rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef TEST_UTILS_H
+#define TEST_UTILS_H
+
+#include "egl-stub.h"
+#include "gbm-stub.h"
+#include "gbm-handle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                    __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+/* A display on a stub GBM device, with the platform loaded on the stub */
+typedef struct TestDisplayRec {
+    EGLExtPlatform platform;
+    struct gbm_device* gbm;
+    EGLDisplay dpy;
+    int numFds;
+
+    struct {
+#define DO_HOOK(_PROTO, _FUNC) \
+        _PROTO                              _FUNC;
+#include "test-hooks.h"
+#undef DO_HOOK
+    } egl;
+} TestDisplay;
+
+/* A handle table object whose free callback only counts how often it ran */
+typedef struct TestObjectRec {
+    GbmObject base;
+    int numFrees;
+} TestObject;
+
+typedef struct TestWindowRec {
+    struct gbm_surface* gbmSurf;
+    EGLSurface surf;
+} TestWindow;
+
+/* Returns the number of file descriptors the process has open */
+int TestCountFds(void);
+
+/* Initializes <obj> with one reference, without adding it to the table */
+void TestInitObject(TestObject* obj);
+
+void TestOpenDisplay(TestDisplay* t);
+
+/*
+ * Terminates and frees the display, then checks that nothing the stubs
+ * allocated for it, and no file descriptor, was leaked.
+ */
+void TestCloseDisplay(TestDisplay* t);
+
+/* Runs <test> on a display of its own, which starts without cached state */
+void TestRunWithDisplay(void (*test)(TestDisplay* t));
+
+/* Returns a config for window surfaces with the native visual <format> */
+EGLConfig TestChooseWindowConfig(TestDisplay* t, uint32_t format);
+
+/*
+ * Creates a gbm_surface and an EGLSurface for it. Returns false if the
+ * EGLSurface couldn't be created.
+ */
+bool TestCreateWindow(TestDisplay* t,
+                      TestWindow* w,
+                      uint32_t width,
+                      uint32_t height,
+                      const EGLAttrib* attribs);
+void TestDestroyWindow(TestDisplay* t, TestWindow* w);
+
+/*
+ * Returns the stub's producer surface for <w>, as the driver would look it up
+ * when making the surface current.
+ */
+EGLSurface TestDriverSurface(TestDisplay* t, TestWindow* w);
+
+/* Returns the number of the frame the stub driver rendered into <bo> */
+uint32_t TestGetFrame(struct gbm_bo* bo);
+
+#endif /* TEST_UTILS_H */